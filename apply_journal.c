@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "loki_patch.h"
+#include "apply_journal.h"
+#include "log_output.h"
+
+#define JOURNAL_NAME    ".loki_patch.journal"
+#define JOURNAL_MAGIC   "LOKI_PATCH_JOURNAL 1"
+
+/* The new file for an operation, as a previous run left it */
+struct journal_entry {
+    patch_op op;
+    char *path;
+    int seq;                    /* The order it was recorded in */
+    int state;
+    char sum[CHECKSUM_SIZE+1];
+    unsigned long long ino;
+    unsigned long long size;
+    long long mtime;
+    long long mtime_nsec;
+};
+
+static char journal_path[PATH_MAX];
+static int journal_fd = -1;
+static int journal_used;        /* There's something in it to resume */
+static struct journal_entry *journal_entries;
+static int num_entries;
+
+static const char *op_name(patch_op op)
+{
+    return((op == OP_PATCH_FILE) ? "PATCH" : "ADD");
+}
+
+static void install_path(char *path, const char *dst, const char *file)
+{
+    if ( *file == '/' ) {
+        strcpy(path, file);
+    } else {
+        sprintf(path, "%s/%s", dst, file);
+    }
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    const struct journal_entry *A = (const struct journal_entry *)a;
+    const struct journal_entry *B = (const struct journal_entry *)b;
+
+    if ( A->op != B->op ) {
+        return (A->op < B->op) ? -1 : 1;
+    }
+    return strcmp(A->path, B->path);
+}
+
+/* Entries are sorted by operation and path, and then by when they were
+   recorded */
+static int compare_entries(const void *a, const void *b)
+{
+    int cmp;
+
+    cmp = compare_paths(a, b);
+    if ( cmp == 0 ) {
+        cmp = ((const struct journal_entry *)a)->seq -
+              ((const struct journal_entry *)b)->seq;
+    }
+    return(cmp);
+}
+
+static void free_entries(void)
+{
+    int i;
+
+    for ( i=0; i<num_entries; ++i ) {
+        free(journal_entries[i].path);
+    }
+    free(journal_entries);
+    journal_entries = NULL;
+    num_entries = 0;
+}
+
+/* Write a record in one go, so that it's either all there or cut short */
+static int write_record(const char *record, int sync)
+{
+    int len;
+
+    if ( journal_fd < 0 ) {
+        return(0);
+    }
+    len = strlen(record);
+    if ( write(journal_fd, record, len) != len ) {
+        logme(LOG_ERROR, "Failed writing to %s\n", journal_path);
+        return(-1);
+    }
+    if ( sync ) {
+        fdatasync(journal_fd);
+    }
+    journal_used = 1;
+    return(0);
+}
+
+static int add_entry(struct journal_entry *entry, int *max)
+{
+    struct journal_entry *grown;
+
+    if ( num_entries == *max ) {
+        *max = *max ? *max*2 : 256;
+        grown = (struct journal_entry *)realloc(journal_entries,
+                                        *max * (sizeof *journal_entries));
+        if ( ! grown ) {
+            return(-1);
+        }
+        journal_entries = grown;
+    }
+    entry->seq = num_entries;
+    entry->path = strdup(entry->path);
+    if ( ! entry->path ) {
+        return(-1);
+    }
+    journal_entries[num_entries++] = *entry;
+    return(0);
+}
+
+static int add_removed_path(loki_patch *patch, const char *path)
+{
+    struct removed_path *newpath;
+
+    newpath = (struct removed_path *)malloc(sizeof *newpath);
+    if ( ! newpath ) {
+        return(-1);
+    }
+    newpath->path = strdup(path);
+    if ( ! newpath->path ) {
+        free(newpath);
+        return(-1);
+    }
+    newpath->next = patch->removed_paths;
+    patch->removed_paths = newpath;
+    return(0);
+}
+
+/* Read back the records of a previous run, keeping the last state of
+   each operation */
+static int load_journal(loki_patch *patch, FILE *fp)
+{
+    char line[2*PATH_MAX];
+    char name[16];
+    struct journal_entry entry;
+    int i, j, n, len, max, status;
+
+    status = 0;
+    max = 0;
+    for ( n=0; fgets(line, sizeof(line), fp); ++n ) {
+        len = strlen(line);
+        if ( (len == 0) || (line[len-1] != '\n') ) {
+            /* Cut short by a crash, nothing after it was written */
+            break;
+        }
+        line[len-1] = '\0';
+        if ( n < 3 ) {
+            if ( ((n == 0) && (strcmp(line, JOURNAL_MAGIC) != 0)) ||
+                 ((n == 1) && ((strncmp(line, "product ", 8) != 0) ||
+                               (strcmp(line+8, patch->product) != 0))) ||
+                 ((n == 2) && ((strncmp(line, "version ", 8) != 0) ||
+                               (strcmp(line+8, patch->version) != 0))) ) {
+                logme(LOG_ERROR, "%s isn't a journal of this patch\n",
+                                                            journal_path);
+                return(-1);
+            }
+            continue;
+        }
+        memset(&entry, 0, (sizeof entry));
+        if ( strncmp(line, "removed ", 8) == 0 ) {
+            status = add_removed_path(patch, line+8);
+        } else
+        if ( (sscanf(line, "staged %15s %32s %llu %llu %lld.%lld %n",
+                     name, entry.sum, &entry.ino, &entry.size,
+                     &entry.mtime, &entry.mtime_nsec, &len) == 6) &&
+             line[len] ) {
+            entry.op = (strcmp(name, "PATCH") == 0) ?
+                                        OP_PATCH_FILE : OP_ADD_FILE;
+            entry.state = JOURNAL_STAGED;
+            entry.path = line+len;
+            status = add_entry(&entry, &max);
+        } else
+        if ( (sscanf(line, "done %15s %n", name, &len) == 1) && line[len] ) {
+            entry.op = (strcmp(name, "PATCH") == 0) ?
+                                        OP_PATCH_FILE : OP_ADD_FILE;
+            entry.state = JOURNAL_DONE;
+            entry.path = line+len;
+            status = add_entry(&entry, &max);
+        }
+        if ( status < 0 ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+    }
+
+    /* A file is known by what it was staged as, and then renamed */
+    qsort(journal_entries, num_entries, sizeof *journal_entries,
+          compare_entries);
+    for ( i=0, j=0; i<num_entries; ++i ) {
+        if ( (j > 0) &&
+             (journal_entries[j-1].op == journal_entries[i].op) &&
+             (strcmp(journal_entries[j-1].path,
+                     journal_entries[i].path) == 0) ) {
+            if ( journal_entries[i].state == JOURNAL_DONE ) {
+                journal_entries[j-1].state = JOURNAL_DONE;
+            } else {
+                free(journal_entries[j-1].path);
+                journal_entries[j-1] = journal_entries[i];
+                continue;
+            }
+            free(journal_entries[i].path);
+            continue;
+        }
+        if ( journal_entries[i].state == JOURNAL_DONE ) {
+            /* Renamed without being made, there's nothing to go on */
+            free(journal_entries[i].path);
+            continue;
+        }
+        journal_entries[j++] = journal_entries[i];
+    }
+    num_entries = j;
+    return(0);
+}
+
+int journal_open(loki_patch *patch, const char *dst, int resume)
+{
+    char header[3*PATH_MAX];
+    FILE *fp;
+    int len;
+
+    sprintf(journal_path, "%s/%s", dst, JOURNAL_NAME);
+    fp = fopen(journal_path, "r");
+    if ( fp ) {
+        if ( ! resume ) {
+            logme(LOG_ERROR, "A previous patch of %s didn't finish, use --resume to carry on from where it left off\n", dst);
+            fclose(fp);
+            return(-1);
+        }
+        if ( load_journal(patch, fp) < 0 ) {
+            fclose(fp);
+            free_entries();
+            return(-1);
+        }
+        fclose(fp);
+        journal_fd = open(journal_path, O_WRONLY|O_APPEND);
+        if ( journal_fd < 0 ) {
+            logme(LOG_ERROR, "Unable to write to %s\n", journal_path);
+            free_entries();
+            return(-1);
+        }
+        logme(LOG_VERBOSE, "Resuming the patch, %d files already made\n",
+                                                                num_entries);
+        journal_used = 1;
+        return(0);
+    }
+    if ( resume ) {
+        logme(LOG_WARNING, "Nothing to resume, starting from the beginning\n");
+    }
+
+    journal_fd = open(journal_path, O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0600);
+    if ( journal_fd < 0 ) {
+        logme(LOG_ERROR, "Unable to create %s\n", journal_path);
+        return(-1);
+    }
+    len = snprintf(header, sizeof(header), "%s\nproduct %s\nversion %s\n",
+                   JOURNAL_MAGIC, patch->product, patch->version);
+    if ( (len >= sizeof(header)) || (write_record(header, 1) < 0) ) {
+        journal_close(1);
+        return(-1);
+    }
+    journal_used = 0;
+    return(0);
+}
+
+static int same_file(const char *path, const struct journal_entry *entry)
+{
+    struct stat sb;
+
+    return((stat(path, &sb) == 0) &&
+           (sb.st_ino == entry->ino) && (sb.st_size == entry->size) &&
+           (sb.st_mtim.tv_sec == entry->mtime) &&
+           (sb.st_mtim.tv_nsec == entry->mtime_nsec));
+}
+
+int journal_state(patch_op op, const char *path, const char *dst, char *sum)
+{
+    char new_path[PATH_MAX];
+    char out_path[PATH_MAX];
+    struct journal_entry key, *entry;
+
+    if ( num_entries == 0 ) {
+        return(JOURNAL_NONE);
+    }
+    key.op = op;
+    key.path = (char *)path;
+    entry = (struct journal_entry *)bsearch(&key, journal_entries,
+                    num_entries, sizeof *journal_entries, compare_paths);
+    if ( ! entry ) {
+        return(JOURNAL_NONE);
+    }
+
+    /* Make sure the file is still the one that was made, wherever the
+       run got to, even if the record of renaming it didn't get written */
+    install_path(new_path, dst, path);
+    sprintf(out_path, "%s.new", new_path);
+    strcpy(sum, entry->sum);
+    if ( same_file(new_path, entry) ) {
+        return(JOURNAL_DONE);
+    }
+    if ( same_file(out_path, entry) ) {
+        return(JOURNAL_STAGED);
+    }
+    return(JOURNAL_NONE);
+}
+
+void journal_staged(patch_op op, const char *path, const char *dst,
+                    const char *sum)
+{
+    char out_path[PATH_MAX];
+    char record[2*PATH_MAX];
+    struct stat sb;
+    int fd;
+
+    if ( journal_fd < 0 ) {
+        return;
+    }
+
+    /* The file has to be on disk before the record says it's made */
+    install_path(out_path, dst, path);
+    strcat(out_path, ".new");
+    fd = open(out_path, O_RDONLY);
+    if ( fd < 0 ) {
+        return;
+    }
+    if ( (fsync(fd) < 0) || (fstat(fd, &sb) < 0) ) {
+        close(fd);
+        return;
+    }
+    close(fd);
+    if ( snprintf(record, sizeof(record),
+                  "staged %s %s %llu %llu %lld.%09lld %s\n",
+                  op_name(op), sum,
+                  (unsigned long long)sb.st_ino,
+                  (unsigned long long)sb.st_size,
+                  (long long)sb.st_mtim.tv_sec,
+                  (long long)sb.st_mtim.tv_nsec, path) < sizeof(record) ) {
+        write_record(record, 1);
+    }
+}
+
+void journal_done(patch_op op, const char *path)
+{
+    char record[2*PATH_MAX];
+
+    if ( snprintf(record, sizeof(record), "done %s %s\n",
+                  op_name(op), path) < sizeof(record) ) {
+        write_record(record, 0);
+    }
+}
+
+void journal_removed(const char *path)
+{
+    char record[2*PATH_MAX];
+
+    if ( snprintf(record, sizeof(record), "removed %s\n",
+                  path) < sizeof(record) ) {
+        write_record(record, 0);
+    }
+}
+
+void journal_close(int finished)
+{
+    if ( journal_fd >= 0 ) {
+        close(journal_fd);
+        journal_fd = -1;
+        if ( finished || !journal_used ) {
+            unlink(journal_path);
+        }
+    }
+    free_entries();
+}
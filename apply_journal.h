@@ -0,0 +1,40 @@
+
+/* A journal of how far a patch has got with an install, kept in the
+   install itself, so that a patch which was interrupted can carry on
+   from where it left off rather than starting again.
+
+   Each new file is recorded once it has been made, with its checksum
+   and enough about it to know it again, and once it has been renamed
+   into place.  The files removed are recorded so they can still be
+   taken out of the registry.  Records are only ever appended, and a
+   record cut short by a crash is ignored.
+ */
+
+/* How far a previous run got with the new file for a path */
+#define JOURNAL_NONE    0
+#define JOURNAL_STAGED  1       /* The new file is made, next to the old */
+#define JOURNAL_DONE    2       /* The new file is renamed into place */
+
+/* Start the journal for patching 'dst', or pick up an existing one if
+   resuming, in which case the removed paths it lists are added back */
+extern int journal_open(loki_patch *patch, const char *dst, int resume);
+
+/* See how far a previous run got with the new file for an operation,
+   filling in its checksum if it got anywhere */
+extern int journal_state(patch_op op, const char *path, const char *dst,
+                         char *sum);
+
+/* Record that the new file for an operation has been made, once it's
+   safely on disk */
+extern void journal_staged(patch_op op, const char *path, const char *dst,
+                           const char *sum);
+
+/* Record that the new file for an operation has been renamed into place */
+extern void journal_done(patch_op op, const char *path);
+
+/* Record that a path has been removed from the install */
+extern void journal_removed(const char *path);
+
+/* Close the journal, removing it if the patch is finished, or if nothing
+   has been recorded in it, so there's nothing to resume */
+extern void journal_close(int finished);
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
@@ -18,7 +19,10 @@
 #include "loki_xdelta.h"
 #include "mkdirhier.h"
 #include "md5.h"
+#include "md5_cache.h"
 #include "arch.h"
+#include "job_pool.h"
+#include "apply_journal.h"
 #include "log_output.h"
 
 static void assemble_path(char *dest, const char *base, const char *path)
@@ -71,11 +75,12 @@ static int apply_add_file(const char *base,
     int len;
     char data[4096];
     char csum[CHECKSUM_SIZE+1];
+    struct loki_md5 *md5;
 
     logme(LOG_VERBOSE, "-> ADD FILE %s\n", op->dst);
 
     /* Open the source and destination files */
-    sprintf(src_path, "%s/%s", base, op->dst);
+    sprintf(src_path, "%s/%s", base, op->src);
     src_zfp = gzopen(src_path, "rb");
     if ( src_zfp == NULL ) {
         logme(LOG_ERROR, "Unable to open %s\n", src_path);
@@ -100,26 +105,42 @@ static int apply_add_file(const char *base,
         fchmod(dst_fd, (op->mode&01777)|0200);
     }
 
-    /* Copy the data */
+    /* Copy the data, checksumming it on the way through */
+    md5 = loki_md5_begin();
+    if ( ! md5 ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        close(dst_fd);
+        gzclose(src_zfp);
+        return(-1);
+    }
     disk_done *= 1024;
     while ( (len=gzread(src_zfp, data, sizeof(data))) > 0 ) {
         if ( write(dst_fd, data, len) != len ) {
             logme(LOG_ERROR, "Failed writing to %s\n", dst_path);
+            loki_md5_end(md5, csum);
+            close(dst_fd);
+            gzclose(src_zfp);
             return(-1);
         }
+        loki_md5_update(md5, data, len);
         disk_done += len;
-        logme(LOG_NORMAL, " %0.0f%%%c",
-            ((((float)disk_done)/1024.0)/disk_used)*100.0,
-            get_logging() <= LOG_VERBOSE ? '\n' : '\r');
+        if ( disk_used ) {
+            logme(LOG_NORMAL, " %0.0f%%%c",
+                ((((float)disk_done)/1024.0)/disk_used)*100.0,
+                get_logging() <= LOG_VERBOSE ? '\n' : '\r');
+        }
     }
     gzclose(src_zfp);
+    loki_md5_end(md5, csum);
     if ( close(dst_fd) < 0 ) {
         logme(LOG_ERROR, "Failed writing to %s\n", dst_path);
         return(-1);
     }
+    if ( ! *csum ) {
+        md5_compute(dst_path, csum, 1);
+    }
 
-    /* Verify the checksum */
-    md5_compute(dst_path, csum, 1);
+    /* Verify the checksum of the data that was written */
     if ( strcmp(op->sum, csum) != 0 ) {
         logme(LOG_ERROR, "Failed checksum: %s\n", dst_path);
         return(-1);
@@ -129,6 +150,48 @@ static int apply_add_file(const char *base,
     return(0);
 }
 
+/* Uncompress a new file stored whole in place of a delta */
+static int unpack_whole(const char *src_path, const char *path, char *csum)
+{
+    gzFile src_zfp;
+    int dst_fd;
+    int len;
+    char data[4096];
+    struct loki_md5 *md5;
+
+    src_zfp = gzopen(src_path, "rb");
+    if ( src_zfp == NULL ) {
+        logme(LOG_ERROR, "Unable to open %s\n", src_path);
+        return(-1);
+    }
+    dst_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if ( dst_fd < 0 ) {
+        logme(LOG_ERROR, "Unable to open %s\n", path);
+        gzclose(src_zfp);
+        return(-1);
+    }
+    md5 = loki_md5_begin();
+    if ( ! md5 ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        close(dst_fd);
+        gzclose(src_zfp);
+        return(-1);
+    }
+    while ( (len=gzread(src_zfp, data, sizeof(data))) > 0 ) {
+        if ( write(dst_fd, data, len) != len ) {
+            break;
+        }
+        loki_md5_update(md5, data, len);
+    }
+    gzclose(src_zfp);
+    loki_md5_end(md5, csum);
+    if ( (close(dst_fd) < 0) || (len != 0) ) {
+        logme(LOG_ERROR, "Failed writing to %s\n", path);
+        return(-1);
+    }
+    return(0);
+}
+
 static int apply_symlink_file(const char *base,
                           struct op_symlink_file *op, const char *dst)
 {
@@ -152,45 +215,133 @@ static int apply_symlink_file(const char *base,
     return(retval);
 }
 
+/* Open a file a delta may apply to, and see if it's at a version the
+   patch knows about.  This returns 1 and the opened file if a delta
+   applies, 0 if the file is already patched, -1 if neither, or -2 if
+   the file couldn't be read.
+ */
+static int find_delta(struct op_patch_file *op, const char *path,
+                      const char *from, struct loki_xsource **old,
+                      struct delta_option **found)
+{
+    struct delta_option *delta;
+    char csum[CHECKSUM_SIZE+1];
+    time_t since;
+
+    /* A file with multi-part deltas may be too large to map, so it's
+       only checksummed here, and read a segment at a time later */
+    for ( delta=op->options; delta; delta=delta->next ) {
+        if ( delta->segment ) {
+            break;
+        }
+    }
+    if ( delta ) {
+        *old = NULL;
+        if ( access(path, R_OK) < 0 ) {
+            logme(LOG_ERROR, "Unable to read %s\n", path);
+            return(-2);
+        }
+        md5_cache_compute(path, csum);
+    } else
+    if ( md5_cache_find(path, csum) ) {
+        /* The file is only read if there's a delta to apply to it */
+        *old = NULL;
+    } else {
+        since = time(NULL);
+        *old = loki_xsource_open(path, csum);
+        if ( ! *old ) {
+            logme(LOG_ERROR, "Unable to read %s\n", path);
+            return(-2);
+        }
+        md5_cache_store(path, csum, since);
+    }
+    for ( delta=op->options; delta; delta=delta->next ) {
+        if ( (from ? (delta->from && strcmp(delta->from, from) == 0)
+                   : !delta->from) &&
+             (strcmp(delta->oldsum, csum) == 0) ) {
+            /* Whew!  Found it! */
+            *found = delta;
+            return(1);
+        }
+    }
+
+    /* Chained deltas make old versions along the way, so a file is only
+       patched already if no delta starts from it */
+    for ( delta=op->options; delta; delta=delta->next ) {
+        if ( !from && (strcmp(delta->newsum, csum) == 0) ) {
+            /* Patch should already be applied previously */
+            loki_xsource_close(*old);
+            *old = NULL;
+            return(0);
+        }
+    }
+    loki_xsource_close(*old);
+    *old = NULL;
+    return(-1);
+}
+
 static int apply_patch_file(const char *base,
                             struct op_patch_file *op, const char *dst)
 {
     char src_path[PATH_MAX];
     char dst_path[PATH_MAX];
+    char old_path[PATH_MAX];
     char out_path[PATH_MAX];
+    char step_path[PATH_MAX];
+    char last_path[PATH_MAX];
+    char cur_path[PATH_MAX];
     struct stat sb;
-    struct delta_option *delta;
+    struct delta_option *delta, *from, *next;
+    struct loki_xsource *old;
     char csum[CHECKSUM_SIZE+1];
+    unsigned int hits, misses, evictions;
+    int retval, exists, steps;
 
     logme(LOG_VERBOSE, "-> PATCH FILE %s\n", op->dst);
 
-    /* Make sure the destination file exists */
-    if ( *op->dst == '/' ) {
-        strcpy(dst_path, op->dst);
-    } else {
-        sprintf(dst_path, "%s/%s", dst, op->dst);
+    /* Make sure the destination file exists, unless the delta can
+       be applied to another file instead */
+    assemble_path(dst_path, dst, op->dst);
+    exists = (stat(dst_path, &sb) == 0);
+    for ( from=op->options; from; from=from->next ) {
+        if ( from->from ) {
+            break;
+        }
     }
-    if ( stat(dst_path, &sb) < 0 ) {
+    if ( !exists && !from ) {
         if ( op->optional )  {
             return(0);
         }
         logme(LOG_ERROR, "Can't find %s\n", dst_path);
         return(-1);
     }
-    md5_compute(dst_path, csum, 1);
 
-    /* See if we can find a corresponding delta */
-    for ( delta=op->options; delta; delta=delta->next ) {
-        if ( strcmp(delta->oldsum, csum) == 0 ) {
-            /* Whew!  Found it! */
-            break;
+    /* See if we can find a corresponding delta, for the file itself
+       first and then for the files it may have been copied from */
+    old = NULL;
+    delta = NULL;
+    retval = -1;
+    if ( exists ) {
+        retval = find_delta(op, dst_path, NULL, &old, &delta);
+        if ( retval == -2 ) {
+            return(-1);
         }
-        if ( strcmp(delta->newsum, csum) == 0 ) {
-            /* Patch should already be applied previously */
+        if ( retval == 0 ) {
             logme(LOG_WARNING, "Current patch seems already applied to %s. Skipping.\n", dst_path);
             return(0);
         }
     }
+    for ( ; (retval < 0) && from; from=from->next ) {
+        if ( from->from ) {
+            assemble_path(old_path, dst, from->from);
+            if ( stat(old_path, &sb) == 0 ) {
+                retval = find_delta(op, old_path, from->from, &old, &delta);
+                if ( retval == -2 ) {
+                    return(-1);
+                }
+            }
+        }
+    }
     if ( ! delta ) {
         if ( op->optional )  {
             logme(LOG_WARNING, "No matching delta for %s\n", dst_path);
@@ -201,26 +352,112 @@ static int apply_patch_file(const char *base,
             return(-1);
         }
     }
-
-    /* Apply the given delta */
-    sprintf(src_path, "%s/%s", base, delta->src);
-    if ( stat(src_path, &sb) < 0 ) {
-        logme(LOG_ERROR, "Can't find %s\n", src_path);
-        return(-1);
-    }
+    strcpy(cur_path, delta->from ? old_path : dst_path);
     sprintf(out_path, "%s.new", dst_path);
-    if ( loki_xpatch(src_path, dst_path, out_path) < 0 ) {
-        logme(LOG_ERROR, "Failed patch delta on %s\n", dst_path);
-        return(-1);
+    if ( delta->from ) {
+        /* The file may be moving to a directory that isn't there yet */
+        logme(LOG_VERBOSE, "-> PATCH FILE %s from %s\n", op->dst, delta->from);
+        if ( mkdirhier(out_path) < 0 ) {
+            loki_xsource_close(old);
+            return(-1);
+        }
     }
-    chmod(out_path, (op->mode&01777)|0200);
 
-    /* Verify the checksum */
-    md5_compute(out_path, csum, 1);
-    if ( strcmp(delta->newsum, csum) != 0 ) {
-        logme(LOG_ERROR, "Failed checksum: %s\n", dst_path);
+    /* Apply the given delta, and any chained on to it.  The versions
+       along the way are written next to the output, and removed as soon
+       as the next one has been made from them.
+     */
+    *step_path = '\0';
+    *last_path = '\0';
+    for ( steps=0; ; ++steps ) {
+        /* The deltas for the files copied from start a chain, but the
+           rest of it is made of deltas for this file */
+        for ( next=op->options; next; next=next->next ) {
+            if ( !next->from && (strcmp(next->oldsum, delta->newsum) == 0) ) {
+                break;
+            }
+        }
+        if ( next && (steps == MAX_DELTA_CHAIN) ) {
+            logme(LOG_ERROR, "Delta chain too long for %s\n", dst_path);
+            loki_xsource_close(old);
+            retval = -1;
+            break;
+        }
+        strcpy(last_path, step_path);
+        if ( next ) {
+            sprintf(step_path, "%s.%d", out_path, steps);
+        } else {
+            strcpy(step_path, out_path);
+        }
+
+        sprintf(src_path, "%s/%s", base, delta->src);
+        if ( stat(src_path, &sb) < 0 ) {
+            logme(LOG_ERROR, "Can't find %s\n", src_path);
+            loki_xsource_close(old);
+            retval = -1;
+            break;
+        }
+        if ( delta->whole ) {
+            /* The new file didn't make a delta worth having */
+            loki_xsource_close(old);
+            old = NULL;
+            retval = unpack_whole(src_path, step_path, csum);
+        } else
+        if ( delta->segment ) {
+            /* Multi-part deltas read the old file a segment at a time */
+            loki_xsource_close(old);
+            old = NULL;
+            retval = loki_xpatch_segments(src_path, cur_path, step_path, csum);
+        } else {
+            if ( ! old ) {
+                old = loki_xsource_open(cur_path, csum);
+                if ( ! old ) {
+                    logme(LOG_ERROR, "Unable to read %s\n", cur_path);
+                    retval = -1;
+                    break;
+                }
+            }
+            retval = loki_xpatch_source(src_path, old, step_path, csum);
+            loki_xsource_close(old);
+            old = NULL;
+        }
+        if ( *last_path ) {
+            unlink(last_path);
+            *last_path = '\0';
+        }
+        if ( retval < 0 ) {
+            logme(LOG_ERROR, "Failed patch delta on %s\n", dst_path);
+            break;
+        }
+        loki_xdelta_stats(&hits, &misses, &evictions);
+        logme(LOG_DEBUG, "Patch of %s: %u page hits, %u misses, %u evictions\n",
+                                        dst_path, hits, misses, evictions);
+
+        /* Verify the checksum, if it wasn't taken while patching */
+        if ( ! *csum ) {
+            md5_compute(step_path, csum, 1);
+        }
+        if ( strcmp(delta->newsum, csum) != 0 ) {
+            logme(LOG_ERROR, "Failed checksum: %s\n", dst_path);
+            retval = -1;
+            break;
+        }
+        if ( ! next ) {
+            break;
+        }
+        strcpy(cur_path, step_path);
+        delta = next;
+    }
+    if ( retval < 0 ) {
+        if ( *last_path ) {
+            unlink(last_path);
+        }
+        if ( strcmp(step_path, out_path) != 0 ) {
+            unlink(step_path);
+        }
         return(-1);
     }
+    chmod(out_path, (op->mode&01777)|0200);
     logme(LOG_NORMAL, "Patch successful for %s\n", dst_path);
     op->performed = 1;
     delta->installed = 1;
@@ -232,8 +469,14 @@ static int rename_add_file(struct op_add_file *op, const char *dst)
 {
     char o_path[PATH_MAX];
     char n_path[PATH_MAX];
+    char sum[CHECKSUM_SIZE+1];
     int retval;
 
+    /* A previous run may have got this far */
+    if ( journal_state(OP_ADD_FILE, op->dst, dst, sum) == JOURNAL_DONE ) {
+        return(0);
+    }
+
     /* Rename the added file into place */
     if ( *op->dst == '/' ) {
         sprintf(o_path, "%s.new", op->dst);
@@ -245,6 +488,8 @@ static int rename_add_file(struct op_add_file *op, const char *dst)
     retval = rename(o_path, n_path);
     if ( retval < 0 ) {
         logme(LOG_ERROR, "Unable to rename file: %s -> %s\n", o_path, n_path);
+    } else {
+        journal_done(OP_ADD_FILE, op->dst);
     }
     return(retval);
 }
@@ -253,8 +498,14 @@ static int rename_patch_file(struct op_patch_file *op, const char *dst)
 {
     char o_path[PATH_MAX];
     char n_path[PATH_MAX];
+    char sum[CHECKSUM_SIZE+1];
     int retval;
 
+    /* A previous run may have got this far */
+    if ( journal_state(OP_PATCH_FILE, op->dst, dst, sum) == JOURNAL_DONE ) {
+        return(0);
+    }
+
     /* Rename the patched file */
     if ( *op->dst == '/' ) {
         sprintf(o_path, "%s.new", op->dst);
@@ -266,10 +517,202 @@ static int rename_patch_file(struct op_patch_file *op, const char *dst)
     retval = rename(o_path, n_path);
     if ( retval < 0 ) {
         logme(LOG_ERROR, "Unable to rename file: %s -> %s\n", o_path, n_path);
+    } else {
+        journal_done(OP_PATCH_FILE, op->dst);
+    }
+    return(retval);
+}
+
+/* The number of worker processes used to add and patch files */
+static int apply_jobs = 1;
+
+void set_apply_jobs(int jobs)
+{
+    if ( jobs < 1 ) {
+        jobs = 1;
+    }
+    apply_jobs = jobs;
+}
+
+/* State shared by the add and patch file jobs */
+struct apply_state {
+    loki_patch *patch;
+    const char *dst;
+    int unsafe;
+    int jobs;
+    size_t disk_done;
+    size_t disk_used;
+    int count;
+    void **ops;
+};
+
+/* What a job needs to pass back to update the in-memory patch */
+struct apply_result {
+    int performed;
+    int installed;      /* Index of the delta option that was applied */
+    int resumed;        /* The new file was made by an earlier run */
+};
+
+static void update_progress(struct apply_state *state, long size)
+{
+    state->disk_done += (size + 1023)/1024;
+    if ( state->disk_done ) {
+        logme(LOG_NORMAL," %0.0f%%%c",
+            ((float)state->disk_done/state->disk_used)*100.0,
+            get_logging() <= LOG_VERBOSE ? '\n' : '\r');
+    }
+}
+
+/* See if an earlier run made the new file for a patched file already,
+   returning the delta it was made with */
+static struct delta_option *made_patch_file(struct op_patch_file *op,
+                                            const char *dst)
+{
+    struct delta_option *delta;
+    char sum[CHECKSUM_SIZE+1];
+
+    delta = NULL;
+    if ( journal_state(OP_PATCH_FILE, op->dst, dst, sum) ) {
+        for ( delta=op->options; delta; delta=delta->next ) {
+            if ( strcmp(delta->newsum, sum) == 0 ) {
+                break;
+            }
+        }
+    }
+    return(delta);
+}
+
+/* See if an earlier run made an added file already */
+static int made_add_file(struct op_add_file *op, const char *dst)
+{
+    char sum[CHECKSUM_SIZE+1];
+
+    return(journal_state(OP_ADD_FILE, op->dst, dst, sum) &&
+           (strcmp(op->sum, sum) == 0));
+}
+
+static int patch_file_job(int job, void *data, void *result)
+{
+    struct apply_state *state = (struct apply_state *)data;
+    struct apply_result *res = (struct apply_result *)result;
+    struct op_patch_file *op = (struct op_patch_file *)state->ops[job];
+    struct delta_option *delta;
+    int retval;
+
+    /* See if an earlier run made the new file already */
+    op->performed = 0;
+    delta = made_patch_file(op, state->dst);
+    res->resumed = (delta != NULL);
+    if ( res->resumed ) {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s (already made)\n", op->dst);
+        op->performed = 1;
+        delta->installed = 1;
+        retval = 0;
+    } else {
+        retval = apply_patch_file(state->patch->base, op, state->dst);
+    }
+    res->performed = op->performed;
+    res->installed = -1;
+    if ( op->performed ) {
+        for ( delta=op->options; delta; delta=delta->next ) {
+            ++res->installed;
+            if ( delta->installed ) {
+                break;
+            }
+        }
     }
     return(retval);
 }
 
+static int patch_file_done(int job, int status, void *data, void *result)
+{
+    struct apply_state *state = (struct apply_state *)data;
+    struct apply_result *res = (struct apply_result *)result;
+    struct op_patch_file *op = (struct op_patch_file *)state->ops[job];
+    struct delta_option *delta;
+    int i;
+
+    /* The job may have run in another process, so copy back the results */
+    op->performed = res->performed;
+    if ( op->performed ) {
+        for ( i=0, delta=op->options; delta; ++i, delta=delta->next ) {
+            if ( i == res->installed ) {
+                delta->installed = 1;
+                if ( (status == 0) && !res->resumed ) {
+                    journal_staged(OP_PATCH_FILE, op->dst, state->dst,
+                                   delta->newsum);
+                }
+            }
+        }
+    }
+    if ( status < 0 ) {
+        if ( state->unsafe < 3 ) {
+            return(-1);
+        }
+    }
+    update_progress(state, op->size);
+    if ( state->unsafe && op->performed ) {
+        if ( rename_patch_file(op, state->dst) < 0 ) {
+            if ( state->unsafe < 3 ) {
+                return(-1);
+            }
+            op->performed = 0;
+        }
+    }
+    return(0);
+}
+
+static int add_file_job(int job, void *data, void *result)
+{
+    struct apply_state *state = (struct apply_state *)data;
+    struct apply_result *res = (struct apply_result *)result;
+    struct op_add_file *op = (struct op_add_file *)state->ops[job];
+    int retval;
+
+    /* See if an earlier run made the new file already */
+    op->performed = 0;
+    res->resumed = made_add_file(op, state->dst);
+    if ( res->resumed ) {
+        logme(LOG_VERBOSE, "-> ADD FILE %s (already made)\n", op->dst);
+        op->performed = 1;
+        retval = 0;
+    } else {
+        /* Per-chunk progress only makes sense when files go one at a time */
+        retval = apply_add_file(state->patch->base, op, state->dst,
+                                state->disk_done,
+                                (state->jobs > 1) ? 0 : state->disk_used);
+    }
+    res->performed = op->performed;
+    return(retval);
+}
+
+static int add_file_done(int job, int status, void *data, void *result)
+{
+    struct apply_state *state = (struct apply_state *)data;
+    struct apply_result *res = (struct apply_result *)result;
+    struct op_add_file *op = (struct op_add_file *)state->ops[job];
+
+    op->performed = res->performed;
+    if ( op->performed && (status == 0) && !res->resumed ) {
+        journal_staged(OP_ADD_FILE, op->dst, state->dst, op->sum);
+    }
+    if ( status < 0 ) {
+        if ( state->unsafe < 3 ) {
+            return(-1);
+        }
+    }
+    update_progress(state, op->size);
+    if ( state->unsafe && op->performed ) {
+        if ( rename_add_file(op, state->dst) < 0 ) {
+            if ( state->unsafe < 3 ) {
+                return(-1);
+            }
+            op->performed = 0;
+        }
+    }
+    return(0);
+}
+
 static void add_removed_path(const char *path,
                              const char *prefix, struct removed_path **paths)
 {
@@ -285,6 +728,7 @@ static void add_removed_path(const char *path,
         }
         newpath->path = strdup(path);
         if ( newpath->path ) {
+            journal_removed(newpath->path);
             newpath->next = *paths;
             *paths = newpath;
         } else {
@@ -435,12 +879,136 @@ static int chmod_directory(const char *path)
     return(0);
 }
 
+/* Whether to carry on from where an earlier run left off */
+static int apply_resume = 0;
+
+void set_apply_resume(int resume)
+{
+    apply_resume = resume;
+}
+
+/* The most disk space a safe patch may use at once, as well as what's
+   free, or 0 for just what's free */
+static size_t apply_disk_limit = 0;
+
+void set_apply_disk_limit(size_t limit)
+{
+    apply_disk_limit = limit;
+}
+
+static size_t apply_limit(const char *dst)
+{
+    size_t limit;
+
+    if ( ! dst ) {
+        return(apply_disk_limit);
+    }
+    limit = available_space(dst);
+    if ( apply_disk_limit && (apply_disk_limit < limit) ) {
+        limit = apply_disk_limit;
+    }
+    return(limit);
+}
+
+size_t apply_space(loki_patch *patch, const char *dst)
+{
+    return schedule_space(patch, dst, apply_limit(dst));
+}
+
+/* Remove the obsolete files, either those which have to stay until
+   everything else is in place or the rest of them, or all of them if
+   there are no sources given */
+static void apply_deletions(loki_patch *patch, const char *dst,
+                            struct delta_sources *sources, int late)
+{
+    { struct op_del_file *op;
+
+        for ( op = patch->del_file_list; op; op=op->next ) {
+            if ( sources &&
+                 (is_removed_late(patch, sources, op->dst, 0) != late) ) {
+                continue;
+            }
+            /* This is non-fatal */
+            apply_del_file(op, dst, &patch->removed_paths);
+        }
+    }
+    { struct op_del_path *op;
+
+        for ( op = patch->del_path_list; op; op=op->next ) {
+            if ( sources &&
+                 (is_removed_late(patch, sources, op->dst, 1) != late) ) {
+                continue;
+            }
+            /* This is non-fatal */
+            apply_del_path(op, dst, &patch->removed_paths);
+        }
+    }
+}
+
+/* Make the new files of one batch of a safe patch, and once they've all
+   been made, rename them into place */
+static int apply_batch(struct apply_state *state,
+                       struct patch_schedule *schedule, int batch)
+{
+    struct patch_step *step;
+    int i;
+
+    state->count = 0;
+    for ( i=0; i<schedule->count; ++i ) {
+        step = &schedule->steps[i];
+        if ( (step->batch == batch) && (step->type == OP_PATCH_FILE) ) {
+            state->ops[state->count++] = step->op;
+        }
+    }
+    if ( run_jobs(state->jobs, state->count, sizeof(struct apply_result),
+                  patch_file_job, patch_file_done, state) < 0 ) {
+        return(-1);
+    }
+    state->count = 0;
+    for ( i=0; i<schedule->count; ++i ) {
+        step = &schedule->steps[i];
+        if ( (step->batch == batch) && (step->type == OP_ADD_FILE) ) {
+            state->ops[state->count++] = step->op;
+        }
+    }
+    if ( run_jobs(state->jobs, state->count, sizeof(struct apply_result),
+                  add_file_job, add_file_done, state) < 0 ) {
+        return(-1);
+    }
+    for ( i=0; i<schedule->count; ++i ) {
+        step = &schedule->steps[i];
+        if ( step->batch != batch ) {
+            continue;
+        }
+        if ( step->type == OP_PATCH_FILE ) {
+            struct op_patch_file *op = (struct op_patch_file *)step->op;
+
+            if ( op->performed && (rename_patch_file(op, state->dst) < 0) ) {
+                return(-1);
+            }
+        } else {
+            struct op_add_file *op = (struct op_add_file *)step->op;
+
+            if ( op->performed && (rename_add_file(op, state->dst) < 0) ) {
+                return(-1);
+            }
+        }
+    }
+    return(0);
+}
+
 int apply_patch(loki_patch *patch, const char *dst)
 {
     int unsafe = 0;
     size_t disk_done;
     size_t disk_used;
     size_t disk_free;
+    size_t disk_needed;
+    struct apply_state state;
+    struct delta_sources sources;
+    struct patch_schedule schedule;
+    int batch;
+    int retval;
 
     /* First stage, check ownership and disk space requirements */
     chmod_directory(dst);
@@ -459,19 +1027,55 @@ int apply_patch(loki_patch *patch, const char *dst)
         }
     }
 
+    /* Keep a journal of the patch, so it can be resumed if interrupted */
+    if ( journal_open(patch, dst, apply_resume) < 0 ) {
+        return(-1);
+    }
+
+    /* The files an earlier run made already don't need any more space */
+    { struct op_add_file *op;
+
+        for ( op = patch->add_file_list; op; op=op->next ) {
+            op->performed = made_add_file(op, dst);
+        }
+    }
+    { struct op_patch_file *op;
+
+        for ( op = patch->patch_file_list; op; op=op->next ) {
+            op->performed = (made_patch_file(op, dst) != NULL);
+        }
+    }
+
+    /* A safe patch is split into batches if it doesn't fit all at once */
     disk_done = 0;
     disk_used = calculate_space(patch, unsafe);
     disk_free = available_space(dst);
-    if ( disk_used > disk_free ) {
+    disk_needed = disk_used;
+    memset(&schedule, 0, (sizeof schedule));
+    if ( ! unsafe ) {
+        if ( schedule_patch(patch, dst, apply_limit(dst), &schedule) < 0 ) {
+            journal_close(0);
+            return(-1);
+        }
+        disk_needed = schedule.peak;
+        if ( schedule.batches > 1 ) {
+            logme(LOG_VERBOSE,
+                  "Applying the patch in %d batches, %luK at most\n",
+                  schedule.batches, (unsigned long)disk_needed);
+        }
+    }
+    if ( disk_needed > disk_free ) {
         if ( unsafe < 2 ) {
             logme(LOG_ERROR,
             "Not enough diskspace available, %uMB needed, %uMB free\n",
-                    (disk_used+1023)/1024, disk_free/1024);
+                    (disk_needed+1023)/1024, disk_free/1024);
+            free_schedule(&schedule);
+            journal_close(0);
             return(-1);
         } else {
             logme(LOG_WARNING,
             "Not enough diskspace available, %uMB needed, %uMB free\n",
-                    (disk_used+1023)/1024, disk_free/1024);
+                    (disk_needed+1023)/1024, disk_free/1024);
         }
     }
 
@@ -509,137 +1113,214 @@ int apply_patch(loki_patch *patch, const char *dst)
     if ( patch->prepatch ) {
         if ( system(patch->prepatch) != 0 ) {
             logme(LOG_ERROR, "Prepatch script returned non-zero status - Aborting\n");
+            free_schedule(&schedule);
+            journal_close(0);
             return(-1);
         }
     }
 
     /* Fire it up! */
     logme(LOG_NORMAL, " 0%%%c", get_logging() <= LOG_VERBOSE ? '\n' : '\r');
+    state.patch = patch;
+    state.dst = dst;
+    state.unsafe = unsafe;
+    /* Unsafe mode only has room for one new file at a time */
+    state.jobs = unsafe ? 1 : apply_jobs;
+    state.disk_done = disk_done;
+    state.disk_used = disk_used;
+
+    if ( ! unsafe ) {
+        /* Third stage, make the new files a batch at a time, renaming
+           each batch into place once all of it has been made.  The
+           obsolete files are removed at the end, unless their space is
+           needed sooner, but the files which deltas are applied to are
+           always kept until then.
+         */
+        state.ops = (void **)malloc((schedule.count+1) * (sizeof *state.ops));
+        if ( ! state.ops ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            free_schedule(&schedule);
+            journal_close(0);
+            return(-1);
+        }
+        retval = 0;
+        { struct op_add_path *op;
+
+            for ( op = patch->add_path_list; op; op=op->next ) {
+                op->performed = 0;
+                if ( apply_add_path(op, dst) < 0 ) {
+                    retval = -1;
+                    break;
+                }
+            }
+        }
+        for ( batch=0; (retval == 0) && (batch < schedule.batches); ++batch ) {
+            if ( batch == schedule.delete_batch ) {
+                apply_deletions(patch, dst, &schedule.sources, 0);
+            }
+            retval = apply_batch(&state, &schedule, batch);
+        }
+        free(state.ops);
+        if ( retval == 0 ) {
+            struct op_symlink_file *op;
 
-    /* Third stage, apply deltas, create new paths, copy new files */
-    if ( unsafe ) {
+            for ( op = patch->symlink_file_list; op; op=op->next ) {
+                op->performed = 0;
+                if ( apply_symlink_file(patch->base, op, dst) < 0 ) {
+                    retval = -1;
+                    break;
+                }
+            }
+        }
+        if ( retval == 0 ) {
+            if ( schedule.delete_batch == schedule.batches ) {
+                apply_deletions(patch, dst, NULL, 0);
+            } else {
+                apply_deletions(patch, dst, &schedule.sources, 1);
+            }
+        }
+        free_schedule(&schedule);
+        if ( retval < 0 ) {
+            journal_close(0);
+            return(-1);
+        }
+    } else {
+        /* Third stage, apply deltas, create new paths, copy new files,
+           renaming each into place as soon as it's made.  Files which
+           other files are patched from are removed only once that has
+           been done.
+         */
+        if ( collect_sources(patch, &sources) < 0 ) {
+            journal_close(0);
+            return(-1);
+        }
         { struct op_del_file *op;
-    
+
             for ( op = patch->del_file_list; op; op=op->next ) {
+                if ( is_delta_source(&sources, op->dst, 0) ) {
+                    continue;
+                }
                 /* This is non-fatal */
                 apply_del_file(op, dst, &patch->removed_paths);
             }
         }
         { struct op_del_path *op;
-    
+
             for ( op = patch->del_path_list; op; op=op->next ) {
+                if ( is_delta_source(&sources, op->dst, 1) ) {
+                    continue;
+                }
                 /* This is non-fatal */
                 apply_del_path(op, dst, &patch->removed_paths);
             }
         }
-    }
-    { struct op_patch_file *op;
+        { struct op_patch_file *op;
+          struct delta_option *option;
+          int pass;
 
-        for ( op = patch->patch_file_list; op; op=op->next ) {
-            op->performed = 0;
-            if ( apply_patch_file(patch->base, op, dst) < 0 ) {
-                if ( unsafe < 3 ) {
-                    return(-1);
-                }
+            state.count = 0;
+            for ( op = patch->patch_file_list; op; op=op->next ) {
+                ++state.count;
             }
-            disk_done += (op->size + 1023)/1024;
-            if ( disk_done ) {
-                logme(LOG_NORMAL," %0.0f%%%c",
-                    ((float)disk_done/disk_used)*100.0,
-                    get_logging() <= LOG_VERBOSE ? '\n' : '\r');
+            state.ops = (void **)malloc((state.count+1) * (sizeof *state.ops));
+            if ( ! state.ops ) {
+                logme(LOG_ERROR, "Out of memory\n");
+                free(sources.paths);
+                journal_close(0);
+                return(-1);
             }
-            if ( unsafe && op->performed ) {
-                if ( rename_patch_file(op, dst) < 0 ) {
-                    if ( unsafe < 3 ) {
-                        return(-1);
+
+            /* Files patched from other files go first, so that the files
+               they're patched from haven't been replaced yet */
+            state.count = 0;
+            for ( pass = 0; pass < 2; ++pass ) {
+                for ( op = patch->patch_file_list; op; op=op->next ) {
+                    for ( option=op->options; option; option=option->next ) {
+                        if ( option->from ) {
+                            break;
+                        }
+                    }
+                    if ( (option != NULL) == (pass == 0) ) {
+                        state.ops[state.count++] = op;
                     }
-                    op->performed = 0;
                 }
             }
-        }
-    }
-    { struct op_add_path *op;
-
-        for ( op = patch->add_path_list; op; op=op->next ) {
-            op->performed = 0;
-            if ( apply_add_path(op, dst) < 0 ) {
-                if ( unsafe < 3 ) {
-                    return(-1);
-                }
+            retval = run_jobs(state.jobs, state.count,
+                              sizeof(struct apply_result),
+                              patch_file_job, patch_file_done, &state);
+            free(state.ops);
+            if ( retval < 0 ) {
+                free(sources.paths);
+                journal_close(0);
+                return(-1);
             }
         }
-    }
-    { struct op_add_file *op;
+        { struct op_del_file *op;
 
-        for ( op = patch->add_file_list; op; op=op->next ) {
-            op->performed = 0;
-            if (apply_add_file(patch->base, op, dst, disk_done, disk_used) < 0){
-                if ( unsafe < 3 ) {
-                    return(-1);
-                }
-            }
-            disk_done += (op->size + 1023)/1024;
-            if ( disk_done ) {
-                logme(LOG_NORMAL," %0.0f%%%c",
-                    ((float)disk_done/disk_used)*100.0,
-                    get_logging() <= LOG_VERBOSE ? '\n' : '\r');
-            }
-            if ( unsafe && op->performed ) {
-                if ( rename_add_file(op, dst) < 0 ) {
-                    if ( unsafe < 3 ) {
-                        return(-1);
-                    }
-                    op->performed = 0;
+            for ( op = patch->del_file_list; op; op=op->next ) {
+                if ( is_delta_source(&sources, op->dst, 0) ) {
+                    /* This is non-fatal */
+                    apply_del_file(op, dst, &patch->removed_paths);
                 }
             }
         }
-    }
-    { struct op_symlink_file *op;
+        { struct op_del_path *op;
 
-        for ( op = patch->symlink_file_list; op; op=op->next ) {
-            op->performed = 0;
-            if ( apply_symlink_file(patch->base, op, dst) < 0 ) {
-                if ( unsafe < 3 ) {
-                    return(-1);
+            for ( op = patch->del_path_list; op; op=op->next ) {
+                if ( is_delta_source(&sources, op->dst, 1) ) {
+                    /* This is non-fatal */
+                    apply_del_path(op, dst, &patch->removed_paths);
                 }
             }
         }
-    }
+        free(sources.paths);
+        { struct op_add_path *op;
 
-    /* Third stage, rename patched/added files, remove obsolete files */
-    if ( ! unsafe ) {
-        { struct op_patch_file *op;
-    
-            for ( op = patch->patch_file_list; op; op=op->next ) {
-                if ( op->performed ) {
-                    if ( rename_patch_file(op, dst) < 0 ) {
+            for ( op = patch->add_path_list; op; op=op->next ) {
+                op->performed = 0;
+                if ( apply_add_path(op, dst) < 0 ) {
+                    if ( unsafe < 3 ) {
+                        journal_close(0);
                         return(-1);
                     }
                 }
             }
         }
         { struct op_add_file *op;
-    
+
+            state.count = 0;
             for ( op = patch->add_file_list; op; op=op->next ) {
-                if ( op->performed ) {
-                    if ( rename_add_file(op, dst) < 0 ) {
-                        return(-1);
-                    }
-                }
+                ++state.count;
             }
-        }
-        { struct op_del_file *op;
-    
-            for ( op = patch->del_file_list; op; op=op->next ) {
-                /* This is non-fatal */
-                apply_del_file(op, dst, &patch->removed_paths);
+            state.ops = (void **)malloc((state.count+1) * (sizeof *state.ops));
+            if ( ! state.ops ) {
+                logme(LOG_ERROR, "Out of memory\n");
+                journal_close(0);
+                return(-1);
+            }
+            state.count = 0;
+            for ( op = patch->add_file_list; op; op=op->next ) {
+                state.ops[state.count++] = op;
+            }
+            retval = run_jobs(state.jobs, state.count,
+                              sizeof(struct apply_result),
+                              add_file_job, add_file_done, &state);
+            free(state.ops);
+            if ( retval < 0 ) {
+                journal_close(0);
+                return(-1);
             }
         }
-        { struct op_del_path *op;
-    
-            for ( op = patch->del_path_list; op; op=op->next ) {
-                /* This is non-fatal */
-                apply_del_path(op, dst, &patch->removed_paths);
+        { struct op_symlink_file *op;
+
+            for ( op = patch->symlink_file_list; op; op=op->next ) {
+                op->performed = 0;
+                if ( apply_symlink_file(patch->base, op, dst) < 0 ) {
+                    if ( unsafe < 3 ) {
+                        journal_close(0);
+                        return(-1);
+                    }
+                }
             }
         }
     }
@@ -652,6 +1333,7 @@ int apply_patch(loki_patch *patch, const char *dst)
     }
 
     /* Yay!  The patch succeeded! */
+    journal_close(1);
     logme(LOG_NORMAL, " 100%%%c", get_logging() <= LOG_VERBOSE ? '\n' : '\r');
 
     return(0);
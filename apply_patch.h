@@ -1 +1,15 @@
+
+/* Set the number of files which may be added or patched at once */
+extern void set_apply_jobs(int jobs);
+
+/* Carry on from where an interrupted patch of the install left off */
+extern void set_apply_resume(int resume);
+
+/* Set the most disk space in K a safe patch may use at once, 0 for all
+   that's free, beyond which it's applied in batches */
+extern void set_apply_disk_limit(size_t limit);
+
+/* The most disk space in K applying the patch to 'dst' will use at once */
+extern size_t apply_space(loki_patch *patch, const char *dst);
+
 extern int apply_patch(loki_patch *patch, const char *dst);
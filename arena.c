@@ -0,0 +1,203 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "loki_patch.h"
+#include "arena.h"
+
+/* Everything handed out is aligned for any of the patch structures */
+#define ARENA_ALIGN(size)   (((size) + 7) & ~7)
+
+/* Blocks start small, and double as the patch grows */
+#define MIN_BLOCK_SIZE      (64*1024)
+#define MAX_BLOCK_SIZE      (4*1024*1024)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+};
+
+struct patch_arena {
+    struct arena_block *blocks;
+    size_t block_size;
+
+    /* Open addressed hash table of the interned strings */
+    char **strings;
+    unsigned int num_strings;
+    unsigned int max_strings;   /* A power of two */
+};
+
+static struct arena_block *new_block(size_t size)
+{
+    struct arena_block *block;
+
+    block = (struct arena_block *)malloc(size);
+    if ( block ) {
+        block->size = size;
+        block->used = ARENA_ALIGN(sizeof *block);
+    }
+    return(block);
+}
+
+static void *arena_alloc(struct patch_arena *arena, size_t size)
+{
+    struct arena_block *block;
+    void *mem;
+
+    size = ARENA_ALIGN(size);
+
+    /* Large requests get a block of their own, behind the current one
+       so that the space left in that isn't wasted */
+    if ( size > (arena->block_size / 4) ) {
+        block = new_block(ARENA_ALIGN(sizeof *block) + size);
+        if ( ! block ) {
+            return(NULL);
+        }
+        if ( arena->blocks ) {
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = NULL;
+            arena->blocks = block;
+        }
+    } else {
+        block = arena->blocks;
+        if ( !block || ((block->size - block->used) < size) ) {
+            if ( arena->block_size < MAX_BLOCK_SIZE ) {
+                arena->block_size *= 2;
+            }
+            block = new_block(arena->block_size);
+            if ( ! block ) {
+                return(NULL);
+            }
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+    mem = (char *)block + block->used;
+    block->used += size;
+    memset(mem, 0, size);
+    return(mem);
+}
+
+static struct patch_arena *get_arena(loki_patch *patch)
+{
+    struct patch_arena *arena;
+
+    if ( ! patch->arena ) {
+        arena = (struct patch_arena *)malloc(sizeof *arena);
+        if ( ! arena ) {
+            return(NULL);
+        }
+        memset(arena, 0, (sizeof *arena));
+        arena->block_size = MIN_BLOCK_SIZE / 2;
+        patch->arena = arena;
+    }
+    return(patch->arena);
+}
+
+void *patch_alloc(loki_patch *patch, size_t size)
+{
+    struct patch_arena *arena;
+
+    arena = get_arena(patch);
+    if ( ! arena ) {
+        return(NULL);
+    }
+    return arena_alloc(arena, size);
+}
+
+static unsigned int hash_string(const char *str)
+{
+    unsigned int hash;
+
+    hash = 5381;
+    while ( *str ) {
+        hash = ((hash << 5) + hash) + (unsigned char)*str++;
+    }
+    return(hash);
+}
+
+static int grow_strings(struct patch_arena *arena)
+{
+    char **strings;
+    unsigned int i, j, size;
+
+    size = arena->max_strings ? arena->max_strings*2 : 4096;
+    strings = (char **)malloc(size * (sizeof *strings));
+    if ( ! strings ) {
+        return(-1);
+    }
+    memset(strings, 0, size * (sizeof *strings));
+    for ( i=0; i<arena->max_strings; ++i ) {
+        if ( arena->strings[i] ) {
+            j = hash_string(arena->strings[i]) & (size-1);
+            while ( strings[j] ) {
+                j = (j+1) & (size-1);
+            }
+            strings[j] = arena->strings[i];
+        }
+    }
+    if ( arena->strings ) {
+        free(arena->strings);
+    }
+    arena->strings = strings;
+    arena->max_strings = size;
+    return(0);
+}
+
+char *patch_strdup(loki_patch *patch, const char *str)
+{
+    struct patch_arena *arena;
+    unsigned int i;
+    char *copy;
+
+    arena = get_arena(patch);
+    if ( ! arena ) {
+        return(NULL);
+    }
+
+    /* Keep the table at most half full */
+    if ( (arena->num_strings+1) > (arena->max_strings/2) ) {
+        if ( grow_strings(arena) < 0 ) {
+            return(NULL);
+        }
+    }
+
+    /* See if we already have it */
+    i = hash_string(str) & (arena->max_strings-1);
+    while ( arena->strings[i] ) {
+        if ( strcmp(arena->strings[i], str) == 0 ) {
+            return(arena->strings[i]);
+        }
+        i = (i+1) & (arena->max_strings-1);
+    }
+
+    /* Nope, add it */
+    copy = (char *)arena_alloc(arena, strlen(str)+1);
+    if ( copy ) {
+        strcpy(copy, str);
+        arena->strings[i] = copy;
+        ++arena->num_strings;
+    }
+    return(copy);
+}
+
+void free_arena(struct patch_arena *arena)
+{
+    struct arena_block *block, *freeable;
+
+    if ( arena ) {
+        block = arena->blocks;
+        while ( block ) {
+            freeable = block;
+            block = block->next;
+            free(freeable);
+        }
+        if ( arena->strings ) {
+            free(arena->strings);
+        }
+        free(arena);
+    }
+}
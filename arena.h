@@ -0,0 +1,17 @@
+
+/* The operations in a patch and their strings are carved out of large
+   blocks owned by the patch, and are all released together when the
+   patch is freed.  Nothing allocated this way can be freed on its own,
+   operations removed from a patch just stay in the arena until then.
+
+   Strings are interned, so they must never be modified in place.
+ */
+
+/* Allocate zeroed memory for a patch, or NULL if out of memory */
+extern void *patch_alloc(loki_patch *patch, size_t size);
+
+/* Get a copy of a string for a patch, shared with any equal string */
+extern char *patch_strdup(loki_patch *patch, const char *str);
+
+/* Release all of the memory in an arena, when the patch is freed */
+extern void free_arena(struct patch_arena *arena);
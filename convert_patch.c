@@ -0,0 +1,65 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "loki_patch.h"
+#include "load_patch.h"
+#include "save_patch.h"
+#include "manifest.h"
+#include "log_output.h"
+
+static void print_usage(const char *argv0)
+{
+    fprintf(stderr,
+"Loki Patch Tools " VERSION "\n");
+    fprintf(stderr,
+"Usage: %s [--text] patch-file\n"
+"Writes the binary manifest patch-file" MANIFEST_SUFFIX " from the text patch-file,\n"
+"or with --text, writes the text patch-file from patch-file" MANIFEST_SUFFIX "\n",
+    argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    loki_patch *patch;
+    int i;
+    int to_text;
+
+    to_text = 0;
+    for ( i=1; argv[i] && (argv[i][0] == '-'); ++i ) {
+        if ( strcmp(argv[i], "--text") == 0 ) {
+            to_text = 1;
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if ( (argc - i) != 1 ) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    if ( to_text ) {
+        patch = load_manifest(argv[i], 1);
+        if ( ! patch ) {
+            logme(LOG_ERROR, "Unable to load %s" MANIFEST_SUFFIX "\n", argv[i]);
+            exit(2);
+        }
+        /* This writes a new manifest too, to match the new text file */
+        if ( save_patch(patch, argv[i]) ) {
+            exit(4);
+        }
+    } else {
+        patch = load_patch_text(argv[i]);
+        if ( ! patch ) {
+            exit(2);
+        }
+        if ( save_manifest(patch, argv[i]) ) {
+            exit(4);
+        }
+    }
+    free_patch(patch);
+
+    return(0);
+}
@@ -0,0 +1,182 @@
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "job_pool.h"
+#include "log_output.h"
+
+struct worker {
+    pid_t pid;
+    int job;
+    int fd;
+};
+
+/* Run every job in this process, one after another */
+static int run_jobs_serial(int count, size_t result_size,
+                           job_work work, job_done done, void *data)
+{
+    char result[JOB_RESULT_MAX];
+    int job, status;
+
+    for ( job=0; job<count; ++job ) {
+        memset(result, 0, result_size);
+        status = work(job, data, result);
+        if ( done(job, status, data, result) < 0 ) {
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+/* Start a worker process for the given job */
+static int start_worker(struct worker *worker, int job, size_t result_size,
+                        job_work work, void *data)
+{
+    char result[JOB_RESULT_MAX];
+    int fds[2];
+    int status;
+
+    if ( pipe(fds) < 0 ) {
+        logme(LOG_ERROR, "Unable to create pipe: %s\n", strerror(errno));
+        return(-1);
+    }
+
+    /* Don't let the worker inherit (and repeat) buffered output */
+    fflush(stdout);
+    fflush(stderr);
+
+    worker->pid = fork();
+    if ( worker->pid < 0 ) {
+        logme(LOG_ERROR, "Unable to start worker: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return(-1);
+    }
+    if ( worker->pid == 0 ) {
+        /* We're the worker, do the job and pass back the results.
+           The record is smaller than PIPE_BUF, so it fits in the pipe
+           and the write won't block waiting for the parent.
+         */
+        close(fds[0]);
+        memset(result, 0, result_size);
+        status = work(job, data, result);
+        fflush(stdout);
+        if ( (write(fds[1], &status, sizeof(status)) != sizeof(status)) ||
+             (write(fds[1], result, result_size) != result_size) ) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    worker->job = job;
+    worker->fd = fds[0];
+    return(0);
+}
+
+/* Wait for any worker to finish, and collect its results */
+static struct worker *wait_worker(struct worker *workers, int jobs,
+                                  size_t result_size, int *status, void *result)
+{
+    struct worker *worker;
+    pid_t pid;
+    int i, exit_status;
+
+    do {
+        pid = waitpid(-1, &exit_status, 0);
+        if ( pid < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            logme(LOG_ERROR, "Unable to wait for worker: %s\n", strerror(errno));
+            return((struct worker *)0);
+        }
+        worker = (struct worker *)0;
+        for ( i=0; i<jobs; ++i ) {
+            if ( workers[i].pid == pid ) {
+                worker = &workers[i];
+                break;
+            }
+        }
+    } while ( ! worker );
+
+    /* A worker that died without reporting back has failed the job */
+    memset(result, 0, result_size);
+    if ( !WIFEXITED(exit_status) || (WEXITSTATUS(exit_status) != 0) ||
+         (read(worker->fd, status, sizeof(*status)) != sizeof(*status)) ||
+         (read(worker->fd, result, result_size) != result_size) ) {
+        logme(LOG_ERROR, "Worker for job %d failed\n", worker->job);
+        *status = -1;
+    }
+    close(worker->fd);
+    worker->pid = 0;
+    return(worker);
+}
+
+/* Run 'count' jobs on at most 'jobs' workers at a time.
+   Jobs are handed out in order as workers become free, so a worker
+   stuck on a large file doesn't hold up the rest of the queue.
+ */
+int run_jobs(int jobs, int count, size_t result_size,
+             job_work work, job_done done, void *data)
+{
+    char result[JOB_RESULT_MAX];
+    struct worker *workers;
+    struct worker *worker;
+    int next, active, status, retval;
+    int i;
+
+    if ( result_size + sizeof(int) > JOB_RESULT_MAX ) {
+        logme(LOG_ERROR, "Job result is too large\n");
+        return(-1);
+    }
+    if ( (jobs <= 1) || (count <= 1) ) {
+        return run_jobs_serial(count, result_size, work, done, data);
+    }
+
+    workers = (struct worker *)malloc(jobs * (sizeof *workers));
+    if ( ! workers ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    memset(workers, 0, jobs * (sizeof *workers));
+
+    retval = 0;
+    next = 0;
+    active = 0;
+    for ( ; ; ) {
+        /* Keep every worker busy while there's work left to do */
+        for ( i=0; (i < jobs) && (next < count) && (retval == 0); ++i ) {
+            if ( workers[i].pid == 0 ) {
+                if ( start_worker(&workers[i], next, result_size,
+                                  work, data) < 0 ) {
+                    retval = -1;
+                    break;
+                }
+                ++next;
+                ++active;
+            }
+        }
+        if ( ! active ) {
+            break;
+        }
+
+        /* Collect the next finished job */
+        worker = wait_worker(workers, jobs, result_size, &status, result);
+        if ( ! worker ) {
+            retval = -1;
+            break;
+        }
+        --active;
+        if ( done(worker->job, status, data, result) < 0 ) {
+            retval = -1;
+        }
+    }
+    free(workers);
+
+    return(retval);
+}
@@ -0,0 +1,23 @@
+
+/* A small pool of worker processes for running independent operations.
+   Processes are used instead of threads because the xdelta library and
+   glib keep global state which isn't safe to share between threads.
+ */
+
+/* The largest result record a job can pass back to the parent */
+#define JOB_RESULT_MAX  256
+
+/* Perform a single job, filling in the result record.
+   This runs in a worker process, unless only one job is allowed.
+ */
+typedef int (*job_work)(int job, void *data, void *result);
+
+/* Collect the status and result of a job.
+   This always runs in the parent process, in the order jobs complete.
+   Returning a negative value stops any more jobs from being started.
+ */
+typedef int (*job_done)(int job, int status, void *data, void *result);
+
+/* Run 'count' jobs on at most 'jobs' workers at a time */
+extern int run_jobs(int jobs, int count, size_t result_size,
+                    job_work work, job_done done, void *data);
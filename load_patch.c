@@ -6,6 +6,10 @@
 
 #include "loki_patch.h"
 #include "load_patch.h"
+#include "arena.h"
+#include "path_index.h"
+#include "payload_index.h"
+#include "manifest.h"
 #include "log_output.h"
 
 #define BASE "patchdata"
@@ -18,12 +22,11 @@ int load_add_file(FILE *file, int *line_num, const char *dst, loki_patch *patch)
     char *key, *value;
 
     /* Allocate memory for the operation */
-    op = (struct op_add_file *)malloc(sizeof *op);
+    op = (struct op_add_file *)patch_alloc(patch, sizeof *op);
     if ( ! op ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    memset(op, 0, (sizeof *op));
 
     /* Load the information for this section */
     while ( fgets(line, sizeof(line), file) ) {
@@ -52,7 +55,7 @@ int load_add_file(FILE *file, int *line_num, const char *dst, loki_patch *patch)
 
         /* See if we recognize the entry */
         if ( strcmp(key, "src") == 0 ) {
-            op->src = strdup(value);
+            op->src = patch_strdup(patch, value);
         } else
         if ( strcmp(key, "sum") == 0 ) {
             strncpy(op->sum, value, CHECKSUM_SIZE);
@@ -73,18 +76,19 @@ int load_add_file(FILE *file, int *line_num, const char *dst, loki_patch *patch)
         logme(LOG_ERROR, "Incomplete ADD FILE entry above line %d\n", *line_num);
         return(-1);
     }
-    op->dst = strdup(dst);
+    op->dst = patch_strdup(patch, dst);
+    if ( ! op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
 
     /* Add the operation to the end of our list */
-    if ( patch->add_file_list ) {
-        struct op_add_file *here;
-
-        for ( here=patch->add_file_list; here->next; here=here->next )
-            ;
-        here->next = op;
+    if ( patch->add_file_tail ) {
+        patch->add_file_tail->next = op;
     } else {
         patch->add_file_list = op;
     }
+    patch->add_file_tail = op;
 
     return(0);
 }
@@ -96,12 +100,11 @@ int load_add_path(FILE *file, int *line_num, const char *dst, loki_patch *patch)
     char *key, *value;
 
     /* Allocate memory for the operation */
-    op = (struct op_add_path *)malloc(sizeof *op);
+    op = (struct op_add_path *)patch_alloc(patch, sizeof *op);
     if ( ! op ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    memset(op, 0, (sizeof *op));
 
     /* Load the information for this section */
     while ( fgets(line, sizeof(line), file) ) {
@@ -142,42 +145,41 @@ int load_add_path(FILE *file, int *line_num, const char *dst, loki_patch *patch)
         logme(LOG_ERROR, "Incomplete ADD PATH entry above line %d\n", *line_num);
         return(-1);
     }
-    op->dst = strdup(dst);
+    op->dst = patch_strdup(patch, dst);
+    if ( ! op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
 
     /* Add the operation to the end of our list */
-    if ( patch->add_path_list ) {
-        struct op_add_path *here;
-
-        for ( here=patch->add_path_list; here->next; here=here->next )
-            ;
-        here->next = op;
+    if ( patch->add_path_tail ) {
+        patch->add_path_tail->next = op;
     } else {
         patch->add_path_list = op;
     }
+    patch->add_path_tail = op;
 
     return(0);
 }
 
-/* Note, there are a lot of memory leaks in here if parse fails.
- */
 int load_patch_file(FILE *file, int *line_num, const char *dst,
                                             loki_patch *patch)
 {
     struct op_patch_file *op;
     char line[1024];
     char *key, *value;
-    struct delta_option *option;
+    struct delta_option *option, *last;
 
     /* Allocate memory for the operation */
-    op = (struct op_patch_file *)malloc(sizeof *op);
+    op = (struct op_patch_file *)patch_alloc(patch, sizeof *op);
     if ( ! op ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    memset(op, 0, (sizeof *op));
 
     /* Load the information for this section */
     option = (struct delta_option *)0;
+    last = (struct delta_option *)0;
     while ( fgets(line, sizeof(line), file) ) {
         /* Chop the newline */
         ++*line_num;
@@ -203,15 +205,18 @@ int load_patch_file(FILE *file, int *line_num, const char *dst,
         *value++ = '\0';
 
         if ( (strcmp(key, "oldsum") == 0) ||
+             (strcmp(key, "from") == 0) ||
              (strcmp(key, "src") == 0) ||
+             (strcmp(key, "segment") == 0) ||
+             (strcmp(key, "whole") == 0) ||
              (strcmp(key, "newsum") == 0) ) {
             if ( !option ) {
-                option = (struct delta_option *)malloc(sizeof *option);
+                option = (struct delta_option *)
+                            patch_alloc(patch, sizeof *option);
                 if ( ! option ) {
                     logme(LOG_ERROR, "Out of memory\n");
                     return(-1);
                 }
-                memset(option, 0, (sizeof *option));
             }
             if ( strcmp(key, "src") == 0 ) {
                 if ( option->src ) {
@@ -219,7 +224,26 @@ int load_patch_file(FILE *file, int *line_num, const char *dst,
                                                                     *line_num);
                     return(-1);
                 }
-                option->src = strdup(value);
+                option->src = patch_strdup(patch, value);
+            } else
+            if ( strcmp(key, "from") == 0 ) {
+                if ( option->from ) {
+                    logme(LOG_ERROR, "Patch option not complete at line %d\n",
+                                                                    *line_num);
+                    return(-1);
+                }
+                option->from = patch_strdup(patch, value);
+            } else
+            if ( strcmp(key, "segment") == 0 ) {
+                if ( option->segment ) {
+                    logme(LOG_ERROR, "Patch option not complete at line %d\n",
+                                                                    *line_num);
+                    return(-1);
+                }
+                option->segment = strtol(value, 0, 0);
+            } else
+            if ( strcmp(key, "whole") == 0 ) {
+                option->whole = atoi(value);
             } else
             if ( strcmp(key, "oldsum") == 0 ) {
                 if ( *option->oldsum ) {
@@ -239,15 +263,12 @@ int load_patch_file(FILE *file, int *line_num, const char *dst,
             }
             /* If we have a complete entry, add it */
             if ( option->src && *option->oldsum && *option->newsum ) {
-                if ( op->options ) {
-                    struct delta_option *here;
-
-                    for ( here=op->options; here->next; here=here->next )
-                        ;
-                    here->next = option;
+                if ( last ) {
+                    last->next = option;
                 } else {
                     op->options = option;
                 }
+                last = option;
                 option = (struct delta_option *)0;
             }
         } else
@@ -271,18 +292,19 @@ int load_patch_file(FILE *file, int *line_num, const char *dst,
                                                             *line_num);
         return(-1);
     }
-    op->dst = strdup(dst);
+    op->dst = patch_strdup(patch, dst);
+    if ( ! op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
 
     /* Add the operation to the end of our list */
-    if ( patch->patch_file_list ) {
-        struct op_patch_file *here;
-
-        for ( here=patch->patch_file_list; here->next; here=here->next )
-            ;
-        here->next = op;
+    if ( patch->patch_file_tail ) {
+        patch->patch_file_tail->next = op;
     } else {
         patch->patch_file_list = op;
     }
+    patch->patch_file_tail = op;
 
     return(0);
 }
@@ -294,12 +316,11 @@ int load_symlink_file(FILE *file, int *line_num, const char *dst, loki_patch *pa
     char *key, *value;
 
     /* Allocate memory for the operation */
-    op = (struct op_symlink_file *)malloc(sizeof *op);
+    op = (struct op_symlink_file *)patch_alloc(patch, sizeof *op);
     if ( ! op ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    memset(op, 0, (sizeof *op));
 
     /* Load the information for this section */
     while ( fgets(line, sizeof(line), file) ) {
@@ -327,7 +348,7 @@ int load_symlink_file(FILE *file, int *line_num, const char *dst, loki_patch *pa
         *value++ = '\0';
 
         if ( strcmp(key, "link") == 0 ) {
-            op->link = strdup(value);
+            op->link = patch_strdup(patch, value);
         } else {
             logme(LOG_ERROR, "Unknown SYMLINK FILE key %d: %s\n", *line_num, key);
             return(-1);
@@ -340,18 +361,19 @@ int load_symlink_file(FILE *file, int *line_num, const char *dst, loki_patch *pa
                                                             *line_num);
         return(-1);
     }
-    op->dst = strdup(dst);
+    op->dst = patch_strdup(patch, dst);
+    if ( ! op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
 
     /* Add the operation to the end of our list */
-    if ( patch->symlink_file_list ) {
-        struct op_symlink_file *here;
-
-        for ( here=patch->symlink_file_list; here->next; here=here->next )
-            ;
-        here->next = op;
+    if ( patch->symlink_file_tail ) {
+        patch->symlink_file_tail->next = op;
     } else {
         patch->symlink_file_list = op;
     }
+    patch->symlink_file_tail = op;
 
     return(0);
 }
@@ -363,12 +385,11 @@ int load_del_file(FILE *file, int *line_num, const char *dst, loki_patch *patch)
     char *key, *value;
 
     /* Allocate memory for the operation */
-    op = (struct op_del_file *)malloc(sizeof *op);
+    op = (struct op_del_file *)patch_alloc(patch, sizeof *op);
     if ( ! op ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    memset(op, 0, (sizeof *op));
 
     /* Load the information for this section */
     while ( fgets(line, sizeof(line), file) ) {
@@ -400,18 +421,19 @@ int load_del_file(FILE *file, int *line_num, const char *dst, loki_patch *patch)
     }
 
     /* Make sure we have all the information we need */
-    op->dst = strdup(dst);
+    op->dst = patch_strdup(patch, dst);
+    if ( ! op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
 
     /* Add the operation to the end of our list */
-    if ( patch->del_file_list ) {
-        struct op_del_file *here;
-
-        for ( here=patch->del_file_list; here->next; here=here->next )
-            ;
-        here->next = op;
+    if ( patch->del_file_tail ) {
+        patch->del_file_tail->next = op;
     } else {
         patch->del_file_list = op;
     }
+    patch->del_file_tail = op;
 
     return(0);
 }
@@ -423,12 +445,11 @@ int load_del_path(FILE *file, int *line_num, const char *dst, loki_patch *patch)
     char *key, *value;
 
     /* Allocate memory for the operation */
-    op = (struct op_del_path *)malloc(sizeof *op);
+    op = (struct op_del_path *)patch_alloc(patch, sizeof *op);
     if ( ! op ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    memset(op, 0, (sizeof *op));
 
     /* Load the information for this section */
     while ( fgets(line, sizeof(line), file) ) {
@@ -460,18 +481,19 @@ int load_del_path(FILE *file, int *line_num, const char *dst, loki_patch *patch)
     }
 
     /* Make sure we have all the information we need */
-    op->dst = strdup(dst);
+    op->dst = patch_strdup(patch, dst);
+    if ( ! op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
 
     /* Add the operation to the end of our list */
-    if ( patch->del_path_list ) {
-        struct op_del_path *here;
-
-        for ( here=patch->del_path_list; here->next; here=here->next )
-            ;
-        here->next = op;
+    if ( patch->del_path_tail ) {
+        patch->del_path_tail->next = op;
     } else {
         patch->del_path_list = op;
     }
+    patch->del_path_tail = op;
 
     return(0);
 }
@@ -488,20 +510,12 @@ static struct optional_field *add_optional_field(loki_patch *patch,
     }
 
     /* Create a new optional field */
-    field = (struct optional_field *)malloc(sizeof *field);
+    field = (struct optional_field *)patch_alloc(patch, sizeof *field);
     if ( field ) {
-        field->key = strdup(key);
-        field->val = strdup(val);
-        field->next = NULL;
+        field->key = patch_strdup(patch, key);
+        field->val = patch_strdup(patch, val);
         if ( ! field->key || ! field->val ) {
-            if ( field->key ) {
-                free(field->key);
-            }
-            if ( field->val ) {
-                free(field->val);
-            }
-            free(field);
-            field = NULL;
+            return(NULL);
         }
     }
 
@@ -514,6 +528,31 @@ static struct optional_field *add_optional_field(loki_patch *patch,
     return(field);
 }
 
+const char *get_optional_field(loki_patch *patch, const char *key)
+{
+    struct optional_field *field;
+
+    for ( field = patch->optional_fields; field; field = field->next ) {
+        if ( strcasecmp(field->key, key) == 0 ) {
+            return(field->val);
+        }
+    }
+    return(NULL);
+}
+
+int set_optional_field(loki_patch *patch, const char *key, const char *val)
+{
+    struct optional_field *field;
+
+    for ( field = patch->optional_fields; field; field = field->next ) {
+        if ( strcasecmp(field->key, key) == 0 ) {
+            field->val = patch_strdup(patch, val);
+            return(field->val ? 0 : -1);
+        }
+    }
+    return(add_optional_field(patch, key, val) ? 0 : -1);
+}
+
 static struct {
     const char *key;
     int (*func)(FILE *file, int *line_num, const char *dst, loki_patch *patch);
@@ -526,7 +565,39 @@ static struct {
     {   "DEL PATH ",        load_del_path       }
 };
 
+char *patch_base(const char *patchfile)
+{
+    char *base;
+
+    if ( strrchr(patchfile, '/') != NULL ) {
+        base = (char *)malloc(strlen(patchfile) + strlen("/" BASE) + 1);
+        if ( base ) {
+            strcpy(base, patchfile);
+            *strrchr(base, '/') = '\0';
+            strcat(base, "/" BASE);
+        }
+    } else {
+        base = (char *)malloc(strlen("./" BASE) + 1);
+        if ( base ) {
+            strcpy(base, "./" BASE);
+        }
+    }
+    return(base);
+}
+
 loki_patch *load_patch(const char *patchfile)
+{
+    loki_patch *patch;
+
+    /* Use the binary manifest if it's up to date */
+    patch = load_manifest(patchfile, 0);
+    if ( ! patch ) {
+        patch = load_patch_text(patchfile);
+    }
+    return patch;
+}
+
+loki_patch *load_patch_text(const char *patchfile)
 {
     loki_patch *patch;
     FILE *file;
@@ -550,24 +621,11 @@ loki_patch *load_patch(const char *patchfile)
     }
 
     /* Get the data directory for the patch */
-    if ( strrchr(patchfile, '/') != NULL ) {
-        patch->base = (char *)malloc(strlen(patchfile) + strlen("/" BASE) + 1);
-        if ( ! patch->base ) {
-            logme(LOG_ERROR, "Out of memory\n");
-            free_patch(patch);
-            return (loki_patch *)0;
-        }
-        strcpy(patch->base, patchfile);
-        *strrchr(patch->base, '/') = '\0';
-        strcat(patch->base, "/" BASE);
-    } else {
-        patch->base = (char *)malloc(strlen("./" BASE) + 1);
-        if ( ! patch->base ) {
-            logme(LOG_ERROR, "Out of memory\n");
-            free_patch(patch);
-            return (loki_patch *)0;
-        }
-        strcpy(patch->base, "./" BASE);
+    patch->base = patch_base(patchfile);
+    if ( ! patch->base ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_patch(patch);
+        return (loki_patch *)0;
     }
 
     /* Load the patch header */
@@ -600,24 +658,24 @@ loki_patch *load_patch(const char *patchfile)
 
         /* See if we recognize the token */
         if ( strcasecmp(line, "Product") == 0 ) {
-            patch->product = strdup(token);
+            patch->product = patch_strdup(patch, token);
         } else
         if ( strcasecmp(line, "Component") == 0 ) {
             if ( *token ) {
-                patch->component = strdup(token);
+                patch->component = patch_strdup(patch, token);
             }
         } else
         if ( strcasecmp(line, "Version") == 0 ) {
-            patch->version = strdup(token);
+            patch->version = patch_strdup(patch, token);
         } else
         if ( strcasecmp(line, "Size") == 0 ) {
             /* Discard the size attribute - it's recalculated */ ;
         } else
         if ( strcasecmp(line, "Prepatch") == 0 ) {
-            patch->prepatch = strdup(token);
+            patch->prepatch = patch_strdup(patch, token);
         } else
         if ( strcasecmp(line, "Postpatch") == 0 ) {
-            patch->postpatch = strdup(token);
+            patch->postpatch = patch_strdup(patch, token);
         } else {
             if ( ! add_optional_field(patch, line, token) ) {
                 logme(LOG_ERROR, "Out of memory\n");
@@ -681,104 +739,6 @@ loki_patch *load_patch(const char *patchfile)
     return patch;
 }
 
-static void free_optional_fields(struct optional_field *fields)
-{
-    struct optional_field *field, *freeable;
-
-    field = fields;
-    while ( field ) {
-        freeable = field;
-        field = field->next;
-        free(freeable->key);
-        free(freeable->val);
-        free(freeable);
-    }
-}
-
-void free_add_path(struct op_add_path *add_path_list)
-{
-    struct op_add_path *freeable;
-
-    while ( add_path_list ) {
-        freeable = add_path_list;
-        add_path_list = add_path_list->next;
-        free(freeable->dst);
-        free(freeable);
-    }
-}
-
-void free_add_file(struct op_add_file *add_file_list)
-{
-    struct op_add_file *freeable;
-
-    while ( add_file_list ) {
-        freeable = add_file_list;
-        add_file_list = add_file_list->next;
-        free(freeable->dst);
-        free(freeable->src);
-        free(freeable);
-    }
-}
-
-void free_patch_file(struct op_patch_file *patch_file_list)
-{
-    struct op_patch_file *freeable;
-    struct delta_option *option, *o;
-
-    while ( patch_file_list ) {
-        freeable = patch_file_list;
-        patch_file_list = patch_file_list->next;
-        option=freeable->options;
-        while ( option ) {
-            o = option;
-            option = option->next;
-            if ( o->src ) {
-                free(o->src);
-            }
-            free(o);
-        }
-        free(freeable->dst);
-        free(freeable);
-    }
-}
-
-void free_symlink_file(struct op_symlink_file *symlink_file_list)
-{
-    struct op_symlink_file *freeable;
-
-    while ( symlink_file_list ) {
-        freeable = symlink_file_list;
-        symlink_file_list = symlink_file_list->next;
-        free(freeable->dst);
-        free(freeable->link);
-        free(freeable);
-    }
-}
-
-void free_del_file(struct op_del_file *del_file_list)
-{
-    struct op_del_file *freeable;
-
-    while ( del_file_list ) {
-        freeable = del_file_list;
-        del_file_list = del_file_list->next;
-        free(freeable->dst);
-        free(freeable);
-    }
-}
-
-void free_del_path(struct op_del_path *del_path_list)
-{
-    struct op_del_path *freeable;
-
-    while ( del_path_list ) {
-        freeable = del_path_list;
-        del_path_list = del_path_list->next;
-        free(freeable->dst);
-        free(freeable);
-    }
-}
-
 static void free_removed_paths(struct removed_path *removed_paths)
 {
     struct removed_path *freeable;
@@ -799,29 +759,11 @@ void free_patch(loki_patch *patch)
         if ( patch->base ) {
             free(patch->base);
         }
-        if ( patch->product ) {
-            free(patch->product);
-        }
-        if ( patch->version ) {
-            free(patch->version);
-        }
-        if ( patch->component ) {
-            free(patch->component);
-        }
-        free_optional_fields(patch->optional_fields);
-        if ( patch->prepatch ) {
-            free(patch->prepatch);
-        }
-        if ( patch->postpatch ) {
-            free(patch->postpatch);
-        }
-        free_add_path(patch->add_path_list);
-        free_add_file(patch->add_file_list);
-        free_patch_file(patch->patch_file_list);
-        free_symlink_file(patch->symlink_file_list);
-        free_del_file(patch->del_file_list);
-        free_del_path(patch->del_path_list);
+        free_arena(patch->arena);
+        free_manifest(patch->manifest);
         free_removed_paths(patch->removed_paths);
+        free_path_index(patch->index);
+        free_payload_index(patch->payloads);
         free(patch);
     }
 }
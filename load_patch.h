@@ -1,9 +1,10 @@
 /* Functions to load and free the patch */
 extern loki_patch *load_patch(const char *patchfile);
-extern void free_add_path(struct op_add_path *add_path_list);
-extern void free_add_file(struct op_add_file *add_file_list);
-extern void free_patch_file(struct op_patch_file *patch_file_list);
-extern void free_symlink_file(struct op_symlink_file *symlink_file_list);
-extern void free_del_file(struct op_del_file *del_file_list);
-extern void free_del_path(struct op_del_path *del_path_list);
+/* Load the text patch file, ignoring any binary manifest */
+extern loki_patch *load_patch_text(const char *patchfile);
+/* Get the data directory for the patch file */
+extern char *patch_base(const char *patchfile);
 extern void free_patch(loki_patch *patch);
+/* Get or set a header field which isn't one of the standard ones */
+extern const char *get_optional_field(loki_patch *patch, const char *key);
+extern int set_optional_field(loki_patch *patch, const char *key, const char *val);
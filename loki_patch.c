@@ -4,19 +4,22 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 
 #include "loki_patch.h"
 #include "load_patch.h"
 #include "print_patch.h"
 #include "apply_patch.h"
 #include "registry.h"
+#include "loki_xdelta.h"
+#include "md5_cache.h"
 #include "log_output.h"
 
 
 static void print_usage(const char *argv0)
 {
     fprintf(stderr, "Loki Patch Tools " VERSION "\n");
-    fprintf(stderr, "Usage: %s [--info] patch-file [install-path]\n", argv0);
+    fprintf(stderr, "Usage: %s [--info] [--jobs N] [--page-size BYTES] [--mapped-pages N] [--md5-cache FILE] [--disk-limit K] [--resume] patch-file [install-path]\n", argv0);
 }
 
 int main(int argc, char *argv[])
@@ -29,10 +32,13 @@ int main(int argc, char *argv[])
     int just_verify;
     const char *patchfile;
     const char *install;
+    const char *md5_cache;
+    int result;
 
     /* Quick hack to check command-line arguments */
     show_info = 0;
     just_verify = 0;
+    md5_cache = NULL;
     for ( i=1; argv[i] && (argv[i][0] == '-'); ++i ) {
         if ( (strcmp(argv[i], "--verbose") == 0) ||
              (strcmp(argv[i], "-v") == 0) ) {
@@ -43,6 +49,28 @@ int main(int argc, char *argv[])
         } else
         if ( strcmp(argv[i], "--info") == 0 ) {
             show_info = 1;
+        } else
+        if ( strcmp(argv[i], "--resume") == 0 ) {
+            set_apply_resume(1);
+        } else
+        if ( ((strcmp(argv[i], "--jobs") == 0) ||
+              (strcmp(argv[i], "-j") == 0)) && argv[i+1] ) {
+            set_apply_jobs(atoi(argv[++i]));
+        } else
+        if ( (strcmp(argv[i], "--page-size") == 0) && argv[i+1] ) {
+            if ( loki_xdelta_page_size(atoi(argv[++i])) < 0 ) {
+                logme(LOG_ERROR, "Page size must be a power of two from 64K to 1G\n");
+                return(1);
+            }
+        } else
+        if ( (strcmp(argv[i], "--mapped-pages") == 0) && argv[i+1] ) {
+            loki_xdelta_mapped_pages(atoi(argv[++i]));
+        } else
+        if ( (strcmp(argv[i], "--md5-cache") == 0) && argv[i+1] ) {
+            md5_cache = argv[++i];
+        } else
+        if ( (strcmp(argv[i], "--disk-limit") == 0) && argv[i+1] ) {
+            set_apply_disk_limit(atol(argv[++i]));
         } else {
             print_usage(argv[0]);
             return(1);
@@ -52,6 +80,24 @@ int main(int argc, char *argv[])
     if ( getenv("PATCH_LOGGING") ) {
         set_logging(atoi(getenv("PATCH_LOGGING")));
     }
+    if ( getenv("PATCH_JOBS") ) {
+        set_apply_jobs(atoi(getenv("PATCH_JOBS")));
+    }
+    if ( getenv("PATCH_PAGE_SIZE") ) {
+        if ( loki_xdelta_page_size(atoi(getenv("PATCH_PAGE_SIZE"))) < 0 ) {
+            logme(LOG_ERROR, "Page size must be a power of two from 64K to 1G\n");
+            return(1);
+        }
+    }
+    if ( getenv("PATCH_MAPPED_PAGES") ) {
+        loki_xdelta_mapped_pages(atoi(getenv("PATCH_MAPPED_PAGES")));
+    }
+    if ( getenv("PATCH_MD5_CACHE") ) {
+        md5_cache = getenv("PATCH_MD5_CACHE");
+    }
+    if ( getenv("PATCH_DISK_LIMIT") ) {
+        set_apply_disk_limit(atol(getenv("PATCH_DISK_LIMIT")));
+    }
 
     /* Make sure we have the correct command line arguments */
     patchfile = argv[i];
@@ -75,6 +121,8 @@ int main(int argc, char *argv[])
     /* Print out information about the patch and install */
     if ( show_info ) {
         print_info(patch, stdout);
+        printf("Diskspace: %lu K\n",
+               (unsigned long)apply_space(patch, install));
         if ( install ) {
             printf("Installed: %s\n", install);
         }
@@ -96,7 +144,13 @@ int main(int argc, char *argv[])
         free_patch(patch);
         return(3);
     }
-    if ( apply_patch(patch, install) ) {
+    if ( md5_cache && (md5_cache_open(md5_cache) < 0) ) {
+        free_patch(patch);
+        return(1);
+    }
+    result = apply_patch(patch, install);
+    md5_cache_close();
+    if ( result ) {
         free_patch(patch);
         return(3);
     }
@@ -68,12 +68,18 @@ struct op_del_path {
     struct op_del_path *next;
 };
 
+/* The most deltas which will be chained together to patch a file */
+#define MAX_DELTA_CHAIN     64
+
 struct op_patch_file {
     char *dst;
     struct delta_option {
         int installed;
         char oldsum[CHECKSUM_SIZE+1];
+        char *from;     /* The file the delta applies to, if not dst */
         char *src;
+        long segment;   /* The segment size of a multi-part delta */
+        int whole;      /* The data is the new file, not a delta */
         char newsum[CHECKSUM_SIZE+1];
         struct delta_option *next;
     } *options;
@@ -112,10 +118,30 @@ typedef struct loki_patch {
     struct op_del_file *del_file_list;
     struct op_del_path *del_path_list;
 
+    /* The last operation in each of the lists above, for appending */
+    struct op_add_path *add_path_tail;
+    struct op_add_file *add_file_tail;
+    struct op_patch_file *patch_file_tail;
+    struct op_symlink_file *symlink_file_tail;
+    struct op_del_file *del_file_tail;
+    struct op_del_path *del_path_tail;
+
     /* This is needed for unregistering paths that are removed */
     struct removed_path {
         char *path;
         struct removed_path *next;
     } *removed_paths;
+
+    /* Memory for the header, the operations and their strings */
+    struct patch_arena *arena;
+
+    /* Lookup table of the paths used by the operations above */
+    struct path_index *index;
+
+    /* Lookup table of the data files used by the operations above */
+    struct payload_index *payloads;
+
+    /* The binary manifest holding the operations, if loaded from one */
+    struct patch_manifest *manifest;
 } loki_patch;
 
@@ -23,6 +23,11 @@
  * $Id$
  */
 
+/* for copy_file_range() */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,13 +52,54 @@
 
 #include <zlib.h>
 
+/* Copies between files can be done by the kernel, without the data
+ * passing through here */
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define XD_ZERO_COPY
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define XD_COPY_FILE_RANGE
+#endif
+/* On filesystems which share blocks between files, the output can start
+ * as a clone of the file it's patched from */
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#ifdef FICLONE
+#define XD_CLONE
+#endif
+#endif
+
 #define LOKI_PATCH
 
 #include "xdelta_inc/xdelta.h"
 
 static HandleFuncTable xd_handle_table;
 
-#define XD_PAGE_SIZE (1<<20)
+#define XD_DEFAULT_PAGE_SIZE (1<<20)
+#define XD_MIN_PAGE_SIZE     (1<<16)
+#define XD_MAX_PAGE_SIZE     (1<<30)
+
+/* The block size files are matched in, xdelta can't go past 64 bytes */
+#define XD_MIN_QUERY_SIZE    2
+#define XD_MAX_QUERY_SIZE    64
+
+/* How far ahead of the copies to read, and how many instructions to
+ * look through for the one being copied */
+#define XD_READ_AHEAD_PAGES  4
+#define XD_READ_AHEAD_SEARCH 64
+
+/* Copies smaller than this aren't worth a system call of their own,
+ * and data that has to pass through here is moved in this size */
+#define XD_ZERO_COPY_MIN     (1<<16)
+#define XD_COPY_BUFFER       (1<<16)
+
+/* Copies smaller than this are written out even if the cloned output
+ * already has them in place, rather than seeking past them */
+#define XD_CLONE_MIN         (1<<12)
+
+/* The page size can be changed before any files are opened */
+static guint xd_page_size = XD_DEFAULT_PAGE_SIZE;
+#define XD_PAGE_SIZE xd_page_size
 
 #define XDELTA_110_PREFIX "%XDZ004%"
 #define XDELTA_104_PREFIX "%XDZ003%"
@@ -149,12 +195,14 @@ struct _XdFileHandle
 
   guint8 md5[16];
   EdsioMD5Ctx ctx;
+  EdsioMD5Ctx *sink;  /* checksums everything written, if set */
 
   /* for write */
   int out_fd;
   void* out;
   gboolean (* out_write) (XdFileHandle* handle, const void* buf, gint nbyte);
   gboolean (* out_close) (XdFileHandle* handle);
+  XdFileHandle* cloned; /* the file the output started as a copy of */
 
   /* for read */
   GPtrArray *lru_table;
@@ -178,6 +226,23 @@ struct _XdFileHandle
 
   gint md5_page;
   gint fd;
+  off_t window;   /* where the part of the file that's read starts */
+
+  /* for gzipped files read in place, the inflate state at the start
+   * of each page and the offset of the compressed data it reads next */
+  z_stream **zpoints;
+  guint     *zoffsets;
+  guint      zcount;
+
+  /* for reading ahead: either the file is read straight through, or
+   * the copies the delta will make from it are known in advance */
+  gboolean sequential;
+  const XdeltaInstruction* plan;
+  guint plan_len;
+  guint plan_index;   /* the source number of this file */
+  guint plan_next;    /* the next instruction that copies from it */
+  guint plan_ahead;   /* the first instruction not read ahead yet */
+  guint plan_bytes;   /* bytes read ahead but not copied yet */
 };
 
 /* $Format: "static const char xdelta_version[] = \"$ReleaseVersion$\"; " $ */
@@ -229,7 +294,26 @@ static gint         no_verify = FALSE;
 static gint         pristine = FALSE;
 static gint         verbose = FALSE;
 static gint         max_mapped_pages = G_MAXINT;
+#ifdef LOKI_PATCH
+static gint         mapped_pages = 0;   /* 0 picks it from the free memory */
+static gint         query_size = 0;     /* 0 leaves xdelta's own */
+#endif
+static guint        page_hits = 0;
+static guint        page_misses = 0;
+static guint        page_evictions = 0;
 static gint         quiet = FALSE;
+static XdFileHandle* patch_from = NULL;  /* an already open source file */
+static EdsioMD5Ctx*  patch_sink = NULL;  /* checksums the patched file */
+static gboolean     patch_append = FALSE;  /* add to the end of the patched file */
+
+/* the parts of the old and new files diffed, when they are done a
+ * segment at a time */
+static gboolean     window_set = FALSE;
+static off_t        window_from_off = 0;
+static guint        window_from_len = 0;
+static off_t        window_to_off = 0;
+static guint        window_to_len = 0;
+
 /*static gint         long_format = FALSE;
 static gint         really_long_format = FALSE;*/
 
@@ -322,6 +406,109 @@ event_watch (GenericEvent* ev, GenericEventDef* def, const char* message)
 
 static int xd_edsio_started = 0;
 
+/* Read the memory that's free for the taking, or -1 if we can't tell */
+static glong xd_free_memory(void)
+{
+    FILE *fp;
+    char line[128];
+    glong kb;
+
+    kb = -1;
+    fp = fopen("/proc/meminfo", "r");
+    if ( fp ) {
+        while ( fgets(line, sizeof(line), fp) ) {
+            if ( sscanf(line, "MemAvailable: %ld kB", &kb) == 1 ) {
+                break;
+            }
+        }
+        fclose(fp);
+    }
+#ifdef _SC_AVPHYS_PAGES
+    if ( kb < 0 ) {
+        kb = (sysconf(_SC_AVPHYS_PAGES) / 1024) * (sysconf(_SC_PAGESIZE) / 1024) * 1024;
+    }
+#endif
+    return(kb);
+}
+
+/* Pick how many pages each file may have mapped.  Unless it's been set,
+   the files that are open at once (the old and new file, or the delta)
+   get a quarter of the free memory each, so we don't push it into swap.
+ */
+static void xd_pick_mapped_pages(void)
+{
+    glong kb;
+
+    if ( mapped_pages > 0 ) {
+        max_mapped_pages = mapped_pages;
+        return;
+    }
+    kb = xd_free_memory();
+    if ( kb < 0 ) {
+        max_mapped_pages = G_MAXINT;
+    } else {
+        max_mapped_pages = MIN(kb / 4 / (XD_PAGE_SIZE >> 10), G_MAXINT);
+        max_mapped_pages = MAX(max_mapped_pages, 8);
+    }
+}
+
+int loki_xdelta_page_size(int size)
+{
+    if ( (size < XD_MIN_PAGE_SIZE) || (size > XD_MAX_PAGE_SIZE) ||
+         (size & (size-1)) ) {
+        return(-1);
+    }
+    xd_page_size = size;
+    return(0);
+}
+
+int loki_xdelta_get_page_size(void)
+{
+    return(xd_page_size);
+}
+
+void loki_xdelta_mapped_pages(int pages)
+{
+    mapped_pages = pages;
+}
+
+int loki_xdelta_query_size(int size)
+{
+    if ( size && ((size < XD_MIN_QUERY_SIZE) || (size > XD_MAX_QUERY_SIZE) ||
+                  (size & (size-1))) ) {
+        return(-1);
+    }
+    query_size = size;
+    return(0);
+}
+
+/* Set the query size for the next delta, it's only a hint if xdelta
+   was built with the query size fixed */
+static void xd_pick_query_size(void)
+{
+    static gboolean warned = FALSE;
+    gint size;
+
+    size = query_size ? query_size : (1 << QUERY_SIZE_DEFAULT);
+    if ( (xdp_set_query_size_pow(size) == XDP_QUERY_HARDCODED) &&
+         (size != (1 << QUERY_SIZE_DEFAULT)) && !warned ) {
+        xd_error("xdelta was built with a fixed query size of %d bytes\n",
+                 1 << QUERY_SIZE_DEFAULT);
+        warned = TRUE;
+    }
+}
+
+void loki_xdelta_stats(unsigned int *hits, unsigned int *misses,
+                       unsigned int *evictions)
+{
+    *hits = page_hits;
+    *misses = page_misses;
+    *evictions = page_evictions;
+    page_hits = 0;
+    page_misses = 0;
+    page_evictions = 0;
+}
+
 int loki_xdelta(const char *old, const char *new, const char *out)
 {
     int argc;
@@ -336,6 +523,8 @@ int loki_xdelta(const char *old, const char *new, const char *out)
     }
 
     quiet = TRUE;
+    xd_pick_mapped_pages();
+    xd_pick_query_size();
     strcpy(args[0], old);
     strcpy(args[1], new);
     strcpy(args[2], out);
@@ -364,6 +553,9 @@ int loki_xpatch(const char *pat, const char *old, const char *out)
     }
 
     quiet = TRUE;
+    if ( ! patch_from ) {
+        xd_pick_mapped_pages();
+    }
     strcpy(args[0], pat);
     strcpy(args[1], old);
     strcpy(args[2], out);
@@ -378,6 +570,50 @@ int loki_xpatch(const char *pat, const char *old, const char *out)
     return(0);
 }
 
+struct loki_md5 {
+    EdsioMD5Ctx ctx;
+    guint8 head[2];     /* The start of the data, to see if it's gzipped */
+    int head_len;
+};
+
+struct loki_md5 *loki_md5_begin(void)
+{
+    struct loki_md5 *md5;
+
+    md5 = (struct loki_md5 *)malloc(sizeof *md5);
+    if ( md5 ) {
+        edsio_md5_init(&md5->ctx);
+        md5->head_len = 0;
+    }
+    return(md5);
+}
+
+void loki_md5_update(struct loki_md5 *md5, const void *data, int len)
+{
+    const guint8 *bytes = (const guint8 *)data;
+    int i;
+
+    for ( i=0; (i < len) && (md5->head_len < sizeof(md5->head)); ++i ) {
+        md5->head[md5->head_len++] = bytes[i];
+    }
+    edsio_md5_update(&md5->ctx, bytes, len);
+}
+
+void loki_md5_end(struct loki_md5 *md5, char *sum)
+{
+    guint8 digest[16];
+
+    edsio_md5_final(digest, &md5->ctx);
+    edsio_md5_to_string(digest, sum);
+
+    /* md5_compute() checksums gzipped data uncompressed */
+    if ( (md5->head_len == sizeof(md5->head)) &&
+         (md5->head[0] == 037) && (md5->head[1] == 0213) ) {
+        *sum = '\0';
+    }
+    free(md5);
+}
+
 #else
 
 gint
@@ -657,10 +893,10 @@ file_gunzip (const char* name)
   const char* new_name = xd_tmpname ();
   FILE* out = fopen (new_name, FOPEN_WRITE_ARG);
   gzFile in = gzopen (name, "rb");
-  guint8 buf[1024];
+  guint8 buf[XD_COPY_BUFFER];
   int nread;
 
-  while ((nread = gzread (in, buf, 1024)) > 0)
+  while ((nread = gzread (in, buf, sizeof (buf))) > 0)
     {
       if (fwrite (buf, nread, 1, out) != 1)
 	{
@@ -686,17 +922,194 @@ file_gunzip (const char* name)
   return new_name;
 }
 
+/* Inflate up to len bytes of a gzipped file into buf, starting with the
+ * compressed data at *in_pos.  Concatenated gzip members are followed
+ * like gzread() does, and anything else after the end is ignored. */
+static gint
+xd_zinflate (XdFileHandle* fh, z_stream* strm, guint* in_pos, guint8* buf, guint len)
+{
+  guint8 in[1<<14];
+  guint read_pos = *in_pos;
+  gboolean ended = FALSE;
+  gint ret, nread;
+
+  if (lseek (fh->fd, read_pos, SEEK_SET) < 0)
+    {
+      xd_error ("lseek failed: %s\n", g_strerror (errno));
+      return -1;
+    }
+
+  strm->next_out = buf;
+  strm->avail_out = len;
+  strm->avail_in = 0;
+
+  while (strm->avail_out > 0)
+    {
+      if (strm->avail_in == 0)
+	{
+	  if ((nread = read (fh->fd, in, sizeof (in))) < 0)
+	    {
+	      xd_error ("read %s failed: %s\n", fh->name, g_strerror (errno));
+	      return -1;
+	    }
+
+	  if (nread == 0)
+	    break;
+
+	  read_pos += nread;
+	  strm->next_in = in;
+	  strm->avail_in = nread;
+	}
+
+      ret = inflate (strm, Z_NO_FLUSH);
+
+      if (ret == Z_STREAM_END)
+	{
+	  ended = TRUE;
+	  inflateReset (strm);
+	}
+      else if (ret == Z_DATA_ERROR && ended && strm->total_out == 0)
+	{
+	  /* trailing garbage after the last member */
+	  strm->avail_in = 0;
+	  break;
+	}
+      else if (ret != Z_OK)
+	{
+	  xd_error ("inflate %s failed: %s\n", fh->name, strm->msg ? strm->msg : "corrupt data");
+	  return -1;
+	}
+      else
+	{
+	  ended = FALSE;
+	}
+    }
+
+  *in_pos = read_pos - strm->avail_in;
+  strm->next_in = NULL;
+  strm->avail_in = 0;
+
+  return len - strm->avail_out;
+}
+
+/* Read a gzipped file once to find its length, saving the inflate state
+ * at each page boundary so pages can be inflated in any order later,
+ * instead of uncompressing the whole thing to a temporary file */
+static gboolean
+xd_zindex (XdFileHandle* fh)
+{
+  z_stream strm;
+  guint8* page = g_malloc (XD_PAGE_SIZE);
+  guint in_pos = 0;
+  guint length = 0;
+  guint alloc = 0;
+  gint got;
+
+  memset (&strm, 0, sizeof (strm));
+
+  if (inflateInit2 (&strm, 15+32) != Z_OK)
+    {
+      xd_error ("inflateInit failed\n");
+      g_free (page);
+      return FALSE;
+    }
+
+  do
+    {
+      if (fh->zcount == alloc)
+	{
+	  alloc = alloc ? alloc*2 : 16;
+	  fh->zpoints = g_realloc (fh->zpoints, alloc * sizeof (z_stream*));
+	  fh->zoffsets = g_realloc (fh->zoffsets, alloc * sizeof (guint));
+	}
+
+      fh->zpoints[fh->zcount] = g_new0 (z_stream, 1);
+      fh->zoffsets[fh->zcount] = in_pos;
+
+      if (inflateCopy (fh->zpoints[fh->zcount], &strm) != Z_OK)
+	{
+	  xd_error ("inflateCopy failed\n");
+	  g_free (fh->zpoints[fh->zcount]);
+	  got = -1;
+	  break;
+	}
+
+      fh->zcount += 1;
+
+      if ((got = xd_zinflate (fh, &strm, &in_pos, page, XD_PAGE_SIZE)) > 0)
+	length += got;
+    }
+  while (got == XD_PAGE_SIZE);
+
+  inflateEnd (&strm);
+  g_free (page);
+
+  if (got < 0)
+    return FALSE;
+
+  fh->length = length;
+  fh->narrow_high = length;
+
+  return TRUE;
+}
+
+/* Inflate one page of a gzipped file from the state saved for it */
+static gboolean
+xd_zread_page (XdFileHandle* fh, guint pgno, guint8* buf, guint len)
+{
+  z_stream strm;
+  guint in_pos;
+  gint got;
+
+  if (pgno >= fh->zcount || inflateCopy (&strm, fh->zpoints[pgno]) != Z_OK)
+    {
+      xd_error ("inflateCopy failed\n");
+      return FALSE;
+    }
+
+  in_pos = fh->zoffsets[pgno];
+  got = xd_zinflate (fh, &strm, &in_pos, buf, len);
+  inflateEnd (&strm);
+
+  if (got != len)
+    {
+      if (got >= 0)
+	xd_error ("unexpected EOF in %s\n", fh->name);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+xd_zfree (XdFileHandle* fh)
+{
+  guint i;
+
+  for (i = 0; i < fh->zcount; i += 1)
+    {
+      inflateEnd (fh->zpoints[i]);
+      g_free (fh->zpoints[i]);
+    }
+
+  g_free (fh->zpoints);
+  g_free (fh->zoffsets);
+
+  fh->zpoints = NULL;
+  fh->zoffsets = NULL;
+  fh->zcount = 0;
+}
+
 static XdFileHandle*
 open_read_noseek_handle (const char* name, gboolean* is_compressed, gboolean will_read, gboolean honor_pristine)
 {
   XdFileHandle* fh;
   const char* name0 = name;
 
-  /* we _could_ stream-read this file if compressed, but it adds a
-   * lot of complexity.  the library can handle it, just set the
-   * length to (XDELTA_MAX_FILE_LEN-1) and make sure that the end
-   * of file condition is set when on the last page.  However, I
-   * don't feel like it. */
+  /* compressed files that are mapped a page at a time are inflated in
+   * place.  a compressed file that's read as a stream still has to be
+   * uncompressed first, since it seeks into compressed sections within
+   * it, but only a patch file that was gzipped as a whole does that. */
   if (honor_pristine && pristine)
     *is_compressed = FALSE;
   else
@@ -705,17 +1118,25 @@ open_read_noseek_handle (const char* name, gboolean* is_compressed, gboolean wil
         return NULL;
     }
 
-  if ((* is_compressed) && ! (name = file_gunzip (name)))
+  if ((* is_compressed) && will_read && ! (name = file_gunzip (name)))
     return NULL;
 
   if (! (fh = open_common (name, name0)))
     return NULL;
 
+  if ((* is_compressed) && ! will_read && ! xd_zindex (fh))
+    return NULL;
+
   fh->type = READ_NOSEEK_TYPE;
+  fh->sequential = TRUE;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise (fh->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
   edsio_md5_init (&fh->ctx);
 
-  if (*is_compressed)
+  if ((*is_compressed) && will_read)
     fh->cleanup = name;
 
   if (will_read)
@@ -745,6 +1166,8 @@ xd_read_close (XdFileHandle* fh)
   if (fh->cleanup)
     unlink (fh->cleanup);
 
+  xd_zfree (fh);
+
   close (fh->fd);
 
   if (fh->in)
@@ -765,16 +1188,36 @@ open_read_seek_handle (const char* name, gboolean* is_compressed, gboolean honor
 	return NULL;
     }
 
-  if ((* is_compressed) && ! (name = file_gunzip (name)))
+  if (! (fh = open_common (name, name0)))
     return NULL;
 
-  if (! (fh = open_common (name, name0)))
+  if ((* is_compressed) && ! xd_zindex (fh))
     return NULL;
 
   fh->type = READ_SEEK_TYPE;
 
-  if (*is_compressed)
-    fh->cleanup = name;
+  init_table (fh);
+
+  edsio_md5_init (&fh->ctx);
+
+  return fh;
+}
+
+/* Open a part of a file, which is then read as if it were the whole
+ * file.  The part has to start on a page boundary. */
+static XdFileHandle*
+open_window_handle (const char* name, off_t off, guint len, gboolean sequential)
+{
+  XdFileHandle* fh;
+
+  if (! (fh = open_common (name, name)))
+    return NULL;
+
+  fh->window = off;
+  fh->length = len;
+  fh->narrow_high = len;
+  fh->type = sequential ? READ_NOSEEK_TYPE : READ_SEEK_TYPE;
+  fh->sequential = sequential;
 
   init_table (fh);
 
@@ -1106,6 +1549,9 @@ xd_handle_write (XdFileHandle *fh, const char *buf, gsize nbyte)
   if (! no_verify)
     edsio_md5_update (&fh->ctx, (guint8 *)buf, nbyte);
 
+  if (fh->sink)
+    edsio_md5_update (fh->sink, (guint8 *)buf, nbyte);
+
   if (! (*fh->out_write) (fh, buf, nbyte))
     {
       xd_error ("write failed: %s\n", g_strerror (errno));
@@ -1119,12 +1565,120 @@ xd_handle_write (XdFileHandle *fh, const char *buf, gsize nbyte)
   return TRUE;
 }
 
+#ifdef XD_ZERO_COPY
+/* Have the kernel copy part of one file to the end of another */
+static gssize
+xd_copy_range (gint in_fd, off_t in_off, gint out_fd, gsize len)
+{
+  off_t pos = in_off;
+
+#ifdef XD_COPY_FILE_RANGE
+  {
+    loff_t range_pos = in_off;
+    gssize n = copy_file_range (in_fd, &range_pos, out_fd, NULL, len, 0);
+
+    if (n > 0)
+      return n;
+  }
+#endif
+
+  return sendfile (out_fd, in_fd, &pos, len);
+}
+#endif
+
+/* Write data that is also at the given offset of a file being read,
+ * letting the kernel move it across if the output is a plain file */
+static gboolean
+xd_handle_write_range (XdFileHandle *fh, const char *buf, gsize nbyte, XdFileHandle *from, guint off)
+{
+#ifdef XD_ZERO_COPY
+  gsize done = 0;
+  gssize n;
+
+  if (fh->out_write != &xd_fwrite || from->zpoints || nbyte < XD_ZERO_COPY_MIN)
+    {
+      if (from != fh->cloned || off != fh->real_length || nbyte < XD_CLONE_MIN)
+	return xd_handle_write (fh, buf, nbyte);
+    }
+
+  if (fh->reset_length_next_write)
+    {
+      fh->reset_length_next_write = FALSE;
+      fh->length = 0;
+      fh->narrow_high = 0;
+    }
+
+  /* the data is checksummed from the mapped page, which is
+   * cheaper than copying it */
+  if (! no_verify)
+    edsio_md5_update (&fh->ctx, (guint8 *)buf, nbyte);
+
+  if (fh->sink)
+    edsio_md5_update (fh->sink, (guint8 *)buf, nbyte);
+
+  if (fflush (fh->out) != 0)
+    {
+      xd_error ("write failed: %s\n", g_strerror (errno));
+      return FALSE;
+    }
+
+  /* the output was cloned from this file and the data is at the same
+   * place in both, so it's already there */
+  if (from == fh->cloned && off == fh->real_length)
+    {
+      if (fseeko (fh->out, nbyte, SEEK_CUR) != 0)
+	{
+	  xd_error ("seek failed: %s\n", g_strerror (errno));
+	  return FALSE;
+	}
+
+      done = nbyte;
+    }
+
+  while (done < nbyte)
+    {
+      if ((n = xd_copy_range (from->fd, from->window + off + done, fh->out_fd, nbyte - done)) <= 0)
+	break;
+
+      done += n;
+    }
+
+  /* whatever the kernel wouldn't copy is written as usual */
+  if (done < nbyte && ! (*fh->out_write) (fh, buf + done, nbyte - done))
+    {
+      xd_error ("write failed: %s\n", g_strerror (errno));
+      return FALSE;
+    }
+
+  fh->length += nbyte;
+  fh->real_length += nbyte;
+  fh->narrow_high += nbyte;
+
+  return TRUE;
+#else
+  return xd_handle_write (fh, buf, nbyte);
+#endif
+}
+
 static gboolean
 xd_handle_really_close (XdFileHandle *fh)
 {
   g_assert (fh->type == WRITE_TYPE);
 
-  if (! (* fh->out_close) (fh) || close (fh->out_fd) < 0)
+  if (! (* fh->out_close) (fh))
+    {
+      xd_error ("write failed: %s\n", g_strerror (errno));
+      return FALSE;
+    }
+
+  /* a cloned output keeps whatever of the old file is past its end */
+  if (fh->cloned && ftruncate (fh->out_fd, fh->real_length) < 0)
+    {
+      xd_error ("truncate %s failed: %s\n", fh->name, g_strerror (errno));
+      return FALSE;
+    }
+
+  if (close (fh->out_fd) < 0)
     {
       xd_error ("write failed: %s\n", g_strerror (errno));
       return FALSE;
@@ -1133,6 +1687,30 @@ xd_handle_really_close (XdFileHandle *fh)
   return TRUE;
 }
 
+/* Start the output as a clone of the file it's patched from, where the
+ * filesystem can share the blocks, so that only the data the delta
+ * changes has to be written.  The output has to be empty, and the file
+ * read as a whole without being uncompressed. */
+static void
+xd_handle_clone (XdFileHandle *fh, XdFileHandle *from)
+{
+#ifdef XD_CLONE
+  struct stat buf;
+
+  if (fh->out_write != &xd_fwrite || fh->real_length != 0 ||
+      from->zpoints || from->window != 0 ||
+      fstat (from->fd, &buf) < 0 || buf.st_size != from->length)
+    return;
+
+  /* anything that won't clone, such as another filesystem, is written
+   * out in full as usual */
+  if (ioctl (fh->out_fd, FICLONE, from->fd) < 0)
+    return;
+
+  fh->cloned = from;
+#endif
+}
+
 static LRU*
 pull_lru (XdFileHandle* fh, LRU* lru)
 {
@@ -1183,13 +1761,16 @@ really_free_one_page (XdFileHandle* fh)
       to_unmap = on_page (fh, lru_dead->page);
 
       fh->lru_count -= 1;
+      page_evictions += 1;
 
       if (to_unmap > 0)
 	{
 #ifdef WIN32
 	  g_free (lru_dead->buffer);
 #else
-	  if (munmap (lru_dead->buffer, to_unmap))
+	  if (fh->zpoints)
+	    g_free (lru_dead->buffer);
+	  else if (munmap (lru_dead->buffer, to_unmap))
 	    {
 	      xd_error ("munmap failed: %s\n", g_strerror (errno));
 	      return FALSE;
@@ -1229,7 +1810,9 @@ really_free_all_pages (XdFileHandle* fh)
 #ifdef WIN32
 	  g_free (lru_dead->buffer);
 #else
-	  if (munmap (lru_dead->buffer, to_unmap))
+	  if (fh->zpoints)
+	    g_free (lru_dead->buffer);
+	  else if (munmap (lru_dead->buffer, to_unmap))
 	    {
 	      xd_error ("munmap failed: %s\n", g_strerror (errno));
 	      return FALSE;
@@ -1261,13 +1844,18 @@ print_lru (XdFileHandle* fh)
 static gboolean
 make_lru_room (XdFileHandle* fh)
 {
-  if (fh->lru_count == max_mapped_pages)
+  /* the limit can drop while a file is open, and if every page
+   * is in use there's nothing to do but go over it */
+  while (fh->lru_count >= max_mapped_pages)
     {
+      guint count = fh->lru_count;
+
       if (! really_free_one_page (fh))
 	return FALSE;
-    }
 
-  g_assert (fh->lru_count < max_mapped_pages);
+      if (fh->lru_count == count)
+	break;
+    }
 
   return TRUE;
 }
@@ -1309,6 +1897,11 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
       pull_lru (fh, lru);
     }
 
+  if (lru->buffer)
+    page_hits += 1;
+  else
+    page_misses += 1;
+
   lru->prev = fh->lru_head;
   lru->next = NULL;
 
@@ -1335,12 +1928,19 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 
       fh->lru_count += 1;
 
-      if (to_map > 0)
+      if (to_map > 0 && fh->zpoints)
+	{
+	  lru->buffer = g_malloc (to_map);
+
+	  if (! xd_zread_page (fh, pgno, lru->buffer, to_map))
+	    return -1;
+	}
+      else if (to_map > 0)
 	{
 #ifdef WIN32
 	  lru->buffer = g_malloc (to_map);
 
-	  if (lseek (fh->fd, pgno * XD_PAGE_SIZE, SEEK_SET) < 0)
+	  if (lseek (fh->fd, fh->window + (off_t) pgno * XD_PAGE_SIZE, SEEK_SET) < 0)
 	    {
 	      xd_error ("lseek failed: %s\n", g_strerror (errno));
 	      return -1;
@@ -1352,11 +1952,23 @@ xd_handle_map_page (XdFileHandle *fh, guint pgno, const guint8** mem)
 	      return -1;
 	    }
 #else
-	  if ( (lru->buffer = mmap (NULL, to_map, PROT_READ, MAP_PRIVATE, fh->fd, pgno * XD_PAGE_SIZE)) == MAP_FAILED )
+	  if ( (lru->buffer = mmap (NULL, to_map, PROT_READ, MAP_PRIVATE, fh->fd, fh->window + (off_t) pgno * XD_PAGE_SIZE)) == MAP_FAILED )
 	    {
 	      xd_error ("mmap failed: %s\n", g_strerror (errno));
 	      return -1;
 	    }
+
+	  /* Start reading the next page while this one is used */
+	  if (fh->sequential)
+	    {
+#ifdef MADV_SEQUENTIAL
+	      madvise (lru->buffer, to_map, MADV_SEQUENTIAL);
+#endif
+#ifdef POSIX_FADV_WILLNEED
+	      if (pgno < xd_handle_pages (fh))
+		posix_fadvise (fh->fd, fh->window + (off_t) (pgno + 1) * XD_PAGE_SIZE, XD_PAGE_SIZE, POSIX_FADV_WILLNEED);
+#endif
+	    }
 #endif
 	}
       else
@@ -1423,19 +2035,99 @@ xd_handle_unmap_page (XdFileHandle *fh, guint pgno, const guint8** mem)
   return TRUE;
 }
 
+/* Remember the copies a delta will make from a file, to read ahead of them */
+static void
+xd_handle_plan (XdFileHandle *fh, XdeltaControl *cont, XdeltaSourceInfo *info)
+{
+  guint i;
+
+  for (i = 0; i < cont->source_info_len; i += 1)
+    {
+      if (cont->source_info[i] == info)
+	{
+	  fh->plan = cont->inst;
+	  fh->plan_len = cont->inst_len;
+	  fh->plan_index = i;
+	  fh->plan_next = 0;
+	  fh->plan_ahead = 0;
+	  fh->plan_bytes = 0;
+	  break;
+	}
+    }
+}
+
+/* Called as data is copied, this asks for the data of the next few
+ * copies so it's ready by the time it's needed */
+static void
+xd_handle_read_ahead (XdFileHandle *fh, guint off, guint len)
+{
+#ifdef POSIX_FADV_WILLNEED
+  const XdeltaInstruction* inst = NULL;
+  guint i, j, end;
+
+  /* gzipped files aren't read where the copies are */
+  if (! fh->plan || fh->zpoints)
+    return;
+
+  /* Find the copy being made, they come in order */
+  end = MIN (fh->plan_len, fh->plan_next + XD_READ_AHEAD_SEARCH);
+
+  for (i = fh->plan_next; i < end; i += 1)
+    {
+      inst = fh->plan + i;
+
+      if (inst->index == fh->plan_index &&
+	  off >= inst->offset && off < inst->offset + inst->length)
+	break;
+    }
+
+  if (i == end)
+    return;
+
+  if (off + len >= inst->offset + inst->length)
+    i += 1;
+
+  for (j = fh->plan_next; j < i && j < fh->plan_ahead; j += 1)
+    {
+      if (fh->plan[j].index == fh->plan_index)
+	fh->plan_bytes -= MIN (fh->plan_bytes, fh->plan[j].length);
+    }
+
+  fh->plan_next = i;
+
+  if (fh->plan_ahead < i)
+    {
+      fh->plan_ahead = i;
+      fh->plan_bytes = 0;
+    }
+
+  while (fh->plan_ahead < fh->plan_len &&
+	 fh->plan_bytes < XD_PAGE_SIZE * XD_READ_AHEAD_PAGES)
+    {
+      inst = fh->plan + fh->plan_ahead++;
+
+      if (inst->index != fh->plan_index)
+	continue;
+
+      posix_fadvise (fh->fd, fh->window + inst->offset, inst->length, POSIX_FADV_WILLNEED);
+      fh->plan_bytes += inst->length;
+    }
+#endif
+}
+
 static gboolean
 xd_handle_copy (XdFileHandle *from, XdFileHandle *to, guint off, guint len)
 {
   if (from->in)
     {
-      char buf[1024];
+      char buf[XD_COPY_BUFFER];
 
       /*if (! xd_handle_set_pos (from, off))
 	return FALSE;*/
 
       while (len > 0)
 	{
-	  guint r = MIN (1024, len);
+	  guint r = MIN (sizeof (buf), len);
 
 	  if (xd_handle_read (from, buf, r) != r)
 	    return FALSE;
@@ -1448,6 +2140,8 @@ xd_handle_copy (XdFileHandle *from, XdFileHandle *to, guint off, guint len)
     }
   else
     {
+      xd_handle_read_ahead (from, off, len);
+
       while (len > 0)
 	{
 	  guint off_page = off / XD_PAGE_SIZE;
@@ -1476,7 +2170,7 @@ xd_handle_copy (XdFileHandle *from, XdFileHandle *to, guint off, guint len)
 	  if (xd_handle_map_page (from, off_page, &from->copy_page) < 0)
 	    return FALSE;
 
-	  if (! xd_handle_write (to, (char *)from->copy_page + off_off, copy))
+	  if (! xd_handle_write_range (to, (char *)from->copy_page + off_off, copy, from, off))
 	    return FALSE;
 
 	  if (! xd_handle_unmap_page (from, off_page, &from->copy_page))
@@ -1570,11 +2264,22 @@ delta_command (gint argc, gchar** argv)
       return 2;
     }
 
-  if (! (from = open_read_seek_handle (argv[0], &from_is_compressed, TRUE)))
-    return 2;
+  if (window_set)
+    {
+      if (! (from = open_window_handle (argv[0], window_from_off, window_from_len, FALSE)))
+	return 2;
 
-  if (! (to = open_read_noseek_handle (argv[1], &to_is_compressed, FALSE, TRUE)))
-    return 2;
+      if (! (to = open_window_handle (argv[1], window_to_off, window_to_len, TRUE)))
+	return 2;
+    }
+  else
+    {
+      if (! (from = open_read_seek_handle (argv[0], &from_is_compressed, TRUE)))
+	return 2;
+
+      if (! (to = open_read_noseek_handle (argv[1], &to_is_compressed, FALSE, TRUE)))
+	return 2;
+    }
 
   if (argc == 2 || strcmp (argv[2], "-") == 0)
     {
@@ -1924,17 +2629,29 @@ patch_command (gint argc, gchar** argv)
     }
   else
     {
-      to_out_fd = open (patch->to_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+      to_out_fd = open (patch->to_name, O_WRONLY | O_CREAT | (patch_append ? 0 : O_TRUNC) | O_BINARY, 0666);
 
       if (to_out_fd < 0)
 	{
 	  xd_error ("open %s failed: %s\n", patch->to_name, g_strerror (errno));
 	  return 2;
 	}
+
+      if (patch_append && lseek (to_out_fd, 0, SEEK_END) < 0)
+	{
+	  xd_error ("lseek %s failed: %s\n", patch->to_name, g_strerror (errno));
+	  return 2;
+	}
     }
 
   to_out = open_write_handle (to_out_fd, patch->to_name);
 
+  /* The data is checksummed before it's compressed, so the sink
+   * only sees what goes into the file if it isn't */
+  if (patch->patch_flags & FLAG_TO_COMPRESSED)
+    patch_sink = NULL;
+  to_out->sink = patch_sink;
+
   if ((patch->patch_flags & FLAG_TO_COMPRESSED) && (xd_begin_compression (to_out) < 0))
     return 2;
 
@@ -1943,7 +2660,13 @@ patch_command (gint argc, gchar** argv)
       XdFileHandle* from_in;
       gboolean from_is_compressed = FALSE;
 
-      if (! (from_in = open_read_seek_handle (patch->from_name, &from_is_compressed, TRUE)))
+      /* The source can only be reused if it doesn't need uncompressing */
+      if (patch_from && (patch->patch_flags & FLAG_FROM_COMPRESSED))
+	patch_from = NULL;
+
+      if (patch_from)
+	from_in = patch_from;
+      else if (! (from_in = open_read_seek_handle (patch->from_name, &from_is_compressed, TRUE)))
 	return 2;
 
       if (from_is_compressed != ((patch->patch_flags & FLAG_FROM_COMPRESSED) && 1))
@@ -1957,6 +2680,12 @@ patch_command (gint argc, gchar** argv)
 	  return 2;
 	}
 
+      xd_handle_plan (from_in, patch->cont, patch->from_source);
+
+      if (! patch_append && ! (patch->patch_flags & FLAG_TO_COMPRESSED) &&
+	  to_out_fd != STDOUT_FILENO)
+	xd_handle_clone (to_out, from_in);
+
       patch->from_source->in = (XdeltaStream*) from_in;
     }
 
@@ -1966,7 +2695,7 @@ patch_command (gint argc, gchar** argv)
   if (! xdp_apply_delta (patch->cont, (FileHandle*) to_out))
     return 2;
 
-  if (patch->from_source)
+  if (patch->from_source && (XdFileHandle*) patch->from_source->in != patch_from)
     xd_read_close ((XdFileHandle*) patch->from_source->in);
 
   xd_read_close (patch->patch_in);
@@ -1976,3 +2705,302 @@ patch_command (gint argc, gchar** argv)
 
   return 0;
 }
+
+#ifdef LOKI_PATCH
+
+struct loki_xsource {
+    XdFileHandle *fh;
+};
+
+void loki_xsource_close(struct loki_xsource *src)
+{
+    if ( src ) {
+        xd_read_close(src->fh);
+        g_free(src->fh);
+        g_free(src);
+    }
+}
+
+struct loki_xsource *loki_xsource_open(const char *old, char *sum)
+{
+    struct loki_xsource *src;
+    const guint8 *md5;
+
+    quiet = TRUE;
+    no_verify = FALSE;
+    xd_pick_mapped_pages();
+    src = g_new0(struct loki_xsource, 1);
+    src->fh = open_common(old, old);
+    if ( ! src->fh ) {
+        g_free(src);
+        return(NULL);
+    }
+    src->fh->type = READ_SEEK_TYPE;
+    init_table(src->fh);
+    edsio_md5_init(&src->fh->ctx);
+
+    /* Map in the whole file, the pages stay around for the delta */
+    src->fh->sequential = TRUE;
+    md5 = xd_handle_checksum_md5(src->fh);
+    src->fh->sequential = FALSE;
+    if ( ! md5 ) {
+        loki_xsource_close(src);
+        return(NULL);
+    }
+    edsio_md5_to_string(md5, sum);
+    g_free((gpointer)md5);
+    return(src);
+}
+
+/* md5_compute() checksums a gzipped file uncompressed, so the sum taken
+   as it was written won't do */
+static gboolean loki_gzipped_output(const char *out)
+{
+    gboolean is_compressed;
+
+    return(file_gzipped(out, &is_compressed) && is_compressed);
+}
+
+int loki_xpatch_source(const char *pat, struct loki_xsource *old,
+                       const char *out, char *sum)
+{
+    EdsioMD5Ctx ctx;
+    guint8 md5[16];
+    int retval;
+
+    edsio_md5_init(&ctx);
+    patch_from = old->fh;
+    patch_sink = &ctx;
+    retval = loki_xpatch(pat, old->fh->name, out);
+    if ( (retval == 0) && patch_sink && !loki_gzipped_output(out) ) {
+        edsio_md5_final(md5, &ctx);
+        edsio_md5_to_string(md5, sum);
+    } else {
+        *sum = '\0';
+    }
+    patch_from = NULL;
+    patch_sink = NULL;
+    return(retval);
+}
+
+/* A multi-part delta starts with this, the segment size and the number
+   of parts, and then each part follows its length */
+#define XD_SEGMENT_MAGIC    "%XDSEG1%"
+#define XD_SEGMENT_MAGIC_LEN 8
+
+/* The part of the old file a segment of the new one is diffed against,
+   which is the same part of the old file, or its last segment if it's
+   shorter than that */
+static void segment_window(off_t size, long segment, int part,
+                           off_t *off, guint *len)
+{
+    *off = (off_t)part * segment;
+    if ( (*off >= size) && (size > 0) ) {
+        *off = ((size - 1) / segment) * segment;
+    }
+    if ( *off >= size ) {
+        *off = 0;
+        *len = 0;
+    } else {
+        *len = MIN(segment, size - *off);
+    }
+}
+
+static int write_length(FILE *fp, off_t len)
+{
+    guint32 words[2];
+
+    words[0] = g_htonl((guint32)(len >> 32));
+    words[1] = g_htonl((guint32)len);
+    return(fwrite(words, sizeof(words), 1, fp) == 1 ? 0 : -1);
+}
+
+static int read_length(FILE *fp, off_t *len)
+{
+    guint32 words[2];
+
+    if ( fread(words, sizeof(words), 1, fp) != 1 ) {
+        return(-1);
+    }
+    *len = ((off_t)g_ntohl(words[0]) << 32) | g_ntohl(words[1]);
+    return(0);
+}
+
+/* Copy 'len' bytes from one file to another */
+static int copy_part(FILE *in, FILE *out, off_t len)
+{
+    char data[XD_COPY_BUFFER];
+    size_t amount;
+
+    while ( len > 0 ) {
+        amount = MIN(sizeof(data), len);
+        if ( (fread(data, amount, 1, in) != 1) ||
+             (fwrite(data, amount, 1, out) != 1) ) {
+            return(-1);
+        }
+        len -= amount;
+    }
+    return(0);
+}
+
+int loki_xdelta_segments(const char *old, const char *new, const char *out,
+                         long segment)
+{
+    struct stat old_sb, new_sb, part_sb;
+    char part_path[PATH_MAX];
+    FILE *out_fp, *part_fp;
+    guint32 header[2];
+    int i, count, retval;
+
+    if ( (segment <= 0) || (segment % XD_PAGE_SIZE) ) {
+        xd_error("segment size must be a multiple of the page size\n");
+        return(-1);
+    }
+    if ( (stat(old, &old_sb) < 0) || (stat(new, &new_sb) < 0) ) {
+        xd_error("stat failed: %s\n", g_strerror(errno));
+        return(-1);
+    }
+    count = (new_sb.st_size + segment - 1) / segment;
+    if ( count == 0 ) {
+        count = 1;
+    }
+    out_fp = fopen(out, FOPEN_WRITE_ARG);
+    if ( ! out_fp ) {
+        xd_error("open %s failed: %s\n", out, g_strerror(errno));
+        return(-1);
+    }
+    header[0] = g_htonl(segment);
+    header[1] = g_htonl(count);
+    if ( (fwrite(XD_SEGMENT_MAGIC, XD_SEGMENT_MAGIC_LEN, 1, out_fp) != 1) ||
+         (fwrite(header, sizeof(header), 1, out_fp) != 1) ) {
+        xd_error("write %s failed: %s\n", out, g_strerror(errno));
+        fclose(out_fp);
+        return(-1);
+    }
+
+    /* Each segment is diffed on its own, and added to the end */
+    sprintf(part_path, "%s.part", out);
+    retval = 0;
+    for ( i=0; (retval == 0) && (i < count); ++i ) {
+        window_to_off = (off_t)i * segment;
+        window_to_len = MIN(segment, new_sb.st_size - window_to_off);
+        segment_window(old_sb.st_size, segment, i,
+                       &window_from_off, &window_from_len);
+        window_set = TRUE;
+        retval = loki_xdelta(old, new, part_path);
+        window_set = FALSE;
+        if ( retval < 0 ) {
+            break;
+        }
+        part_fp = fopen(part_path, FOPEN_READ_ARG);
+        if ( ! part_fp ||
+             fstat(fileno(part_fp), &part_sb) < 0 ||
+             write_length(out_fp, part_sb.st_size) < 0 ||
+             copy_part(part_fp, out_fp, part_sb.st_size) < 0 ) {
+            xd_error("write %s failed: %s\n", out, g_strerror(errno));
+            retval = -1;
+        }
+        if ( part_fp ) {
+            fclose(part_fp);
+        }
+    }
+    unlink(part_path);
+    if ( fclose(out_fp) != 0 ) {
+        xd_error("write %s failed: %s\n", out, g_strerror(errno));
+        retval = -1;
+    }
+    return(retval);
+}
+
+int loki_xpatch_segments(const char *pat, const char *old, const char *out,
+                         char *sum)
+{
+    EdsioMD5Ctx ctx;
+    guint8 md5[16];
+    struct stat sb;
+    char magic[XD_SEGMENT_MAGIC_LEN];
+    char part_path[PATH_MAX];
+    FILE *pat_fp, *part_fp;
+    guint32 header[2];
+    long segment;
+    off_t len;
+    int i, fd, count, retval;
+
+    *sum = '\0';
+    pat_fp = fopen(pat, FOPEN_READ_ARG);
+    if ( ! pat_fp ) {
+        xd_error("open %s failed: %s\n", pat, g_strerror(errno));
+        return(-1);
+    }
+    if ( (fread(magic, sizeof(magic), 1, pat_fp) != 1) ||
+         (memcmp(magic, XD_SEGMENT_MAGIC, sizeof(magic)) != 0) ||
+         (fread(header, sizeof(header), 1, pat_fp) != 1) ) {
+        xd_error("%s: not a multi-part delta\n", pat);
+        fclose(pat_fp);
+        return(-1);
+    }
+    segment = g_ntohl(header[0]);
+    count = g_ntohl(header[1]);
+    if ( stat(old, &sb) < 0 ) {
+        xd_error("stat %s failed: %s\n", old, g_strerror(errno));
+        fclose(pat_fp);
+        return(-1);
+    }
+    fd = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if ( fd < 0 ) {
+        xd_error("open %s failed: %s\n", out, g_strerror(errno));
+        fclose(pat_fp);
+        return(-1);
+    }
+    close(fd);
+
+    /* Only one part of the delta and one segment of the old file are
+       held at a time, and each segment of the new file is added on */
+    xd_pick_mapped_pages();
+    edsio_md5_init(&ctx);
+    sprintf(part_path, "%s.part", out);
+    retval = 0;
+    for ( i=0; (retval == 0) && (i < count); ++i ) {
+        part_fp = fopen(part_path, FOPEN_WRITE_ARG);
+        if ( !part_fp || (read_length(pat_fp, &len) < 0) ||
+             (copy_part(pat_fp, part_fp, len) < 0) ) {
+            xd_error("%s: corrupt or truncated delta\n", pat);
+            retval = -1;
+        }
+        if ( part_fp && (fclose(part_fp) != 0) ) {
+            retval = -1;
+        }
+        if ( retval < 0 ) {
+            break;
+        }
+        segment_window(sb.st_size, segment, i,
+                       &window_from_off, &window_from_len);
+        patch_from = open_window_handle(old, window_from_off,
+                                        window_from_len, FALSE);
+        if ( ! patch_from ) {
+            retval = -1;
+            break;
+        }
+        patch_sink = &ctx;
+        patch_append = TRUE;
+        retval = loki_xpatch(part_path, old, out);
+        patch_append = FALSE;
+        xd_read_close(patch_from);
+        g_free(patch_from);
+        patch_from = NULL;
+        if ( ! patch_sink ) {
+            xd_error("%s: unexpected compressed output\n", pat);
+            retval = -1;
+        }
+        patch_sink = NULL;
+    }
+    fclose(pat_fp);
+    unlink(part_path);
+    if ( (retval == 0) && !loki_gzipped_output(out) ) {
+        edsio_md5_final(md5, &ctx);
+        edsio_md5_to_string(md5, sum);
+    }
+    return(retval);
+}
+
+#endif /* LOKI_PATCH */
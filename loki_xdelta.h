@@ -2,3 +2,55 @@
 /* XDelta is linked in, for space reasons .. I wish it didn't use glib.. */
 extern int loki_xdelta(const char *old, const char *new, const char *out);
 extern int loki_xpatch(const char *pat, const char *old, const char *out);
+
+/* Very large files are diffed a segment at a time, each segment of the
+   new file against the same segment of the old one, so the memory used
+   doesn't grow with the size of the files.  The segment size has to be
+   a multiple of the page size.  The delta holds one part per segment,
+   and is applied a part at a time, taking the checksum of the output.
+ */
+extern int loki_xdelta_segments(const char *old, const char *new,
+                                const char *out, long segment);
+extern int loki_xpatch_segments(const char *pat, const char *old,
+                                const char *out, char *sum);
+
+/* Files are read in pages of the given size (a power of two, 1 MB by
+   default), and each file may have up to the given number of pages
+   mapped at once - by default that's chosen from the free memory.
+ */
+extern int loki_xdelta_page_size(int size);
+extern int loki_xdelta_get_page_size(void);
+extern void loki_xdelta_mapped_pages(int pages);
+
+/* The block size new files are matched against old ones in (a power of
+   two from 2 to 64 bytes, or 0 for xdelta's own 16 bytes).  Smaller
+   blocks find more matches, larger ones are faster and use less memory.
+ */
+extern int loki_xdelta_query_size(int size);
+
+/* How often a page was already mapped, had to be read in, or was thrown
+   out to make room, since the last time this was asked.
+ */
+extern void loki_xdelta_stats(unsigned int *hits, unsigned int *misses,
+                              unsigned int *evictions);
+
+/* A file can be opened and checksummed before it's patched, the delta
+   then reuses the pages that were read for the checksum.  The checksum
+   of the output is taken as it's written, or is set to "" if the output
+   has to be checksummed separately.
+ */
+struct loki_xsource;
+extern struct loki_xsource *loki_xsource_open(const char *old, char *sum);
+extern void loki_xsource_close(struct loki_xsource *old);
+extern int loki_xpatch_source(const char *pat, struct loki_xsource *old,
+                              const char *out, char *sum);
+
+/* Checksum data as it goes by, the sum is in the same form md5_compute()
+   gives, and the context is freed by loki_md5_end().  md5_compute()
+   checksums gzipped data uncompressed, so if the data is gzipped the sum
+   is set to "" and the data has to be checksummed separately.
+ */
+struct loki_md5;
+extern struct loki_md5 *loki_md5_begin(void);
+extern void loki_md5_update(struct loki_md5 *md5, const void *data, int len);
+extern void loki_md5_end(struct loki_md5 *md5, char *sum);
@@ -4,11 +4,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "loki_patch.h"
 #include "load_patch.h"
 #include "tree_patch.h"
 #include "save_patch.h"
+#include "loki_xdelta.h"
+#include "md5_cache.h"
 #include "log_output.h"
 
 static void print_usage(const char *argv0)
@@ -16,7 +19,7 @@ static void print_usage(const char *argv0)
     fprintf(stderr,
 "Loki Patch Tools " VERSION "\n");
     fprintf(stderr,
-"Usage: %s patch-file command arguments\n"
+"Usage: %s [--jobs N] [--page-size BYTES] [--mapped-pages N] [--segment-size BYTES] [--query-size SIZES|auto] [--md5-cache FILE] [--chain] patch-file command arguments\n"
 "Where command and arguments are one of:\n"
 "   delta-install old-tree1 [old-tree2] [old-tree3] new-tree\n"
 "   delta-file old-file new-file installed-name\n"
@@ -26,6 +29,7 @@ static void print_usage(const char *argv0)
 "   symlink-file link installed-name\n"
 "   del-path installed-path\n"
 "   del-file installed-file\n"
+"   merge-patch patch-dir1 [patch-dir2] [patch-dir3]\n"
 "   load-file commands-file\n",
     argv0);
 }
@@ -83,10 +87,39 @@ static int split_line(char *line, char **args)
     return(argc);
 }
 
+/* Set when deltas between the old versions are chained */
+static int chain = 0;
+
+/* The query sizes to use, or "auto" to pick them from the files */
+static const char *query_size = NULL;
+
+/* The file the checksums of the trees are kept in between runs */
+static const char *md5_cache = NULL;
+
+/* Files larger than a segment are diffed a segment at a time, so the
+   segments have to be a whole number of pages.  The page size may be
+   given after it, so it's checked once all the options are read. */
+static long segment_size = 0;
+
+static int set_segment_size(const char *value)
+{
+    long size;
+
+    size = atol(value);
+    if ( (size < (64*1024)) || (size > (1024*1024*1024)) ||
+         (size & (size-1)) ) {
+        logme(LOG_ERROR, "Segment size must be a power of two from 64K to 1G\n");
+        return(-1);
+    }
+    segment_size = size;
+    return(0);
+}
+
 static int interpret_args(const char *argv0, int argc, char *args[],
                                                     loki_patch *patch)
 {
     if ( strcmp(args[0], "delta-install") == 0 ) {
+        const char **old_trees;
         int i, result;
 
         if ( argc < 3 ) {
@@ -94,11 +127,22 @@ static int interpret_args(const char *argv0, int argc, char *args[],
             print_usage(argv0);
             return(-1);
         }
-        result = 0;
-        for ( i=1; (result == 0) && i < (argc-1); ++i ) {
+        old_trees = (const char **)malloc((argc-2) * (sizeof *old_trees));
+        if ( ! old_trees ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+        for ( i=1; i < (argc-1); ++i ) {
             printf("delta-install %s %s\n", args[i], args[argc-1]);
-            result = tree_patch(args[i], "", args[argc-1], "", patch);
+            if ( chain ) {
+                /* Newest first, so each version chains to the one after it */
+                old_trees[argc-2-i] = args[i];
+            } else {
+                old_trees[i-1] = args[i];
+            }
         }
+        result = tree_patch_versions(old_trees, argc-2, args[argc-1], patch);
+        free(old_trees);
         return(result);
     }
 
@@ -172,6 +216,23 @@ static int interpret_args(const char *argv0, int argc, char *args[],
         return tree_del_file(args[1], patch);
     }
 
+    if ( strcmp(args[0], "merge-patch") == 0 ) {
+        int i, result;
+
+        if ( argc < 2 ) {
+            fprintf(stderr, "merge-patch requires at least one argument\n");
+            print_usage(argv0);
+            return(-1);
+        }
+        /* Oldest first, so each patch carries on from the ones before */
+        result = 0;
+        for ( i=1; (result == 0) && i < argc; ++i ) {
+            printf("merge-patch %s\n", args[i]);
+            result = tree_merge_patch(args[i], patch);
+        }
+        return(result);
+    }
+
     if ( strcmp(args[0], "load-file") == 0 ) {
         int result;
         FILE *file;
@@ -220,22 +281,112 @@ static int interpret_args(const char *argv0, int argc, char *args[],
 int main(int argc, char *argv[])
 {
     loki_patch *patch;
+    int i, result;
 
     set_logging(LOG_VERBOSE);
-    if ( argc < 3 ) {
+    if ( getenv("PATCH_JOBS") ) {
+        set_tree_jobs(atoi(getenv("PATCH_JOBS")));
+    }
+    if ( getenv("PATCH_PAGE_SIZE") ) {
+        if ( loki_xdelta_page_size(atoi(getenv("PATCH_PAGE_SIZE"))) < 0 ) {
+            logme(LOG_ERROR, "Page size must be a power of two from 64K to 1G\n");
+            exit(1);
+        }
+    }
+    if ( getenv("PATCH_MAPPED_PAGES") ) {
+        loki_xdelta_mapped_pages(atoi(getenv("PATCH_MAPPED_PAGES")));
+    }
+    if ( getenv("PATCH_SEGMENT_SIZE") ) {
+        if ( set_segment_size(getenv("PATCH_SEGMENT_SIZE")) < 0 ) {
+            exit(1);
+        }
+    }
+    if ( getenv("PATCH_QUERY_SIZE") ) {
+        query_size = getenv("PATCH_QUERY_SIZE");
+    }
+    if ( getenv("PATCH_CHAIN") ) {
+        chain = atoi(getenv("PATCH_CHAIN"));
+    }
+    if ( getenv("PATCH_MD5_CACHE") ) {
+        md5_cache = getenv("PATCH_MD5_CACHE");
+    }
+    for ( i=1; argv[i] && (argv[i][0] == '-'); ++i ) {
+        if ( ((strcmp(argv[i], "--jobs") == 0) ||
+              (strcmp(argv[i], "-j") == 0)) && argv[i+1] ) {
+            set_tree_jobs(atoi(argv[++i]));
+        } else
+        if ( (strcmp(argv[i], "--page-size") == 0) && argv[i+1] ) {
+            if ( loki_xdelta_page_size(atoi(argv[++i])) < 0 ) {
+                logme(LOG_ERROR, "Page size must be a power of two from 64K to 1G\n");
+                exit(1);
+            }
+        } else
+        if ( (strcmp(argv[i], "--mapped-pages") == 0) && argv[i+1] ) {
+            loki_xdelta_mapped_pages(atoi(argv[++i]));
+        } else
+        if ( (strcmp(argv[i], "--segment-size") == 0) && argv[i+1] ) {
+            if ( set_segment_size(argv[++i]) < 0 ) {
+                exit(1);
+            }
+        } else
+        if ( (strcmp(argv[i], "--query-size") == 0) && argv[i+1] ) {
+            query_size = argv[++i];
+        } else
+        if ( (strcmp(argv[i], "--md5-cache") == 0) && argv[i+1] ) {
+            md5_cache = argv[++i];
+        } else
+        if ( strcmp(argv[i], "--chain") == 0 ) {
+            chain = 1;
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if ( (argc - i) < 2 ) {
         print_usage(argv[0]);
         exit(1);
     }
-    patch = load_patch(argv[1]);
+    if ( segment_size ) {
+        if ( segment_size % loki_xdelta_get_page_size() ) {
+            logme(LOG_ERROR, "Segment size must be a multiple of the page size, %d bytes\n", loki_xdelta_get_page_size());
+            exit(1);
+        }
+        set_tree_segment_size(segment_size);
+    }
+    set_tree_chain(chain);
+    patch = load_patch_text(argv[i]);
     if ( ! patch ) {
         exit(2);
     }
 
-    if ( interpret_args(argv[0], argc-2, argv+2, patch) < 0 ) {
+    /* The query sizes are kept in the header for the next run */
+    if ( query_size && (strcmp(query_size, "auto") == 0) ) {
+        set_tree_query_auto(1);
+    } else {
+        if ( ! query_size ) {
+            query_size = get_optional_field(patch, QUERY_SIZE_FIELD);
+        }
+        if ( query_size ) {
+            if ( set_tree_query_size(query_size) < 0 ) {
+                exit(1);
+            }
+            if ( set_optional_field(patch, QUERY_SIZE_FIELD, query_size) < 0 ) {
+                logme(LOG_ERROR, "Out of memory\n");
+                exit(2);
+            }
+        }
+    }
+
+    if ( md5_cache && (md5_cache_open(md5_cache) < 0) ) {
+        exit(1);
+    }
+    result = interpret_args(argv[0], argc-i-1, argv+i+1, patch);
+    md5_cache_close();
+    if ( result < 0 ) {
         exit(3);
     }
 
-    if ( save_patch(patch, argv[1]) ) {
+    if ( save_patch(patch, argv[i]) ) {
         exit(4);
     }
     free_patch(patch);
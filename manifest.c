@@ -0,0 +1,654 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "loki_patch.h"
+#include "load_patch.h"
+#include "arena.h"
+#include "manifest.h"
+#include "log_output.h"
+
+/* Records are kept on 8 byte boundaries so they can be used in place */
+#define ALIGN(offset)   (((offset) + 7) & ~7)
+
+struct patch_manifest {
+    void *map;
+    size_t size;
+};
+
+struct string_table {
+    char *data;
+    unsigned int size;
+    unsigned int alloc;
+    int failed;
+};
+
+static unsigned int add_string(struct string_table *table, const char *str)
+{
+    unsigned int offset, len;
+    char *data;
+
+    if ( ! str ) {
+        return(MANIFEST_NONE);
+    }
+    len = strlen(str)+1;
+    if ( (table->size + len) > table->alloc ) {
+        table->alloc = (table->alloc ? table->alloc*2 : 65536) + len;
+        data = (char *)realloc(table->data, table->alloc);
+        if ( ! data ) {
+            table->failed = 1;
+            return(MANIFEST_NONE);
+        }
+        table->data = data;
+    }
+    offset = table->size;
+    memcpy(table->data+offset, str, len);
+    table->size += len;
+    return(offset);
+}
+
+static char *manifest_path(const char *patchfile)
+{
+    char *path;
+
+    path = (char *)malloc(strlen(patchfile)+strlen(MANIFEST_SUFFIX)+1);
+    if ( path ) {
+        strcpy(path, patchfile);
+        strcat(path, MANIFEST_SUFFIX);
+    }
+    return(path);
+}
+
+static unsigned int set_section(struct manifest_section *section,
+                                unsigned int offset, int count, int size)
+{
+    section->offset = offset;
+    section->count = count;
+    return ALIGN(offset + count*size);
+}
+
+int save_manifest(loki_patch *patch, const char *patchfile)
+{
+    struct manifest_header header;
+    struct string_table strings;
+    struct stat sb;
+    char *path, *records;
+    unsigned int offset;
+    int num_fields, num_add_path, num_add_file, num_patch_file;
+    int num_options, num_symlink_file, num_del_file, num_del_path;
+    FILE *file;
+    int status;
+
+    /* The manifest is only good for the text file as it is right now */
+    if ( stat(patchfile, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", patchfile);
+        return(-1);
+    }
+
+    /* Count the records of each kind */
+    num_fields = 0;
+    { struct optional_field *field;
+        for ( field=patch->optional_fields; field; field=field->next ) {
+            ++num_fields;
+        }
+    }
+    num_add_path = 0;
+    { struct op_add_path *op;
+        for ( op=patch->add_path_list; op; op=op->next ) {
+            ++num_add_path;
+        }
+    }
+    num_add_file = 0;
+    { struct op_add_file *op;
+        for ( op=patch->add_file_list; op; op=op->next ) {
+            ++num_add_file;
+        }
+    }
+    num_patch_file = 0;
+    num_options = 0;
+    { struct op_patch_file *op;
+      struct delta_option *option;
+        for ( op=patch->patch_file_list; op; op=op->next ) {
+            ++num_patch_file;
+            for ( option=op->options; option; option=option->next ) {
+                ++num_options;
+            }
+        }
+    }
+    num_symlink_file = 0;
+    { struct op_symlink_file *op;
+        for ( op=patch->symlink_file_list; op; op=op->next ) {
+            ++num_symlink_file;
+        }
+    }
+    num_del_file = 0;
+    { struct op_del_file *op;
+        for ( op=patch->del_file_list; op; op=op->next ) {
+            ++num_del_file;
+        }
+    }
+    num_del_path = 0;
+    { struct op_del_path *op;
+        for ( op=patch->del_path_list; op; op=op->next ) {
+            ++num_del_path;
+        }
+    }
+
+    /* Lay out the file */
+    memset(&header, 0, (sizeof header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = MANIFEST_VERSION;
+    header.byteorder = MANIFEST_BYTEORDER;
+    header.text_size = sb.st_size;
+    header.text_mtime = sb.st_mtime;
+    header.text_mtime_nsec = sb.st_mtim.tv_nsec;
+    header.text_ino = sb.st_ino;
+    offset = ALIGN(sizeof header);
+    offset = set_section(&header.fields, offset, num_fields,
+                         sizeof(struct manifest_field));
+    offset = set_section(&header.add_path, offset, num_add_path,
+                         sizeof(struct manifest_add_path));
+    offset = set_section(&header.add_file, offset, num_add_file,
+                         sizeof(struct manifest_add_file));
+    offset = set_section(&header.patch_file, offset, num_patch_file,
+                         sizeof(struct manifest_patch_file));
+    offset = set_section(&header.options, offset, num_options,
+                         sizeof(struct manifest_option));
+    offset = set_section(&header.symlink_file, offset, num_symlink_file,
+                         sizeof(struct manifest_symlink_file));
+    offset = set_section(&header.del_file, offset, num_del_file,
+                         sizeof(struct manifest_del));
+    offset = set_section(&header.del_path, offset, num_del_path,
+                         sizeof(struct manifest_del));
+    header.strings.offset = offset;
+
+    /* The records are laid out at their file offsets, after room for
+       the header, which is written separately */
+    records = (char *)malloc(offset);
+    if ( ! records ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    memset(records, 0, offset);
+    memset(&strings, 0, (sizeof strings));
+
+    /* Fill in the records */
+    header.product = add_string(&strings, patch->product);
+    header.component = add_string(&strings, patch->component);
+    header.patch_version = add_string(&strings, patch->version);
+    header.prepatch = add_string(&strings, patch->prepatch);
+    header.postpatch = add_string(&strings, patch->postpatch);
+    { struct optional_field *field;
+      struct manifest_field *record;
+        record = (struct manifest_field *)(records + header.fields.offset);
+        for ( field=patch->optional_fields; field; field=field->next ) {
+            record->key = add_string(&strings, field->key);
+            record->val = add_string(&strings, field->val);
+            ++record;
+        }
+    }
+    { struct op_add_path *op;
+      struct manifest_add_path *record;
+        record = (struct manifest_add_path *)(records+header.add_path.offset);
+        for ( op=patch->add_path_list; op; op=op->next ) {
+            record->dst = add_string(&strings, op->dst);
+            record->mode = op->mode;
+            ++record;
+        }
+    }
+    { struct op_add_file *op;
+      struct manifest_add_file *record;
+        record = (struct manifest_add_file *)(records+header.add_file.offset);
+        for ( op=patch->add_file_list; op; op=op->next ) {
+            record->size = op->size;
+            record->dst = add_string(&strings, op->dst);
+            record->src = add_string(&strings, op->src);
+            record->sum = add_string(&strings, op->sum);
+            record->mode = op->mode;
+            ++record;
+        }
+    }
+    { struct op_patch_file *op;
+      struct delta_option *option;
+      struct manifest_patch_file *record;
+      struct manifest_option *option_record;
+        record = (struct manifest_patch_file *)
+                        (records + header.patch_file.offset);
+        option_record = (struct manifest_option *)
+                        (records + header.options.offset);
+        num_options = 0;
+        for ( op=patch->patch_file_list; op; op=op->next ) {
+            record->size = op->size;
+            record->dst = add_string(&strings, op->dst);
+            record->mode = op->mode;
+            record->optional = op->optional;
+            record->options = num_options;
+            for ( option=op->options; option; option=option->next ) {
+                option_record->oldsum = add_string(&strings, option->oldsum);
+                option_record->from = add_string(&strings, option->from);
+                option_record->src = add_string(&strings, option->src);
+                option_record->segment = option->segment;
+                option_record->whole = option->whole;
+                option_record->newsum = add_string(&strings, option->newsum);
+                ++option_record;
+                ++record->num_options;
+                ++num_options;
+            }
+            ++record;
+        }
+    }
+    { struct op_symlink_file *op;
+      struct manifest_symlink_file *record;
+        record = (struct manifest_symlink_file *)
+                        (records + header.symlink_file.offset);
+        for ( op=patch->symlink_file_list; op; op=op->next ) {
+            record->dst = add_string(&strings, op->dst);
+            record->link = add_string(&strings, op->link);
+            ++record;
+        }
+    }
+    { struct op_del_file *op;
+      struct manifest_del *record;
+        record = (struct manifest_del *)(records + header.del_file.offset);
+        for ( op=patch->del_file_list; op; op=op->next ) {
+            record->dst = add_string(&strings, op->dst);
+            ++record;
+        }
+    }
+    { struct op_del_path *op;
+      struct manifest_del *record;
+        record = (struct manifest_del *)(records + header.del_path.offset);
+        for ( op=patch->del_path_list; op; op=op->next ) {
+            record->dst = add_string(&strings, op->dst);
+            ++record;
+        }
+    }
+    header.strings.count = strings.size;
+    if ( strings.failed ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free(records);
+        free(strings.data);
+        return(-1);
+    }
+
+    /* Write it all out */
+    status = -1;
+    path = manifest_path(patchfile);
+    if ( ! path ) {
+        logme(LOG_ERROR, "Out of memory\n");
+    } else
+    if ( (file=fopen(path, "wb")) == NULL ) {
+        logme(LOG_ERROR, "Unable to write %s\n", path);
+    } else {
+        if ( (fwrite(&header, sizeof header, 1, file) == 1) &&
+             (fwrite(records + sizeof header,
+                     header.strings.offset - sizeof header, 1, file) == 1) &&
+             (!strings.size ||
+              (fwrite(strings.data, strings.size, 1, file) == 1)) ) {
+            status = 0;
+        }
+        if ( fclose(file) != 0 ) {
+            status = -1;
+        }
+        if ( status < 0 ) {
+            logme(LOG_ERROR, "Unable to write %s\n", path);
+            unlink(path);
+        }
+    }
+    free(path);
+    free(records);
+    free(strings.data);
+    return(status);
+}
+
+/* Check that a section of records lies within the file */
+static int valid_section(const struct manifest_section *section,
+                         size_t size, size_t record_size)
+{
+    if ( (section->offset % 8) || (section->offset > size) ) {
+        return(0);
+    }
+    if ( section->count > (size - section->offset) / record_size ) {
+        return(0);
+    }
+    return(1);
+}
+
+static char *get_string(const struct manifest_header *header,
+                        unsigned int offset, int *valid)
+{
+    if ( offset == MANIFEST_NONE ) {
+        return((char *)0);
+    }
+    if ( offset >= header->strings.count ) {
+        *valid = 0;
+        return((char *)0);
+    }
+    return((char *)header + header->strings.offset + offset);
+}
+
+/* Like get_string(), but for strings that can't be missing */
+static char *need_string(const struct manifest_header *header,
+                         unsigned int offset, int *valid)
+{
+    char *string;
+
+    string = get_string(header, offset, valid);
+    if ( ! string ) {
+        *valid = 0;
+    }
+    return(string);
+}
+
+static void copy_sum(char *sum, const struct manifest_header *header,
+                     unsigned int offset, int *valid)
+{
+    char *string;
+
+    string = need_string(header, offset, valid);
+    if ( string ) {
+        strncpy(sum, string, CHECKSUM_SIZE);
+    }
+}
+
+static void *alloc_ops(loki_patch *patch, int count, size_t size, int *valid)
+{
+    void *ops;
+
+    if ( ! count ) {
+        return(NULL);
+    }
+    ops = patch_alloc(patch, count * size);
+    if ( ! ops ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        *valid = 0;
+    }
+    return(ops);
+}
+
+loki_patch *load_manifest(const char *patchfile, int any_age)
+{
+    loki_patch *patch;
+    struct patch_manifest *manifest;
+    const struct manifest_header *header;
+    struct delta_option *options;
+    const char *base;
+    struct stat sb;
+    char *path;
+    int fd, valid, i;
+    void *map;
+    size_t map_size;
+
+    /* See if there's a manifest */
+    path = manifest_path(patchfile);
+    if ( ! path ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return((loki_patch *)0);
+    }
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 ) {
+        free(path);
+        return((loki_patch *)0);
+    }
+    if ( (fstat(fd, &sb) < 0) || (sb.st_size < (off_t)(sizeof *header)) ) {
+        logme(LOG_VERBOSE, "Ignoring invalid manifest %s\n", path);
+        close(fd);
+        free(path);
+        return((loki_patch *)0);
+    }
+    map_size = sb.st_size;
+    map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        logme(LOG_VERBOSE, "Unable to map manifest %s\n", path);
+        free(path);
+        return((loki_patch *)0);
+    }
+    header = (const struct manifest_header *)map;
+    base = (const char *)map;
+
+    /* Make sure it's ours and it fits together */
+    valid = (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) == 0)
+            && (header->version == MANIFEST_VERSION)
+            && (header->byteorder == MANIFEST_BYTEORDER)
+            && valid_section(&header->fields, map_size,
+                             sizeof(struct manifest_field))
+            && valid_section(&header->add_path, map_size,
+                             sizeof(struct manifest_add_path))
+            && valid_section(&header->add_file, map_size,
+                             sizeof(struct manifest_add_file))
+            && valid_section(&header->patch_file, map_size,
+                             sizeof(struct manifest_patch_file))
+            && valid_section(&header->options, map_size,
+                             sizeof(struct manifest_option))
+            && valid_section(&header->symlink_file, map_size,
+                             sizeof(struct manifest_symlink_file))
+            && valid_section(&header->del_file, map_size,
+                             sizeof(struct manifest_del))
+            && valid_section(&header->del_path, map_size,
+                             sizeof(struct manifest_del))
+            && (header->strings.offset <= map_size)
+            && (header->strings.count <= map_size - header->strings.offset)
+            && (!header->strings.count ||
+                !base[header->strings.offset + header->strings.count - 1]);
+    if ( ! valid ) {
+        logme(LOG_VERBOSE, "Ignoring invalid manifest %s\n", path);
+        munmap(map, map_size);
+        free(path);
+        return((loki_patch *)0);
+    }
+
+    /* Make sure it matches the text patch file, if that's still around */
+    if ( ! any_age && (stat(patchfile, &sb) == 0) &&
+         ((header->text_size != sb.st_size) ||
+          (header->text_mtime != sb.st_mtime) ||
+          (header->text_mtime_nsec != sb.st_mtim.tv_nsec) ||
+          (header->text_ino != sb.st_ino)) ) {
+        logme(LOG_VERBOSE, "Manifest %s is out of date\n", path);
+        munmap(map, map_size);
+        free(path);
+        return((loki_patch *)0);
+    }
+    free(path);
+
+    /* Allocate memory for the patch */
+    patch = (loki_patch *)malloc(sizeof *patch);
+    manifest = (struct patch_manifest *)malloc(sizeof *manifest);
+    if ( ! patch || ! manifest ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        if ( patch ) {
+            free(patch);
+        }
+        if ( manifest ) {
+            free(manifest);
+        }
+        munmap(map, map_size);
+        return((loki_patch *)0);
+    }
+    memset(patch, 0, (sizeof *patch));
+    memset(manifest, 0, (sizeof *manifest));
+    manifest->map = map;
+    manifest->size = map_size;
+    patch->manifest = manifest;
+    patch->base = patch_base(patchfile);
+    if ( ! patch->base ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_patch(patch);
+        return((loki_patch *)0);
+    }
+
+    /* Build the operations from the records, all of the strings are used
+       straight out of the map */
+    valid = 1;
+    patch->product = need_string(header, header->product, &valid);
+    patch->component = get_string(header, header->component, &valid);
+    patch->version = need_string(header, header->patch_version, &valid);
+    patch->prepatch = get_string(header, header->prepatch, &valid);
+    patch->postpatch = get_string(header, header->postpatch, &valid);
+
+    patch->optional_fields = alloc_ops(patch, header->fields.count,
+                                 sizeof(struct optional_field), &valid);
+    patch->add_path_list = alloc_ops(patch, header->add_path.count,
+                                 sizeof(struct op_add_path), &valid);
+    patch->add_file_list = alloc_ops(patch, header->add_file.count,
+                                 sizeof(struct op_add_file), &valid);
+    patch->patch_file_list = alloc_ops(patch, header->patch_file.count,
+                                 sizeof(struct op_patch_file), &valid);
+    options = alloc_ops(patch, header->options.count,
+                                 sizeof(struct delta_option), &valid);
+    patch->symlink_file_list = alloc_ops(patch, header->symlink_file.count,
+                                 sizeof(struct op_symlink_file), &valid);
+    patch->del_file_list = alloc_ops(patch, header->del_file.count,
+                                 sizeof(struct op_del_file), &valid);
+    patch->del_path_list = alloc_ops(patch, header->del_path.count,
+                                 sizeof(struct op_del_path), &valid);
+    if ( ! valid ) {
+        free_patch(patch);
+        return((loki_patch *)0);
+    }
+
+    { const struct manifest_field *record;
+      struct optional_field *field;
+        record = (const struct manifest_field *)(base + header->fields.offset);
+        field = patch->optional_fields;
+        for ( i=0; i<header->fields.count; ++i, ++record, ++field ) {
+            field->key = need_string(header, record->key, &valid);
+            field->val = need_string(header, record->val, &valid);
+            if ( (i+1) < header->fields.count ) {
+                field->next = field+1;
+            }
+        }
+    }
+    { const struct manifest_add_path *record;
+      struct op_add_path *op;
+        record = (const struct manifest_add_path *)
+                        (base + header->add_path.offset);
+        op = patch->add_path_list;
+        for ( i=0; i<header->add_path.count; ++i, ++record, ++op ) {
+            op->dst = need_string(header, record->dst, &valid);
+            op->mode = record->mode;
+            if ( (i+1) < header->add_path.count ) {
+                op->next = op+1;
+            }
+        }
+        patch->add_path_tail = op ? op-1 : NULL;
+    }
+    { const struct manifest_add_file *record;
+      struct op_add_file *op;
+        record = (const struct manifest_add_file *)
+                        (base + header->add_file.offset);
+        op = patch->add_file_list;
+        for ( i=0; i<header->add_file.count; ++i, ++record, ++op ) {
+            op->dst = need_string(header, record->dst, &valid);
+            op->src = need_string(header, record->src, &valid);
+            copy_sum(op->sum, header, record->sum, &valid);
+            op->mode = record->mode;
+            op->size = record->size;
+            if ( (i+1) < header->add_file.count ) {
+                op->next = op+1;
+            }
+        }
+        patch->add_file_tail = op ? op-1 : NULL;
+    }
+    { const struct manifest_patch_file *record;
+      const struct manifest_option *option_record;
+      struct op_patch_file *op;
+      struct delta_option *option;
+      int j;
+        record = (const struct manifest_patch_file *)
+                        (base + header->patch_file.offset);
+        op = patch->patch_file_list;
+        for ( i=0; valid && i<header->patch_file.count; ++i, ++record, ++op ) {
+            op->dst = need_string(header, record->dst, &valid);
+            op->mode = record->mode;
+            op->size = record->size;
+            op->optional = record->optional;
+            if ( !record->num_options ||
+                 (record->options > header->options.count) ||
+                 (record->num_options >
+                        header->options.count - record->options) ) {
+                valid = 0;
+                break;
+            }
+            option_record = (const struct manifest_option *)
+                        (base + header->options.offset) + record->options;
+            option = options + record->options;
+            op->options = option;
+            for ( j=0; valid && j<record->num_options; ++j ) {
+                copy_sum(option->oldsum, header, option_record->oldsum, &valid);
+                option->from = get_string(header, option_record->from, &valid);
+                option->src = need_string(header, option_record->src, &valid);
+                option->segment = option_record->segment;
+                option->whole = option_record->whole;
+                copy_sum(option->newsum, header, option_record->newsum, &valid);
+                if ( (j+1) < record->num_options ) {
+                    option->next = option+1;
+                }
+                ++option_record;
+                ++option;
+            }
+            if ( (i+1) < header->patch_file.count ) {
+                op->next = op+1;
+            }
+        }
+        patch->patch_file_tail = op ? op-1 : NULL;
+    }
+    { const struct manifest_symlink_file *record;
+      struct op_symlink_file *op;
+        record = (const struct manifest_symlink_file *)
+                        (base + header->symlink_file.offset);
+        op = patch->symlink_file_list;
+        for ( i=0; i<header->symlink_file.count; ++i, ++record, ++op ) {
+            op->dst = need_string(header, record->dst, &valid);
+            op->link = need_string(header, record->link, &valid);
+            if ( (i+1) < header->symlink_file.count ) {
+                op->next = op+1;
+            }
+        }
+        patch->symlink_file_tail = op ? op-1 : NULL;
+    }
+    { const struct manifest_del *record;
+      struct op_del_file *op;
+        record = (const struct manifest_del *)(base + header->del_file.offset);
+        op = patch->del_file_list;
+        for ( i=0; i<header->del_file.count; ++i, ++record, ++op ) {
+            op->dst = need_string(header, record->dst, &valid);
+            if ( (i+1) < header->del_file.count ) {
+                op->next = op+1;
+            }
+        }
+        patch->del_file_tail = op ? op-1 : NULL;
+    }
+    { const struct manifest_del *record;
+      struct op_del_path *op;
+        record = (const struct manifest_del *)(base + header->del_path.offset);
+        op = patch->del_path_list;
+        for ( i=0; i<header->del_path.count; ++i, ++record, ++op ) {
+            op->dst = need_string(header, record->dst, &valid);
+            if ( (i+1) < header->del_path.count ) {
+                op->next = op+1;
+            }
+        }
+        patch->del_path_tail = op ? op-1 : NULL;
+    }
+    if ( ! valid ) {
+        logme(LOG_VERBOSE, "Ignoring invalid manifest for %s\n", patchfile);
+        free_patch(patch);
+        return((loki_patch *)0);
+    }
+    return(patch);
+}
+
+void free_manifest(struct patch_manifest *manifest)
+{
+    if ( manifest ) {
+        munmap(manifest->map, manifest->size);
+        free(manifest);
+    }
+}
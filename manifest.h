@@ -0,0 +1,107 @@
+
+/* The binary manifest is a copy of patch.dat which can be mapped into
+   memory and used without parsing.  It's written next to the text patch
+   file by save_patch(), and load_patch() uses it as long as it was made
+   from the text file as it is now.  The text file is still the one to
+   edit, any change to it makes the manifest out of date.
+
+   The file is a header, followed by arrays of fixed size records for
+   each kind of operation, followed by a table of nul terminated strings.
+   Records refer to strings by their offset into the string table.
+   Everything is stored in the byte order of the machine that wrote it,
+   a manifest from a machine with a different byte order is ignored.
+ */
+
+#define MANIFEST_SUFFIX     ".bin"
+#define MANIFEST_MAGIC      "LOKIPMAN"
+#define MANIFEST_VERSION    5
+#define MANIFEST_BYTEORDER  0x01020304
+#define MANIFEST_NONE       0xFFFFFFFF  /* String offset of a NULL string */
+
+struct manifest_section {
+    unsigned int offset;        /* Offset of the section in the file */
+    unsigned int count;         /* Number of records, or bytes of strings */
+};
+
+struct manifest_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteorder;
+    long long text_size;        /* The text patch file this was made from */
+    long long text_mtime;
+    long long text_mtime_nsec;
+    long long text_ino;
+    unsigned int product;
+    unsigned int component;
+    unsigned int patch_version;
+    unsigned int prepatch;
+    unsigned int postpatch;
+    unsigned int reserved;
+    struct manifest_section fields;
+    struct manifest_section add_path;
+    struct manifest_section add_file;
+    struct manifest_section patch_file;
+    struct manifest_section options;
+    struct manifest_section symlink_file;
+    struct manifest_section del_file;
+    struct manifest_section del_path;
+    struct manifest_section strings;
+};
+
+struct manifest_field {
+    unsigned int key;
+    unsigned int val;
+};
+
+struct manifest_add_path {
+    unsigned int dst;
+    unsigned int mode;
+};
+
+struct manifest_add_file {
+    long long size;
+    unsigned int dst;
+    unsigned int src;
+    unsigned int sum;
+    unsigned int mode;
+};
+
+struct manifest_patch_file {
+    long long size;
+    unsigned int dst;
+    unsigned int mode;
+    unsigned int optional;
+    unsigned int options;       /* Index of the first option record */
+    unsigned int num_options;
+    unsigned int reserved;
+};
+
+struct manifest_option {
+    unsigned int oldsum;
+    unsigned int from;
+    unsigned int src;
+    unsigned int segment;
+    unsigned int whole;
+    unsigned int newsum;
+};
+
+struct manifest_symlink_file {
+    unsigned int dst;
+    unsigned int link;
+};
+
+struct manifest_del {
+    unsigned int dst;
+};
+
+/* Write the binary manifest for a patch that's just been saved as text */
+extern int save_manifest(loki_patch *patch, const char *patchfile);
+
+/* Map the binary manifest for a text patch file.
+   This returns NULL if there isn't a usable manifest, or if it's out of
+   date and 'any_age' isn't set, in which case the text should be loaded.
+ */
+extern loki_patch *load_manifest(const char *patchfile, int any_age);
+
+/* Unmap a manifest, the operations built from it are in the patch arena */
+extern void free_manifest(struct patch_manifest *manifest);
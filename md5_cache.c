@@ -0,0 +1,409 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "md5.h"
+#include "md5_cache.h"
+#include "log_output.h"
+
+#define MD5_CACHE_MAGIC     "LOKIMD5"
+#define MD5_CACHE_VERSION   1
+
+struct md5_cache_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int entry_size;
+    unsigned long long sorted;      /* The entries in the sorted table */
+};
+
+struct md5_cache_entry {
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long size;
+    long long mtime;
+    long long mtime_nsec;
+    long long ctime;
+    long long ctime_nsec;
+    char sum[CHECKSUM_SIZE];
+};
+
+static char cache_path[PATH_MAX];
+static int cache_fd = -1;           /* Sums are appended to this */
+static pid_t cache_owner;
+static off_t cache_size;            /* The size of the file when opened */
+static void *cache_map;
+static const struct md5_cache_entry *cache_sorted;
+static long num_sorted;
+static struct md5_cache_entry *cache_added;   /* Appended since sorted */
+static long num_added;
+
+static void make_key(const struct stat *sb, struct md5_cache_entry *key)
+{
+    memset(key, 0, (sizeof *key));
+    key->dev = sb->st_dev;
+    key->ino = sb->st_ino;
+    key->size = sb->st_size;
+    key->mtime = sb->st_mtim.tv_sec;
+    key->mtime_nsec = sb->st_mtim.tv_nsec;
+    key->ctime = sb->st_ctim.tv_sec;
+    key->ctime_nsec = sb->st_ctim.tv_nsec;
+}
+
+static int same_file(const struct md5_cache_entry *a,
+                     const struct md5_cache_entry *b)
+{
+    return((a->dev == b->dev) && (a->ino == b->ino) &&
+           (a->size == b->size) &&
+           (a->mtime == b->mtime) && (a->mtime_nsec == b->mtime_nsec) &&
+           (a->ctime == b->ctime) && (a->ctime_nsec == b->ctime_nsec));
+}
+
+/* Entries are sorted by file, and then by when the file last changed */
+static int compare_entries(const void *a, const void *b)
+{
+    const struct md5_cache_entry *A = (const struct md5_cache_entry *)a;
+    const struct md5_cache_entry *B = (const struct md5_cache_entry *)b;
+
+    if ( A->dev != B->dev ) {
+        return (A->dev < B->dev) ? -1 : 1;
+    }
+    if ( A->ino != B->ino ) {
+        return (A->ino < B->ino) ? -1 : 1;
+    }
+    if ( A->ctime != B->ctime ) {
+        return (A->ctime < B->ctime) ? -1 : 1;
+    }
+    if ( A->ctime_nsec != B->ctime_nsec ) {
+        return (A->ctime_nsec < B->ctime_nsec) ? -1 : 1;
+    }
+    return(0);
+}
+
+static int same_inode(const struct md5_cache_entry *a,
+                      const struct md5_cache_entry *b)
+{
+    return((a->dev == b->dev) && (a->ino == b->ino));
+}
+
+/* Find the entry for a file in a sorted table */
+static const struct md5_cache_entry *find_entry(
+                        const struct md5_cache_entry *table, long count,
+                        const struct md5_cache_entry *key)
+{
+    long lo, hi, mid;
+
+    lo = 0;
+    hi = count;
+    while ( lo < hi ) {
+        mid = (lo + hi) / 2;
+        if ( (table[mid].dev < key->dev) ||
+             ((table[mid].dev == key->dev) && (table[mid].ino < key->ino)) ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ( (lo < count) && same_inode(&table[lo], key) ) {
+        return(&table[lo]);
+    }
+    return((const struct md5_cache_entry *)0);
+}
+
+/* Read the entries appended after the sorted table, sorting them and
+   keeping only the latest for each file */
+static int load_added(void)
+{
+    struct stat sb;
+    off_t offset;
+    long i, count;
+
+    if ( cache_added ) {
+        free(cache_added);
+        cache_added = NULL;
+    }
+    num_added = 0;
+    if ( fstat(cache_fd, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", cache_path);
+        return(-1);
+    }
+    offset = sizeof(struct md5_cache_header) +
+             num_sorted * sizeof(struct md5_cache_entry);
+    count = (sb.st_size - offset) / sizeof(struct md5_cache_entry);
+    if ( count <= 0 ) {
+        return(0);
+    }
+    cache_added = (struct md5_cache_entry *)malloc(
+                                    count * sizeof(struct md5_cache_entry));
+    if ( ! cache_added ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    if ( pread(cache_fd, cache_added,
+               count * sizeof(struct md5_cache_entry), offset) !=
+         (ssize_t)(count * sizeof(struct md5_cache_entry)) ) {
+        logme(LOG_ERROR, "Unable to read %s\n", cache_path);
+        return(-1);
+    }
+    qsort(cache_added, count, sizeof(struct md5_cache_entry), compare_entries);
+    for ( i=0; i<count; ++i ) {
+        if ( (i+1 < count) && same_inode(&cache_added[i], &cache_added[i+1]) ) {
+            continue;
+        }
+        cache_added[num_added++] = cache_added[i];
+    }
+    return(0);
+}
+
+/* Start the cache file over, if it's empty or can't be used */
+static int reset_cache(void)
+{
+    struct md5_cache_header header;
+
+    memset(&header, 0, (sizeof header));
+    strcpy(header.magic, MD5_CACHE_MAGIC);
+    header.version = MD5_CACHE_VERSION;
+    header.entry_size = sizeof(struct md5_cache_entry);
+    if ( (ftruncate(cache_fd, 0) < 0) ||
+         (write(cache_fd, &header, sizeof(header)) != sizeof(header)) ) {
+        logme(LOG_ERROR, "Unable to write %s\n", cache_path);
+        return(-1);
+    }
+    return(0);
+}
+
+int md5_cache_open(const char *path)
+{
+    struct md5_cache_header header;
+    struct stat sb;
+    long count;
+
+    strcpy(cache_path, path);
+    cache_fd = open(path, O_RDWR|O_CREAT|O_APPEND, 0644);
+    if ( cache_fd < 0 ) {
+        logme(LOG_ERROR, "Unable to open %s\n", path);
+        return(-1);
+    }
+
+    /* Check that the file is one we can use */
+    if ( fstat(cache_fd, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", path);
+        md5_cache_close();
+        return(-1);
+    }
+    count = 0;
+    if ( (sb.st_size < sizeof(header)) ||
+         (pread(cache_fd, &header, sizeof(header), 0) != sizeof(header)) ||
+         (strcmp(header.magic, MD5_CACHE_MAGIC) != 0) ||
+         (header.version != MD5_CACHE_VERSION) ||
+         (header.entry_size != sizeof(struct md5_cache_entry)) ) {
+        if ( sb.st_size > 0 ) {
+            logme(LOG_WARNING, "Starting over with checksum cache %s\n", path);
+        }
+        header.sorted = 0;
+        if ( reset_cache() < 0 ) {
+            md5_cache_close();
+            return(-1);
+        }
+    } else {
+        count = (sb.st_size - sizeof(header)) / sizeof(struct md5_cache_entry);
+        if ( header.sorted > count ) {
+            logme(LOG_WARNING, "Starting over with checksum cache %s\n", path);
+            header.sorted = 0;
+            count = 0;
+            if ( reset_cache() < 0 ) {
+                md5_cache_close();
+                return(-1);
+            }
+        }
+    }
+
+    /* A record cut short would throw off the ones appended after it */
+    cache_size = sizeof(header) + count * sizeof(struct md5_cache_entry);
+    if ( (sb.st_size > cache_size) && (ftruncate(cache_fd, cache_size) < 0) ) {
+        logme(LOG_ERROR, "Unable to write %s\n", path);
+        md5_cache_close();
+        return(-1);
+    }
+
+    /* Map in the sorted table, and read whatever was added after it */
+    num_sorted = header.sorted;
+    if ( num_sorted ) {
+        cache_map = mmap(NULL, cache_size, PROT_READ, MAP_SHARED, cache_fd, 0);
+        if ( cache_map == MAP_FAILED ) {
+            cache_map = NULL;
+            logme(LOG_ERROR, "Unable to map %s\n", path);
+            md5_cache_close();
+            return(-1);
+        }
+        cache_sorted = (const struct md5_cache_entry *)
+                        ((const char *)cache_map + sizeof(header));
+    }
+    if ( load_added() < 0 ) {
+        md5_cache_close();
+        return(-1);
+    }
+    cache_owner = getpid();
+    logme(LOG_DEBUG, "Checksum cache %s holds %ld files\n",
+                                            path, num_sorted + num_added);
+    return(0);
+}
+
+int md5_cache_find(const char *file, char *sum)
+{
+    struct md5_cache_entry key;
+    const struct md5_cache_entry *entry;
+    struct stat sb;
+
+    if ( (cache_fd < 0) || (stat(file, &sb) < 0) ) {
+        return(0);
+    }
+    make_key(&sb, &key);
+    entry = find_entry(cache_added, num_added, &key);
+    if ( ! entry ) {
+        entry = find_entry(cache_sorted, num_sorted, &key);
+    }
+    if ( entry && same_file(entry, &key) ) {
+        memcpy(sum, entry->sum, CHECKSUM_SIZE);
+        sum[CHECKSUM_SIZE] = '\0';
+        return(1);
+    }
+    return(0);
+}
+
+void md5_cache_store(const char *file, const char *sum, time_t since)
+{
+    struct md5_cache_entry entry;
+    struct stat sb;
+
+    if ( (cache_fd < 0) || (stat(file, &sb) < 0) ) {
+        return;
+    }
+    if ( (sb.st_mtime >= since) || (sb.st_ctime >= since) ) {
+        return;
+    }
+    make_key(&sb, &entry);
+    memcpy(entry.sum, sum, CHECKSUM_SIZE);
+
+    /* A single write to a file opened for appending goes in whole, even
+       with other processes appending at the same time */
+    if ( write(cache_fd, &entry, sizeof(entry)) != sizeof(entry) ) {
+        logme(LOG_WARNING, "Unable to write %s\n", cache_path);
+    }
+}
+
+void md5_cache_compute(const char *file, char *sum)
+{
+    time_t since;
+
+    if ( md5_cache_find(file, sum) ) {
+        return;
+    }
+    since = time(NULL);
+    md5_compute(file, sum, 1);
+    md5_cache_store(file, sum, since);
+}
+
+/* Merge the sorted table with the entries added since, into a new file */
+static int write_cache(void)
+{
+    struct md5_cache_header header;
+    const struct md5_cache_entry *entry;
+    char tmp_path[PATH_MAX];
+    FILE *fp;
+    long i, j;
+    int cmp, failed;
+
+    memset(&header, 0, (sizeof header));
+    strcpy(header.magic, MD5_CACHE_MAGIC);
+    header.version = MD5_CACHE_VERSION;
+    header.entry_size = sizeof(struct md5_cache_entry);
+    header.sorted = 0;
+
+    sprintf(tmp_path, "%s.%d", cache_path, (int)getpid());
+    fp = fopen(tmp_path, "wb");
+    if ( ! fp ) {
+        logme(LOG_ERROR, "Unable to create %s\n", tmp_path);
+        return(-1);
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    for ( i=0, j=0; (i < num_sorted) || (j < num_added); ) {
+        /* The sum added later replaces the one for the same file */
+        if ( (i < num_sorted) && (j < num_added) &&
+             same_inode(&cache_sorted[i], &cache_added[j]) ) {
+            ++i;
+        }
+        cmp = 1;
+        if ( j >= num_added ) {
+            cmp = -1;
+        } else
+        if ( i < num_sorted ) {
+            cmp = compare_entries(&cache_sorted[i], &cache_added[j]);
+        }
+        if ( cmp < 0 ) {
+            entry = &cache_sorted[i++];
+        } else {
+            entry = &cache_added[j++];
+        }
+        fwrite(entry, sizeof(*entry), 1, fp);
+        ++header.sorted;
+    }
+
+    /* Now that the entries are counted, the header can be filled in */
+    rewind(fp);
+    fwrite(&header, sizeof(header), 1, fp);
+    failed = ferror(fp);
+    if ( (fclose(fp) != 0) || failed ) {
+        logme(LOG_ERROR, "Unable to write %s\n", tmp_path);
+        unlink(tmp_path);
+        return(-1);
+    }
+    if ( rename(tmp_path, cache_path) < 0 ) {
+        logme(LOG_ERROR, "Unable to rename %s\n", tmp_path);
+        unlink(tmp_path);
+        return(-1);
+    }
+    return(0);
+}
+
+int md5_cache_close(void)
+{
+    struct stat sb;
+    int retval;
+
+    retval = 0;
+    if ( cache_fd < 0 ) {
+        return(retval);
+    }
+
+    /* Fold in anything the workers added, if this is the main process */
+    if ( (getpid() == cache_owner) &&
+         (fstat(cache_fd, &sb) == 0) && (sb.st_size != cache_size) ) {
+        retval = load_added();
+        if ( retval == 0 ) {
+            retval = write_cache();
+        }
+    }
+    if ( cache_map ) {
+        munmap(cache_map, cache_size);
+        cache_map = NULL;
+    }
+    cache_sorted = NULL;
+    num_sorted = 0;
+    if ( cache_added ) {
+        free(cache_added);
+        cache_added = NULL;
+    }
+    num_added = 0;
+    close(cache_fd);
+    cache_fd = -1;
+    cache_owner = 0;
+    return(retval);
+}
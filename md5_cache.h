@@ -0,0 +1,29 @@
+
+/* A cache of file checksums kept on disk from one run to the next, so
+   that files which haven't changed since the last run aren't read again.
+
+   A file is known by its device, inode, size, modification time and
+   change time, so anything done to the file misses the cache.  A sum is
+   only stored if the file was last changed before the second it started
+   being read, so a change made while it was being read, or too soon
+   after for its times to show it, can't leave a stale sum behind.
+
+   The cache file is a table sorted by device and inode, which is mapped
+   in, followed by sums added since it was last sorted.  Worker processes
+   append to it directly, and md5_cache_close() sorts it all again.
+ */
+
+/* Use the given cache file, creating it if needed */
+extern int md5_cache_open(const char *path);
+
+/* Look up the sum of a file, returning 1 if it's in the cache */
+extern int md5_cache_find(const char *file, char *sum);
+
+/* Store the sum of a file, which was read starting at time 'since' */
+extern void md5_cache_store(const char *file, const char *sum, time_t since);
+
+/* Checksum a file like md5_compute(), using the cache if it's open */
+extern void md5_cache_compute(const char *file, char *sum);
+
+/* Write out the cache and close it, in the process which opened it */
+extern int md5_cache_close(void);
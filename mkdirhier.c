@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 
 #include "mkdirhier.h"
 
@@ -23,6 +24,10 @@ int mkdirhier(const char *path)
 				*bufp = '\0';
 				if ( stat(new_path, &sb) < 0 ) {
 					retval = mkdir(new_path, 0755);
+					/* Another process may have just created it */
+					if ( (retval < 0) && (errno == EEXIST) ) {
+						retval = 0;
+					}
 				}
 				*bufp = '/';
 			}
@@ -0,0 +1,316 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "loki_patch.h"
+#include "path_index.h"
+#include "log_output.h"
+
+#define NUM_OPS (OP_SYMLINK_FILE+1)
+
+struct path_entry {
+    char *path;
+    unsigned int hash;
+    int ops[NUM_OPS];       /* Operations on exactly this path */
+    int tree[NUM_OPS];      /* Operations on this path and below it */
+    void *data[NUM_OPS];    /* An operation of each kind on this path */
+    struct path_entry *next;
+};
+
+struct path_index {
+    unsigned int size;      /* The number of buckets, a power of two */
+    unsigned int count;     /* The number of paths in the index */
+    struct path_entry **buckets;
+};
+
+static unsigned int hash_path(const char *path, int len)
+{
+    unsigned int hash;
+
+    hash = 5381;
+    while ( len-- > 0 ) {
+        hash = ((hash << 5) + hash) + (unsigned char)*path++;
+    }
+    return(hash);
+}
+
+static int grow_index(struct path_index *index)
+{
+    struct path_entry **buckets;
+    struct path_entry *entry, *next;
+    unsigned int i, size;
+
+    size = index->size ? index->size*2 : 1024;
+    buckets = (struct path_entry **)malloc(size * (sizeof *buckets));
+    if ( ! buckets ) {
+        return(-1);
+    }
+    memset(buckets, 0, size * (sizeof *buckets));
+    for ( i=0; i<index->size; ++i ) {
+        for ( entry=index->buckets[i]; entry; entry=next ) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (size-1)];
+            buckets[entry->hash & (size-1)] = entry;
+        }
+    }
+    if ( index->buckets ) {
+        free(index->buckets);
+    }
+    index->buckets = buckets;
+    index->size = size;
+    return(0);
+}
+
+/* Find the entry for the first 'len' characters of a path */
+static struct path_entry *find_entry(struct path_index *index,
+                                     const char *path, int len, int create)
+{
+    struct path_entry *entry;
+    unsigned int hash;
+
+    hash = hash_path(path, len);
+    for ( entry=index->buckets[hash & (index->size-1)]; entry; entry=entry->next ) {
+        if ( (entry->hash == hash) &&
+             (strncmp(entry->path, path, len) == 0) && !entry->path[len] ) {
+            return(entry);
+        }
+    }
+    if ( ! create ) {
+        return((struct path_entry *)0);
+    }
+
+    /* Keep the chains short */
+    if ( index->count >= index->size*2 ) {
+        if ( grow_index(index) < 0 ) {
+            return((struct path_entry *)0);
+        }
+    }
+    entry = (struct path_entry *)malloc(sizeof *entry);
+    if ( ! entry ) {
+        return((struct path_entry *)0);
+    }
+    memset(entry, 0, (sizeof *entry));
+    entry->path = (char *)malloc(len+1);
+    if ( ! entry->path ) {
+        free(entry);
+        return((struct path_entry *)0);
+    }
+    memcpy(entry->path, path, len);
+    entry->path[len] = '\0';
+    entry->hash = hash;
+    entry->next = index->buckets[hash & (index->size-1)];
+    index->buckets[hash & (index->size-1)] = entry;
+    ++index->count;
+    return(entry);
+}
+
+static int add_entry(struct path_index *index, patch_op op,
+                     const char *dst, void *data)
+{
+    struct path_entry *entry;
+    int i;
+
+    entry = find_entry(index, dst, strlen(dst), 1);
+    if ( ! entry ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    if ( ! entry->data[op] ) {
+        entry->data[op] = data;
+    }
+    ++entry->ops[op];
+    ++entry->tree[op];
+
+    /* Count it in each of the directories above it */
+    for ( i=1; dst[i]; ++i ) {
+        if ( dst[i] == '/' ) {
+            entry = find_entry(index, dst, i, 1);
+            if ( ! entry ) {
+                logme(LOG_ERROR, "Out of memory\n");
+                return(-1);
+            }
+            ++entry->tree[op];
+        }
+    }
+    return(0);
+}
+
+/* Build the index from the operations already in the patch */
+static struct path_index *get_index(loki_patch *patch)
+{
+    struct path_index *index;
+    int status;
+
+    if ( patch->index ) {
+        return(patch->index);
+    }
+    index = (struct path_index *)malloc(sizeof *index);
+    if ( ! index ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return((struct path_index *)0);
+    }
+    memset(index, 0, (sizeof *index));
+    if ( grow_index(index) < 0 ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free(index);
+        return((struct path_index *)0);
+    }
+
+    status = 0;
+    { struct op_add_path *op;
+        for ( op=patch->add_path_list; op; op=op->next ) {
+            status |= add_entry(index, OP_ADD_PATH, op->dst, op);
+        }
+    }
+    { struct op_add_file *op;
+        for ( op=patch->add_file_list; op; op=op->next ) {
+            status |= add_entry(index, OP_ADD_FILE, op->dst, op);
+        }
+    }
+    { struct op_patch_file *op;
+        for ( op=patch->patch_file_list; op; op=op->next ) {
+            status |= add_entry(index, OP_PATCH_FILE, op->dst, op);
+        }
+    }
+    { struct op_symlink_file *op;
+        for ( op=patch->symlink_file_list; op; op=op->next ) {
+            status |= add_entry(index, OP_SYMLINK_FILE, op->dst, op);
+        }
+    }
+    { struct op_del_file *op;
+        for ( op=patch->del_file_list; op; op=op->next ) {
+            status |= add_entry(index, OP_DEL_FILE, op->dst, op);
+        }
+    }
+    { struct op_del_path *op;
+        for ( op=patch->del_path_list; op; op=op->next ) {
+            status |= add_entry(index, OP_DEL_PATH, op->dst, op);
+        }
+    }
+    if ( status < 0 ) {
+        free_path_index(index);
+        return((struct path_index *)0);
+    }
+    patch->index = index;
+    return(index);
+}
+
+int index_add_path(loki_patch *patch, patch_op op, const char *dst, void *data)
+{
+    /* If there's no index yet, it'll be built from the lists later */
+    if ( ! patch->index ) {
+        return(0);
+    }
+    return add_entry(patch->index, op, dst, data);
+}
+
+void index_remove_path(loki_patch *patch, patch_op op, const char *dst)
+{
+    struct path_entry *entry;
+    int i, count;
+
+    if ( ! patch->index ) {
+        return;
+    }
+    entry = find_entry(patch->index, dst, strlen(dst), 0);
+    if ( !entry || !entry->ops[op] ) {
+        return;
+    }
+    count = entry->ops[op];
+    entry->ops[op] = 0;
+    entry->tree[op] -= count;
+    entry->data[op] = NULL;
+
+    for ( i=1; dst[i]; ++i ) {
+        if ( dst[i] == '/' ) {
+            entry = find_entry(patch->index, dst, i, 0);
+            if ( entry ) {
+                entry->tree[op] -= count;
+            }
+        }
+    }
+}
+
+int index_count(loki_patch *patch, patch_op op, const char *dst)
+{
+    struct path_index *index;
+    struct path_entry *entry;
+    int i, count;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(0);
+    }
+    entry = find_entry(index, dst, strlen(dst), 0);
+    if ( ! entry ) {
+        return(0);
+    }
+    if ( op != OP_NONE ) {
+        return(entry->ops[op]);
+    }
+    count = 0;
+    for ( i=0; i<NUM_OPS; ++i ) {
+        count += entry->ops[i];
+    }
+    return(count);
+}
+
+int index_count_tree(loki_patch *patch, patch_op op, const char *dst)
+{
+    struct path_index *index;
+    struct path_entry *entry;
+    int i, count;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(0);
+    }
+    entry = find_entry(index, dst, strlen(dst), 0);
+    if ( ! entry ) {
+        return(0);
+    }
+    if ( op != OP_NONE ) {
+        return(entry->tree[op]);
+    }
+    count = 0;
+    for ( i=0; i<NUM_OPS; ++i ) {
+        count += entry->tree[i];
+    }
+    return(count);
+}
+
+void *index_find(loki_patch *patch, patch_op op, const char *dst)
+{
+    struct path_index *index;
+    struct path_entry *entry;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(NULL);
+    }
+    entry = find_entry(index, dst, strlen(dst), 0);
+    if ( ! entry ) {
+        return(NULL);
+    }
+    return(entry->data[op]);
+}
+
+void free_path_index(struct path_index *index)
+{
+    struct path_entry *entry, *freeable;
+    unsigned int i;
+
+    if ( index ) {
+        for ( i=0; i<index->size; ++i ) {
+            entry = index->buckets[i];
+            while ( entry ) {
+                freeable = entry;
+                entry = entry->next;
+                free(freeable->path);
+                free(freeable);
+            }
+        }
+        free(index->buckets);
+        free(index);
+    }
+}
@@ -0,0 +1,29 @@
+
+/* A lookup table of the paths used by each kind of operation in a patch.
+
+   Every path also counts the operations on paths below it, so checking
+   whether anything lives under a directory is a single lookup instead
+   of a scan of every list.  The index is built from the patch lists the
+   first time it's needed, after that anything which adds or removes an
+   operation has to keep it up to date.
+ */
+
+/* Record that an operation uses the given path */
+extern int index_add_path(loki_patch *patch, patch_op op, const char *dst,
+                          void *data);
+
+/* Forget every operation of the given kind on the given path */
+extern void index_remove_path(loki_patch *patch, patch_op op, const char *dst);
+
+/* The number of operations of the given kind (or any, for OP_NONE)
+   on exactly this path */
+extern int index_count(loki_patch *patch, patch_op op, const char *dst);
+
+/* The number of operations of the given kind on this path or below it */
+extern int index_count_tree(loki_patch *patch, patch_op op, const char *dst);
+
+/* Look up an operation of the given kind on this path */
+extern void *index_find(loki_patch *patch, patch_op op, const char *dst);
+
+/* Free the index, when the patch is freed */
+extern void free_path_index(struct path_index *index);
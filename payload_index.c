@@ -0,0 +1,406 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "loki_patch.h"
+#include "payload_index.h"
+#include "log_output.h"
+
+struct payload {
+    const char *src;            /* The data file, relative to the base */
+    char key[2*CHECKSUM_SIZE+1];/* The checksums of what it holds */
+    int refs;
+    int whole;                  /* It holds a whole file, not a delta */
+    long segment;               /* The segment size of a multi-part delta */
+    unsigned int src_hash;
+    unsigned int key_hash;
+    struct payload *next_src;
+    struct payload *next_key;
+};
+
+struct payload_index {
+    unsigned int size;          /* The number of buckets, a power of two */
+    unsigned int count;         /* The number of data files in the index */
+    struct payload **by_src;
+    struct payload **by_key;
+};
+
+static unsigned int hash_string(const char *str)
+{
+    unsigned int hash;
+
+    hash = 5381;
+    while ( *str ) {
+        hash = ((hash << 5) + hash) + (unsigned char)*str++;
+    }
+    return(hash);
+}
+
+static void make_key(char *key, const char *oldsum, const char *newsum)
+{
+    if ( oldsum ) {
+        sprintf(key, "%.*s%.*s", CHECKSUM_SIZE, oldsum, CHECKSUM_SIZE, newsum);
+    } else {
+        sprintf(key, "%.*s", CHECKSUM_SIZE, newsum);
+    }
+}
+
+static int grow_index(struct payload_index *index)
+{
+    struct payload **by_src, **by_key;
+    struct payload *entry, *next;
+    unsigned int i, size;
+
+    size = index->size ? index->size*2 : 1024;
+    by_src = (struct payload **)malloc(size * (sizeof *by_src));
+    by_key = (struct payload **)malloc(size * (sizeof *by_key));
+    if ( !by_src || !by_key ) {
+        if ( by_src ) {
+            free(by_src);
+        }
+        if ( by_key ) {
+            free(by_key);
+        }
+        return(-1);
+    }
+    memset(by_src, 0, size * (sizeof *by_src));
+    memset(by_key, 0, size * (sizeof *by_key));
+    for ( i=0; i<index->size; ++i ) {
+        for ( entry=index->by_src[i]; entry; entry=next ) {
+            next = entry->next_src;
+            entry->next_src = by_src[entry->src_hash & (size-1)];
+            by_src[entry->src_hash & (size-1)] = entry;
+            entry->next_key = by_key[entry->key_hash & (size-1)];
+            by_key[entry->key_hash & (size-1)] = entry;
+        }
+    }
+    if ( index->by_src ) {
+        free(index->by_src);
+        free(index->by_key);
+    }
+    index->by_src = by_src;
+    index->by_key = by_key;
+    index->size = size;
+    return(0);
+}
+
+static struct payload *find_src(struct payload_index *index, const char *src)
+{
+    struct payload *entry;
+    unsigned int hash;
+
+    hash = hash_string(src);
+    for ( entry=index->by_src[hash & (index->size-1)]; entry;
+          entry=entry->next_src ) {
+        if ( (entry->src_hash == hash) && (strcmp(entry->src, src) == 0) ) {
+            break;
+        }
+    }
+    return(entry);
+}
+
+static void unlink_key(struct payload_index *index, struct payload *entry)
+{
+    struct payload **link;
+
+    link = &index->by_key[entry->key_hash & (index->size-1)];
+    while ( *link ) {
+        if ( *link == entry ) {
+            *link = entry->next_key;
+            break;
+        }
+        link = &(*link)->next_key;
+    }
+}
+
+static int add_entry(struct payload_index *index, const char *key,
+                     const char *src)
+{
+    struct payload *entry;
+
+    entry = find_src(index, src);
+    if ( entry && strcmp(entry->key, key) != 0 ) {
+        /* A data file can only be reused for new contents once it's
+           been released by everything that used it before */
+        if ( entry->refs ) {
+            logme(LOG_ERROR, "Patch data %s is already in use\n", src);
+            return(-1);
+        }
+        unlink_key(index, entry);
+        strcpy(entry->key, key);
+        entry->whole = 0;
+        entry->segment = 0;
+        entry->key_hash = hash_string(key);
+        entry->next_key = index->by_key[entry->key_hash & (index->size-1)];
+        index->by_key[entry->key_hash & (index->size-1)] = entry;
+    }
+    if ( ! entry ) {
+        /* Keep the chains short */
+        if ( index->count >= index->size*2 ) {
+            if ( grow_index(index) < 0 ) {
+                logme(LOG_ERROR, "Out of memory\n");
+                return(-1);
+            }
+        }
+        entry = (struct payload *)malloc(sizeof *entry);
+        if ( ! entry ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+        memset(entry, 0, (sizeof *entry));
+        entry->src = src;
+        strcpy(entry->key, key);
+        entry->src_hash = hash_string(src);
+        entry->key_hash = hash_string(key);
+        entry->next_src = index->by_src[entry->src_hash & (index->size-1)];
+        index->by_src[entry->src_hash & (index->size-1)] = entry;
+        entry->next_key = index->by_key[entry->key_hash & (index->size-1)];
+        index->by_key[entry->key_hash & (index->size-1)] = entry;
+        ++index->count;
+    }
+    ++entry->refs;
+    return(0);
+}
+
+/* Build the index from the data files already in the patch */
+static struct payload_index *get_index(loki_patch *patch)
+{
+    struct payload_index *index;
+    char key[2*CHECKSUM_SIZE+1];
+    int status;
+
+    if ( patch->payloads ) {
+        return(patch->payloads);
+    }
+    index = (struct payload_index *)malloc(sizeof *index);
+    if ( ! index ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return((struct payload_index *)0);
+    }
+    memset(index, 0, (sizeof *index));
+    if ( grow_index(index) < 0 ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free(index);
+        return((struct payload_index *)0);
+    }
+
+    /* Files which haven't been checksummed yet don't have any data */
+    status = 0;
+    { struct op_add_file *op;
+        for ( op=patch->add_file_list; op; op=op->next ) {
+            if ( *op->sum ) {
+                make_key(key, NULL, op->sum);
+                status |= add_entry(index, key, op->src);
+            }
+        }
+    }
+    { struct op_patch_file *op;
+      struct delta_option *option;
+      struct payload *entry;
+        for ( op=patch->patch_file_list; op; op=op->next ) {
+            for ( option=op->options; option; option=option->next ) {
+                if ( option->src ) {
+                    make_key(key, option->oldsum, option->newsum);
+                    status |= add_entry(index, key, option->src);
+                    entry = find_src(index, option->src);
+                    if ( entry && option->whole ) {
+                        entry->whole = 1;
+                    }
+                    if ( entry && option->segment ) {
+                        entry->segment = option->segment;
+                    }
+                }
+            }
+        }
+    }
+    if ( status < 0 ) {
+        free_payload_index(index);
+        return((struct payload_index *)0);
+    }
+    patch->payloads = index;
+    return(index);
+}
+
+const char *payload_find(loki_patch *patch,
+                         const char *oldsum, const char *newsum)
+{
+    struct payload_index *index;
+    struct payload *entry;
+    char key[2*CHECKSUM_SIZE+1];
+    unsigned int hash;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(NULL);
+    }
+    make_key(key, oldsum, newsum);
+    hash = hash_string(key);
+    for ( entry=index->by_key[hash & (index->size-1)]; entry;
+          entry=entry->next_key ) {
+        if ( entry->refs && (entry->key_hash == hash) &&
+             (strcmp(entry->key, key) == 0) ) {
+            return(entry->src);
+        }
+    }
+    return(NULL);
+}
+
+int payload_add(loki_patch *patch,
+                const char *oldsum, const char *newsum, const char *src)
+{
+    char key[2*CHECKSUM_SIZE+1];
+
+    /* If there's no index yet, it'll be built from the lists later */
+    if ( ! patch->payloads ) {
+        return(0);
+    }
+    make_key(key, oldsum, newsum);
+    return add_entry(patch->payloads, key, src);
+}
+
+int payload_release(loki_patch *patch, const char *src)
+{
+    struct payload_index *index;
+    struct payload *entry;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(1);
+    }
+    entry = find_src(index, src);
+    if ( ! entry ) {
+        return(0);
+    }
+    if ( entry->refs > 0 ) {
+        --entry->refs;
+    }
+    return(entry->refs);
+}
+
+int payload_refs(loki_patch *patch, const char *src)
+{
+    struct payload_index *index;
+    struct payload *entry;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(1);
+    }
+    entry = find_src(index, src);
+    if ( ! entry ) {
+        return(0);
+    }
+    return(entry->refs);
+}
+
+int payload_whole(loki_patch *patch, const char *src)
+{
+    struct payload_index *index;
+    struct payload *entry;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(0);
+    }
+    entry = find_src(index, src);
+    if ( ! entry ) {
+        return(0);
+    }
+    return(entry->whole);
+}
+
+void payload_set_whole(loki_patch *patch, const char *src)
+{
+    struct payload_index *index;
+    struct payload *entry;
+
+    index = get_index(patch);
+    if ( index ) {
+        entry = find_src(index, src);
+        if ( entry ) {
+            entry->whole = 1;
+            entry->segment = 0;
+        }
+    }
+}
+
+long payload_segment(loki_patch *patch, const char *src)
+{
+    struct payload_index *index;
+    struct payload *entry;
+
+    index = get_index(patch);
+    if ( ! index ) {
+        return(0);
+    }
+    entry = find_src(index, src);
+    if ( ! entry ) {
+        return(0);
+    }
+    return(entry->segment);
+}
+
+void payload_set_segment(loki_patch *patch, const char *src, long segment)
+{
+    struct payload_index *index;
+    struct payload *entry;
+
+    index = get_index(patch);
+    if ( index ) {
+        entry = find_src(index, src);
+        if ( entry ) {
+            entry->segment = segment;
+        }
+    }
+}
+
+size_t payload_size(loki_patch *patch)
+{
+    struct payload_index *index;
+    struct payload *entry;
+    char path[PATH_MAX];
+    struct stat sb;
+    size_t used;
+    unsigned int i;
+
+    used = 0;
+    index = get_index(patch);
+    if ( index ) {
+        for ( i=0; i<index->size; ++i ) {
+            for ( entry=index->by_src[i]; entry; entry=entry->next_src ) {
+                if ( ! entry->refs ) {
+                    continue;
+                }
+                sprintf(path, "%s/%s", patch->base, entry->src);
+                if ( stat(path, &sb) == 0 ) {
+                    used += sb.st_size;
+                }
+            }
+        }
+    }
+    return(used);
+}
+
+void free_payload_index(struct payload_index *index)
+{
+    struct payload *entry, *freeable;
+    unsigned int i;
+
+    if ( index ) {
+        for ( i=0; i<index->size; ++i ) {
+            entry = index->by_src[i];
+            while ( entry ) {
+                freeable = entry;
+                entry = entry->next_src;
+                free(freeable);
+            }
+        }
+        free(index->by_src);
+        free(index->by_key);
+        free(index);
+    }
+}
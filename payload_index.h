@@ -0,0 +1,43 @@
+
+/* A lookup table of the data files in the patch directory, by what they
+   hold, so that the same contents are only stored in the patch once.
+
+   An added file's data is keyed by the checksum of the file, and a delta
+   by the checksums of the old and new files.  Every ADD FILE and delta
+   option referring to a data file counts as a reference to it, and the
+   file can be removed from the patch directory when the last reference
+   is released.  Like the path index, this is built from the patch lists
+   the first time it's needed and kept up to date after that.
+ */
+
+/* Find the data file holding the given contents, or NULL if there isn't
+   one.  'oldsum' is NULL for the data of an added file. */
+extern const char *payload_find(loki_patch *patch,
+                                const char *oldsum, const char *newsum);
+
+/* Add a reference to a data file holding the given contents */
+extern int payload_add(loki_patch *patch,
+                       const char *oldsum, const char *newsum, const char *src);
+
+/* Release a reference to a data file, returning the references left */
+extern int payload_release(loki_patch *patch, const char *src);
+
+/* The number of references to a data file */
+extern int payload_refs(loki_patch *patch, const char *src);
+
+/* Whether a delta's data file holds the whole new file instead, and mark
+   it as doing so */
+extern int payload_whole(loki_patch *patch, const char *src);
+extern void payload_set_whole(loki_patch *patch, const char *src);
+
+/* The segment size of a delta's data file, if it's a multi-part delta,
+   and set it */
+extern long payload_segment(loki_patch *patch, const char *src);
+extern void payload_set_segment(loki_patch *patch, const char *src,
+                                long segment);
+
+/* The total size of the data files referenced by the patch */
+extern size_t payload_size(loki_patch *patch);
+
+/* Free the index, when the patch is freed */
+extern void free_payload_index(struct payload_index *index);
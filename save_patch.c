@@ -5,6 +5,7 @@
 #include "size_patch.h"
 #include "print_patch.h"
 #include "save_patch.h"
+#include "manifest.h"
 
 
 int save_patch(loki_patch *patch, const char *patchfile)
@@ -26,7 +27,9 @@ int save_patch(loki_patch *patch, const char *patchfile)
     if ( patch->postpatch ) {
         fprintf(file, "Postpatch: %s\n", patch->postpatch);    
     }
-    fprintf(file, "# Diskspace required: %u K\n", calculate_space(patch, 0));
+    fprintf(file, "# Diskspace required: %u K, %lu K at peak in batches\n",
+            calculate_space(patch, 0),
+            (unsigned long)schedule_space(patch, NULL, 0));
     fprintf(file, "\n");
     fprintf(file, "%%" LOKI_VERSION " - Do not remove this line!\n");
     fprintf(file, "\n");
@@ -46,7 +49,7 @@ int save_patch(loki_patch *patch, const char *patchfile)
 
         for ( op=patch->add_file_list; op; op=op->next ) {
             fprintf(file, "ADD FILE %s\n", op->dst);
-            fprintf(file, "src=%s\n", op->dst);
+            fprintf(file, "src=%s\n", op->src);
             fprintf(file, "sum=%s\n", op->sum);
             fprintf(file, "mode=0%lo\n", op->mode);
             fprintf(file, "size=%ld\n", op->size);
@@ -62,7 +65,16 @@ int save_patch(loki_patch *patch, const char *patchfile)
             fprintf(file, "PATCH FILE %s\n", op->dst);
             for ( option=op->options; option; option=option->next ) {
                 fprintf(file, "oldsum=%s\n", option->oldsum);
+                if ( option->from ) {
+                    fprintf(file, "from=%s\n", option->from);
+                }
                 fprintf(file, "src=%s\n", option->src);
+                if ( option->segment ) {
+                    fprintf(file, "segment=%ld\n", option->segment);
+                }
+                if ( option->whole ) {
+                    fprintf(file, "whole=1\n");
+                }
                 fprintf(file, "newsum=%s\n", option->newsum);
             }
             fprintf(file, "mode=0%lo\n", op->mode);
@@ -102,5 +114,7 @@ int save_patch(loki_patch *patch, const char *patchfile)
 
     /* That's it! */
     fclose(file);
-	return(0);
+
+    /* Write the binary manifest to go with it */
+    return save_manifest(patch, patchfile);
 }
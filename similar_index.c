@@ -0,0 +1,425 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "loki_patch.h"
+#include "similar_index.h"
+#include "job_pool.h"
+#include "log_output.h"
+
+/* Files smaller than this aren't worth a delta */
+#define SIMILAR_MIN_SIZE    512
+
+/* Samples found in more files than this are left out of searches, they
+   are most likely runs of zeroes or other filler */
+#define SIMILAR_COMMON      64
+
+/* At least this fraction (1/N) of the samples have to match */
+#define SIMILAR_MIN_SHARE   4
+
+/* The multiplier for the rolling hash of the window */
+#define HASH_PRIME          0x01000193
+
+struct similar_file {
+    char *path;
+    struct similar_sketch sketch;
+};
+
+struct similar_sample {
+    unsigned int hash;
+    int file;
+};
+
+struct similar_index {
+    char *top;
+    int num_files;
+    int max_files;
+    struct similar_file *files;
+    int num_samples;
+    struct similar_sample *samples;     /* Sorted by hash */
+};
+
+/* Spread the bits of the rolling hash, so the smallest are a fair sample */
+static unsigned int mix_hash(unsigned int hash)
+{
+    hash ^= hash >> 16;
+    hash *= 0x7feb352d;
+    hash ^= hash >> 15;
+    hash *= 0x846ca68b;
+    hash ^= hash >> 16;
+    return(hash);
+}
+
+static void add_sample(struct similar_sketch *sketch, unsigned int hash)
+{
+    int i;
+
+    if ( (sketch->count == SIMILAR_SAMPLES) &&
+         (hash >= sketch->samples[SIMILAR_SAMPLES-1]) ) {
+        return;
+    }
+    for ( i=sketch->count; i > 0 && sketch->samples[i-1] >= hash; --i ) {
+        if ( sketch->samples[i-1] == hash ) {
+            return;
+        }
+    }
+    if ( sketch->count < SIMILAR_SAMPLES ) {
+        ++sketch->count;
+    }
+    memmove(&sketch->samples[i+1], &sketch->samples[i],
+            (sketch->count-i-1) * (sizeof *sketch->samples));
+    sketch->samples[i] = hash;
+}
+
+int similar_sketch_file(const char *path, struct similar_sketch *sketch)
+{
+    unsigned char data[16384];
+    unsigned char window[SIMILAR_WINDOW];
+    unsigned int hash, out_factor;
+    int fd, i, len, pos;
+    long size;
+
+    memset(sketch, 0, (sizeof *sketch));
+    fd = open(path, O_RDONLY);
+    if ( fd < 0 ) {
+        logme(LOG_ERROR, "Unable to open %s\n", path);
+        return(-1);
+    }
+
+    /* The hash of the window is kept up to date as each byte goes by */
+    out_factor = 1;
+    for ( i=0; i<SIMILAR_WINDOW; ++i ) {
+        out_factor *= HASH_PRIME;
+    }
+    memset(window, 0, sizeof(window));
+    hash = 0;
+    pos = 0;
+    size = 0;
+    while ( (len=read(fd, data, sizeof(data))) > 0 ) {
+        for ( i=0; i<len; ++i ) {
+            hash = hash*HASH_PRIME + data[i] - window[pos]*out_factor;
+            window[pos] = data[i];
+            pos = (pos+1) % SIMILAR_WINDOW;
+            if ( ++size >= SIMILAR_WINDOW ) {
+                add_sample(sketch, mix_hash(hash));
+            }
+        }
+    }
+    close(fd);
+    if ( len < 0 ) {
+        logme(LOG_ERROR, "Unable to read %s\n", path);
+        return(-1);
+    }
+    sketch->size = size;
+    return(0);
+}
+
+/* Collect the regular files under a path */
+static int add_files(struct similar_index *index, const char *rel)
+{
+    char path[PATH_MAX];
+    char child[PATH_MAX];
+    struct similar_file *files;
+    struct stat sb;
+    DIR *dir;
+    struct dirent *entry;
+    int status;
+
+    sprintf(path, "%s/%s", index->top, rel);
+    dir = opendir(path);
+    if ( ! dir ) {
+        logme(LOG_ERROR, "Unable to open directory: %s\n", path);
+        return(-1);
+    }
+    status = 0;
+    while ( (entry=readdir(dir)) != NULL ) {
+        /* Skip "." and ".." entries */
+        if ( (strcmp(entry->d_name, ".") == 0) ||
+             (strcmp(entry->d_name, "..") == 0) ) {
+            continue;
+        }
+        if ( *rel ) {
+            sprintf(child, "%s/%s", rel, entry->d_name);
+        } else {
+            strcpy(child, entry->d_name);
+        }
+        sprintf(path, "%s/%s", index->top, child);
+        if ( lstat(path, &sb) < 0 ) {
+            continue;
+        }
+        if ( S_ISDIR(sb.st_mode) ) {
+            status |= add_files(index, child);
+            continue;
+        }
+        if ( !S_ISREG(sb.st_mode) || (sb.st_size < SIMILAR_MIN_SIZE) ) {
+            continue;
+        }
+        if ( index->num_files == index->max_files ) {
+            index->max_files = index->max_files ? index->max_files*2 : 256;
+            files = (struct similar_file *)realloc(index->files,
+                                      index->max_files * (sizeof *files));
+            if ( ! files ) {
+                logme(LOG_ERROR, "Out of memory\n");
+                status = -1;
+                break;
+            }
+            index->files = files;
+        }
+        memset(&index->files[index->num_files], 0, sizeof *index->files);
+        index->files[index->num_files].path = strdup(child);
+        if ( ! index->files[index->num_files].path ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            status = -1;
+            break;
+        }
+        ++index->num_files;
+    }
+    closedir(dir);
+    return(status);
+}
+
+static int sketch_job(int job, void *data, void *result)
+{
+    struct similar_index *index = (struct similar_index *)data;
+    char path[PATH_MAX];
+
+    sprintf(path, "%s/%s", index->top, index->files[job].path);
+    return similar_sketch_file(path, (struct similar_sketch *)result);
+}
+
+static int sketch_done(int job, int status, void *data, void *result)
+{
+    struct similar_index *index = (struct similar_index *)data;
+
+    /* A file which can't be read just won't be found */
+    if ( status == 0 ) {
+        memcpy(&index->files[job].sketch, result,
+               sizeof(struct similar_sketch));
+    } else {
+        index->files[job].sketch.count = 0;
+    }
+    return(0);
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    const struct similar_sample *A = (const struct similar_sample *)a;
+    const struct similar_sample *B = (const struct similar_sample *)b;
+
+    if ( A->hash != B->hash ) {
+        return (A->hash < B->hash) ? -1 : 1;
+    }
+    return(A->file - B->file);
+}
+
+struct similar_index *similar_build(const char *top, const char *path,
+                                    int jobs)
+{
+    struct similar_index *index;
+    int i, j;
+
+    index = (struct similar_index *)malloc(sizeof *index);
+    if ( ! index ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return((struct similar_index *)0);
+    }
+    memset(index, 0, (sizeof *index));
+    index->top = strdup(top);
+    if ( ! index->top ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_similar_index(index);
+        return((struct similar_index *)0);
+    }
+    while ( *path == '/' ) {
+        ++path;
+    }
+    if ( add_files(index, path) < 0 ) {
+        free_similar_index(index);
+        return((struct similar_index *)0);
+    }
+    if ( index->num_files == 0 ) {
+        return(index);
+    }
+
+    /* Sample everything */
+    if ( run_jobs(jobs, index->num_files, sizeof(struct similar_sketch),
+                  sketch_job, sketch_done, index) < 0 ) {
+        free_similar_index(index);
+        return((struct similar_index *)0);
+    }
+
+    /* Sort the samples so the files holding each one can be looked up */
+    index->samples = (struct similar_sample *)malloc(
+            index->num_files * SIMILAR_SAMPLES * (sizeof *index->samples));
+    if ( ! index->samples ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_similar_index(index);
+        return((struct similar_index *)0);
+    }
+    for ( i=0; i<index->num_files; ++i ) {
+        if ( index->files[i].sketch.count > SIMILAR_SAMPLES ) {
+            index->files[i].sketch.count = SIMILAR_SAMPLES;
+        }
+        for ( j=0; j<index->files[i].sketch.count; ++j ) {
+            index->samples[index->num_samples].hash =
+                                    index->files[i].sketch.samples[j];
+            index->samples[index->num_samples].file = i;
+            ++index->num_samples;
+        }
+    }
+    qsort(index->samples, index->num_samples, sizeof *index->samples,
+          compare_samples);
+    logme(LOG_DEBUG, "Sampled %d files in %s\n", index->num_files, top);
+    return(index);
+}
+
+/* The number of bits needed for a size, files of about the same size
+   fall into the same or neighbouring buckets */
+static int size_bucket(long size)
+{
+    int bucket;
+
+    for ( bucket=0; size; ++bucket ) {
+        size >>= 1;
+    }
+    return(bucket);
+}
+
+/* Count how many of the smallest samples of both files together are
+   in each of them, out of the number of samples the smaller one has */
+static int shared_samples(const struct similar_sketch *a,
+                          const struct similar_sketch *b, int *out_of)
+{
+    int i, j, k, shared;
+
+    k = (a->count < b->count) ? a->count : b->count;
+    shared = 0;
+    i = j = 0;
+    while ( (i + j - shared) < k && i < a->count && j < b->count ) {
+        if ( a->samples[i] == b->samples[j] ) {
+            ++shared;
+            ++i;
+            ++j;
+        } else if ( a->samples[i] < b->samples[j] ) {
+            ++i;
+        } else {
+            ++j;
+        }
+    }
+    *out_of = k;
+    return(shared);
+}
+
+static int compare_files(const void *a, const void *b)
+{
+    return(*(const int *)a - *(const int *)b);
+}
+
+int similar_find(struct similar_index *index,
+                 const struct similar_sketch *sketch)
+{
+    int candidates[SIMILAR_SAMPLES*SIMILAR_COMMON];
+    int num_candidates;
+    int i, lo, hi, mid, end;
+    int best, best_shared, best_out_of;
+    int shared, out_of;
+    long best_diff, diff;
+    struct similar_file *file;
+
+    if ( !index || !index->num_samples ||
+         (sketch->size < SIMILAR_MIN_SIZE) || !sketch->count ) {
+        return(-1);
+    }
+
+    /* Collect the files holding any of the samples */
+    num_candidates = 0;
+    for ( i=0; i<sketch->count; ++i ) {
+        lo = 0;
+        hi = index->num_samples;
+        while ( lo < hi ) {
+            mid = (lo + hi) / 2;
+            if ( index->samples[mid].hash < sketch->samples[i] ) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for ( end=lo; (end < index->num_samples) &&
+              (index->samples[end].hash == sketch->samples[i]); ++end )
+            ;
+        if ( (end - lo) > SIMILAR_COMMON ) {
+            continue;
+        }
+        while ( lo < end ) {
+            candidates[num_candidates++] = index->samples[lo++].file;
+        }
+    }
+    qsort(candidates, num_candidates, sizeof *candidates, compare_files);
+
+    /* Pick the one sharing the most, then the closest in size */
+    best = -1;
+    best_shared = 0;
+    best_out_of = 1;
+    best_diff = 0;
+    for ( i=0; i<num_candidates; ++i ) {
+        if ( (i > 0) && (candidates[i] == candidates[i-1]) ) {
+            continue;
+        }
+        file = &index->files[candidates[i]];
+        diff = size_bucket(file->sketch.size) - size_bucket(sketch->size);
+        if ( (diff < -1) || (diff > 1) ) {
+            continue;
+        }
+        shared = shared_samples(&file->sketch, sketch, &out_of);
+        if ( (shared * SIMILAR_MIN_SHARE) < out_of ) {
+            continue;
+        }
+        diff = file->sketch.size - sketch->size;
+        if ( diff < 0 ) {
+            diff = -diff;
+        }
+        if ( (best < 0) ||
+             ((shared * best_out_of) > (best_shared * out_of)) ||
+             (((shared * best_out_of) == (best_shared * out_of)) &&
+              (diff < best_diff)) ) {
+            best = candidates[i];
+            best_shared = shared;
+            best_out_of = out_of;
+            best_diff = diff;
+        }
+    }
+    return(best);
+}
+
+const char *similar_path(struct similar_index *index, int file)
+{
+    return(index->files[file].path);
+}
+
+void free_similar_index(struct similar_index *index)
+{
+    int i;
+
+    if ( index ) {
+        for ( i=0; i<index->num_files; ++i ) {
+            free(index->files[i].path);
+        }
+        if ( index->files ) {
+            free(index->files);
+        }
+        if ( index->samples ) {
+            free(index->samples);
+        }
+        if ( index->top ) {
+            free(index->top);
+        }
+        free(index);
+    }
+}
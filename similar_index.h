@@ -0,0 +1,41 @@
+
+/* A lookup table of the files in an old tree by samples of what they
+   hold, used to find an old file to build a delta from for each file
+   which is new to that tree, so that moved and copied files don't have
+   to be stored whole in the patch.
+
+   A file is sampled by hashing every run of SIMILAR_WINDOW bytes in it,
+   and keeping the SIMILAR_SAMPLES smallest hashes.  Two files with much
+   of the same contents keep many of the same samples, wherever in the
+   files those contents are.  Only old files of about the same size as
+   the new one are considered.
+ */
+
+#define SIMILAR_WINDOW  32
+#define SIMILAR_SAMPLES 32
+
+struct similar_sketch {
+    long size;
+    int count;
+    unsigned int samples[SIMILAR_SAMPLES];  /* In ascending order */
+};
+
+/* Sample the contents of a file */
+extern int similar_sketch_file(const char *path, struct similar_sketch *sketch);
+
+/* Sample all the files under top/path, using up to 'jobs' processes.
+   The files are named relative to 'top'.
+ */
+extern struct similar_index *similar_build(const char *top, const char *path,
+                                           int jobs);
+
+/* Find the old file most like the one sampled, returning its number in
+   the index, or -1 if nothing is close enough to be worth a delta. */
+extern int similar_find(struct similar_index *index,
+                        const struct similar_sketch *sketch);
+
+/* The name of a file in the index, relative to the top of the tree */
+extern const char *similar_path(struct similar_index *index, int file);
+
+/* Free the index, when the tree is done */
+extern void free_similar_index(struct similar_index *index);
@@ -1,5 +1,8 @@
 
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -12,41 +15,30 @@
 
 #include "loki_patch.h"
 #include "size_patch.h"
+#include "payload_index.h"
+#include "path_index.h"
+#include "log_output.h"
 
 
-/* Calculate the size of the patch data files */
+/* Calculate the size of the patch data files, each shared file counts once */
 size_t patch_size(loki_patch *patch)
 {
-    char path[PATH_MAX];
-    struct stat sb;
-    size_t used = 0;
-
-    /* First check the space used by new files */
-    { struct op_add_file *op;
-
-        for ( op = patch->add_file_list; op; op=op->next ) {
-            sprintf(path, "%s/%s", patch->base, op->src);
-            if ( stat(path, &sb) == 0 ) {
-                used += sb.st_size;
-            }
-        }
-    }
+    return((payload_size(patch)+1023)/1024);
+}
 
-    /* Now check the space used by patch delta files */
-    { struct op_patch_file *op;
+/* See if any delta for a file is chained on to another one */
+static int is_chained(struct op_patch_file *op)
+{
+    struct delta_option *option, *next;
 
-        for ( op = patch->patch_file_list; op; op=op->next ) {
-            struct delta_option *option;
-            for ( option = op->options; option; option = option->next ) {
-                sprintf(path, "%s/%s", patch->base, option->src);
-                if ( stat(path, &sb) == 0 ) {
-                    used += sb.st_size;
-                }
+    for ( option=op->options; option; option=option->next ) {
+        for ( next=op->options; next; next=next->next ) {
+            if ( strcmp(option->newsum, next->oldsum) == 0 ) {
+                return(1);
             }
         }
     }
-
-    return((used+1023)/1024);
+    return(0);
 }
 
 /* Calculate the maximum disk space required for patch */
@@ -59,6 +51,9 @@ size_t calculate_space(loki_patch *patch, int unsafe)
     { struct op_add_file *op;
 
         for ( op = patch->add_file_list; op; op=op->next ) {
+            if ( op->performed ) {
+                continue;
+            }
             size = (op->size + 1023)/1024;
             if ( unsafe ) {
                 if ( size > used ) {
@@ -74,7 +69,14 @@ size_t calculate_space(loki_patch *patch, int unsafe)
     { struct op_patch_file *op;
 
         for ( op = patch->patch_file_list; op; op=op->next ) {
+            if ( op->performed ) {
+                continue;
+            }
             size = (op->size + 1023)/1024;
+            /* There's a version along the way while a chain is applied */
+            if ( is_chained(op) ) {
+                size *= 2;
+            }
             if ( unsafe ) {
                 if ( size > used ) {
                     used = size;
@@ -88,6 +90,348 @@ size_t calculate_space(loki_patch *patch, int unsafe)
     return(used);
 }
 
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int collect_sources(loki_patch *patch, struct delta_sources *sources)
+{
+    struct op_patch_file *op;
+    struct delta_option *option;
+
+    sources->count = 0;
+    sources->paths = NULL;
+    for ( op = patch->patch_file_list; op; op=op->next ) {
+        for ( option=op->options; option; option=option->next ) {
+            if ( option->from ) {
+                ++sources->count;
+            }
+        }
+    }
+    if ( sources->count == 0 ) {
+        return(0);
+    }
+    sources->paths = (char **)malloc(sources->count * (sizeof *sources->paths));
+    if ( ! sources->paths ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    sources->count = 0;
+    for ( op = patch->patch_file_list; op; op=op->next ) {
+        for ( option=op->options; option; option=option->next ) {
+            if ( option->from ) {
+                sources->paths[sources->count++] = option->from;
+            }
+        }
+    }
+    qsort(sources->paths, sources->count, sizeof *sources->paths,
+          compare_paths);
+    return(0);
+}
+
+/* See if a delta is applied to the given file, or to anything under
+   the given directory */
+int is_delta_source(struct delta_sources *sources, const char *path,
+                           int is_dir)
+{
+    int lo, hi, mid, len;
+
+    /* Find the first source at or after the path */
+    lo = 0;
+    hi = sources->count;
+    while ( lo < hi ) {
+        mid = (lo + hi) / 2;
+        if ( strcmp(sources->paths[mid], path) < 0 ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    len = strlen(path);
+    for ( ; lo < sources->count; ++lo ) {
+        if ( strncmp(sources->paths[lo], path, len) != 0 ) {
+            break;
+        }
+        if ( sources->paths[lo][len] == '\0' ) {
+            return(1);
+        }
+        if ( is_dir && (sources->paths[lo][len] == '/') ) {
+            return(1);
+        }
+    }
+    return(0);
+}
+
+int is_removed_late(loki_patch *patch, struct delta_sources *sources,
+                    const char *path, int is_dir)
+{
+    if ( is_delta_source(sources, path, is_dir) ) {
+        return(1);
+    }
+    return(index_count_tree(patch, OP_ADD_PATH, path) ||
+           index_count_tree(patch, OP_ADD_FILE, path) ||
+           index_count_tree(patch, OP_PATCH_FILE, path) ||
+           index_count_tree(patch, OP_SYMLINK_FILE, path));
+}
+
+/* Put the path of a file in the install together */
+static void install_path(char *path, const char *dst, const char *file)
+{
+    if ( *file == '/' ) {
+        strcpy(path, file);
+    } else {
+        sprintf(path, "%s/%s", dst, file);
+    }
+}
+
+/* The K taken up by a file in the install, or everything under a
+   directory, counting nothing for anything that isn't there */
+static long install_space(const char *path)
+{
+    char child_path[PATH_MAX];
+    DIR *dir;
+    struct dirent *entry;
+    struct stat sb;
+    long space;
+
+    if ( lstat(path, &sb) < 0 ) {
+        return(0);
+    }
+    if ( S_ISREG(sb.st_mode) ) {
+        return((sb.st_size + 1023)/1024);
+    }
+    if ( ! S_ISDIR(sb.st_mode) ) {
+        return(0);
+    }
+    space = 0;
+    dir = opendir(path);
+    if ( dir ) {
+        while ( (entry=readdir(dir)) != NULL ) {
+            if ( (strcmp(entry->d_name, ".") == 0) ||
+                 (strcmp(entry->d_name, "..") == 0) ) {
+                continue;
+            }
+            sprintf(child_path, "%s/%s", path, entry->d_name);
+            space += install_space(child_path);
+        }
+        closedir(dir);
+    }
+    return(space);
+}
+
+/* The space used by a file an earlier run made already is taken, so it
+   only gives back the space of the file it replaces, if it hasn't been
+   renamed over it yet */
+static void made_step(struct patch_step *step, const char *dst,
+                      const char *file)
+{
+    char path[PATH_MAX];
+    char new_path[PATH_MAX];
+
+    step->space = 0;
+    step->growth = 0;
+    if ( dst ) {
+        install_path(path, dst, file);
+        sprintf(new_path, "%s.new", path);
+        if ( install_space(new_path) > 0 ) {
+            step->growth = -install_space(path);
+        }
+    }
+}
+
+/* Files which deltas are applied to go last, and otherwise the files
+   which free the most space go first.  Until the steps are put into
+   batches, 'batch' holds the order they're listed in the patch. */
+static int compare_steps(const void *a, const void *b)
+{
+    const struct patch_step *step_a = (const struct patch_step *)a;
+    const struct patch_step *step_b = (const struct patch_step *)b;
+
+    if ( step_a->joined != step_b->joined ) {
+        return(step_a->joined - step_b->joined);
+    }
+    if ( step_a->growth != step_b->growth ) {
+        return((step_a->growth < step_b->growth) ? -1 : 1);
+    }
+    return(step_a->batch - step_b->batch);
+}
+
+int schedule_patch(loki_patch *patch, const char *dst, size_t limit,
+                   struct patch_schedule *schedule)
+{
+    char path[PATH_MAX];
+    struct patch_step *step;
+    long max, space, freeable, used, staged, growth, peak;
+    int i, n, batch;
+
+    memset(schedule, 0, (sizeof *schedule));
+    if ( collect_sources(patch, &schedule->sources) < 0 ) {
+        return(-1);
+    }
+    { struct op_add_file *op;
+
+        for ( op = patch->add_file_list; op; op=op->next ) {
+            ++schedule->count;
+        }
+    }
+    { struct op_patch_file *op;
+
+        for ( op = patch->patch_file_list; op; op=op->next ) {
+            ++schedule->count;
+        }
+    }
+    schedule->steps = (struct patch_step *)malloc(
+                            (schedule->count+1) * (sizeof *schedule->steps));
+    if ( ! schedule->steps ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_schedule(schedule);
+        return(-1);
+    }
+
+    /* Work out the space each file takes, and gives back once it's
+       replaced the file that was there before */
+    step = schedule->steps;
+    { struct op_patch_file *op;
+
+        for ( op = patch->patch_file_list; op; op=op->next ) {
+            space = (op->size + 1023)/1024;
+            step->type = OP_PATCH_FILE;
+            step->op = op;
+            step->space = is_chained(op) ? space*2 : space;
+            step->growth = 0;
+            if ( dst ) {
+                install_path(path, dst, op->dst);
+                step->growth = space - install_space(path);
+            }
+            if ( op->performed ) {
+                made_step(step, dst, op->dst);
+            }
+            step->joined = is_delta_source(&schedule->sources, op->dst, 0);
+            step->batch = (step - schedule->steps);
+            ++step;
+        }
+    }
+    { struct op_add_file *op;
+
+        for ( op = patch->add_file_list; op; op=op->next ) {
+            space = (op->size + 1023)/1024;
+            step->type = OP_ADD_FILE;
+            step->op = op;
+            step->space = space;
+            step->growth = space;
+            if ( dst ) {
+                install_path(path, dst, op->dst);
+                step->growth -= install_space(path);
+            }
+            if ( op->performed ) {
+                made_step(step, dst, op->dst);
+            }
+            step->joined = is_delta_source(&schedule->sources, op->dst, 0);
+            step->batch = (step - schedule->steps);
+            ++step;
+        }
+    }
+    qsort(schedule->steps, schedule->count, sizeof *schedule->steps,
+          compare_steps);
+    for ( i=0; i<schedule->count; ++i ) {
+        if ( schedule->steps[i].joined ) {
+            schedule->steps[i].joined = 0;
+            break;
+        }
+    }
+
+    /* The space freed by removing the obsolete files early */
+    freeable = 0;
+    if ( dst ) {
+        { struct op_del_file *op;
+
+            for ( op = patch->del_file_list; op; op=op->next ) {
+                if ( ! is_removed_late(patch, &schedule->sources,
+                                       op->dst, 0) ) {
+                    install_path(path, dst, op->dst);
+                    freeable += install_space(path);
+                }
+            }
+        }
+        { struct op_del_path *op;
+
+            for ( op = patch->del_path_list; op; op=op->next ) {
+                if ( ! is_removed_late(patch, &schedule->sources,
+                                       op->dst, 1) ) {
+                    install_path(path, dst, op->dst);
+                    freeable += install_space(path);
+                }
+            }
+        }
+    }
+
+    /* Fill each batch with as many files as fit in the space that's left */
+    max = (limit > LONG_MAX) ? LONG_MAX : (long)limit;
+    schedule->delete_batch = -1;
+    used = 0;
+    peak = 0;
+    batch = 0;
+    i = 0;
+    while ( i < schedule->count ) {
+        staged = 0;
+        growth = 0;
+        while ( i < schedule->count ) {
+            space = 0;
+            for ( n=i; n < schedule->count; ++n ) {
+                if ( (n > i) && !schedule->steps[n].joined ) {
+                    break;
+                }
+                space += schedule->steps[n].space;
+            }
+            if ( staged && ((used + staged + space) > max) ) {
+                break;
+            }
+            if ( !staged && (schedule->delete_batch < 0) &&
+                 ((used + space) > max) ) {
+                schedule->delete_batch = batch;
+                used -= freeable;
+            }
+            for ( ; i < n; ++i ) {
+                schedule->steps[i].batch = batch;
+                growth += schedule->steps[i].growth;
+            }
+            staged += space;
+        }
+        if ( (used + staged) > peak ) {
+            peak = (used + staged);
+        }
+        used += growth;
+        ++batch;
+    }
+    schedule->batches = batch;
+    if ( schedule->delete_batch < 0 ) {
+        schedule->delete_batch = batch;
+    }
+    schedule->peak = peak;
+    return(0);
+}
+
+void free_schedule(struct patch_schedule *schedule)
+{
+    free(schedule->sources.paths);
+    free(schedule->steps);
+    memset(schedule, 0, (sizeof *schedule));
+}
+
+size_t schedule_space(loki_patch *patch, const char *dst, size_t limit)
+{
+    struct patch_schedule schedule;
+    size_t peak;
+
+    if ( schedule_patch(patch, dst, limit, &schedule) < 0 ) {
+        return calculate_space(patch, 0);
+    }
+    peak = schedule.peak;
+    free_schedule(&schedule);
+    return(peak);
+}
+
 /* Calculate the amount of free space on the given path */
 size_t available_space(const char *path)
 {
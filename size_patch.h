@@ -4,8 +4,67 @@
 /* Calculate the size of the patch data files */
 extern size_t patch_size(loki_patch *patch);
 
-/* Calculate the maximum disk space required for patch */
+/* Calculate the maximum disk space required for patch, leaving out the
+   files marked as performed, which an earlier run made already */
 extern size_t calculate_space(loki_patch *patch, int unsafe);
 
 /* Calculate the amount of free space on the given path */
 extern size_t available_space(const char *path);
+
+/* The files which deltas are applied to in place of their destination,
+   sorted so the deletions can be checked against them quickly.
+ */
+struct delta_sources {
+    int count;
+    char **paths;
+};
+
+extern int collect_sources(loki_patch *patch, struct delta_sources *sources);
+
+/* See if a delta is applied to the given file, or to anything under
+   the given directory */
+extern int is_delta_source(struct delta_sources *sources, const char *path,
+                           int is_dir);
+
+/* See if an obsolete file or directory has to stay until everything else
+   is in place, because a delta is applied to it or the patch puts
+   something else there */
+extern int is_removed_late(loki_patch *patch, struct delta_sources *sources,
+                           const char *path, int is_dir);
+
+/* A safe patch writes each new file next to the one it replaces, and
+   renames them all into place once they've all been made.  When there
+   isn't room for that, the files are made and renamed in batches, so
+   that the space freed by one batch can be used by the next, and the
+   obsolete files are removed early if that's what it takes, unless
+   they're removed late anyway.  Any file which a delta is applied to is
+   replaced in the last batch, after everything which reads it is made.
+ */
+struct patch_step {
+    patch_op type;              /* OP_ADD_FILE or OP_PATCH_FILE */
+    void *op;
+    long space;                 /* K used while the new file is being made */
+    long growth;                /* K the install grows by once it's renamed */
+    int joined;                 /* Renamed along with the step before */
+    int batch;
+};
+
+struct patch_schedule {
+    struct delta_sources sources;
+    struct patch_step *steps;
+    int count;
+    int batches;
+    int delete_batch;           /* Obsolete files go before this batch */
+    size_t peak;                /* The most K used at any one time */
+};
+
+/* Work out the batches for applying a patch to 'dst' using no more than
+   'limit' K at once, where that's possible.  Without an install to look
+   at, patched files are taken to stay the same size.  Files marked as
+   performed were made by an earlier run, and take no more space. */
+extern int schedule_patch(loki_patch *patch, const char *dst, size_t limit,
+                          struct patch_schedule *schedule);
+extern void free_schedule(struct patch_schedule *schedule);
+
+/* The most disk space used at once by a patch applied in batches */
+extern size_t schedule_space(loki_patch *patch, const char *dst, size_t limit);
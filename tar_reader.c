@@ -0,0 +1,369 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include <zlib.h>
+
+#include "tar_reader.h"
+#include "log_output.h"
+
+#define TAR_BLOCK       512
+
+/* Extended headers larger than this aren't read */
+#define TAR_MAX_PAX     (1024*1024)
+
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+struct tar_reader {
+    gzFile zfp;
+    char path[PATH_MAX];
+    long long left;             /* Data left in the current entry */
+    long long pad;              /* Then padding to the end of the block */
+};
+
+struct tar_reader *tar_open(const char *path)
+{
+    struct tar_reader *tar;
+
+    tar = (struct tar_reader *)malloc(sizeof *tar);
+    if ( ! tar ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return((struct tar_reader *)0);
+    }
+    memset(tar, 0, (sizeof *tar));
+    strcpy(tar->path, path);
+
+    /* Archives which aren't gzipped are read as they are */
+    tar->zfp = gzopen(path, "rb");
+    if ( tar->zfp == NULL ) {
+        logme(LOG_ERROR, "Unable to read %s\n", path);
+        free(tar);
+        return((struct tar_reader *)0);
+    }
+    return(tar);
+}
+
+/* Numbers are octal, or base 256 if they're too large for that */
+static long long tar_number(const char *field, int len)
+{
+    long long value;
+    int i;
+
+    value = 0;
+    if ( (unsigned char)field[0] & 0x80 ) {
+        value = field[0] & 0x3f;
+        for ( i=1; i<len; ++i ) {
+            value = (value << 8) | (unsigned char)field[i];
+        }
+        return(value);
+    }
+    for ( i=0; (i < len) && (field[i] == ' '); ++i )
+        ;
+    for ( ; (i < len) && (field[i] >= '0') && (field[i] <= '7'); ++i ) {
+        value = (value * 8) + (field[i] - '0');
+    }
+    return(value);
+}
+
+/* The checksum is of the header with the checksum field as spaces, some
+   old versions of tar summed the bytes as signed */
+static int valid_header(const struct tar_header *header)
+{
+    const unsigned char *block = (const unsigned char *)header;
+    long long stored, usum, ssum;
+    int i, c;
+
+    stored = tar_number(header->chksum, sizeof(header->chksum));
+    usum = 0;
+    ssum = 0;
+    for ( i=0; i<TAR_BLOCK; ++i ) {
+        c = ((i >= 148) && (i < 156)) ? ' ' : block[i];
+        usum += c;
+        ssum += (signed char)c;
+    }
+    return((stored == usum) || (stored == ssum));
+}
+
+static int is_zero_block(const char *block)
+{
+    int i;
+
+    for ( i=0; i<TAR_BLOCK; ++i ) {
+        if ( block[i] ) {
+            return(0);
+        }
+    }
+    return(1);
+}
+
+static long long padding(long long size)
+{
+    return((TAR_BLOCK - (size % TAR_BLOCK)) % TAR_BLOCK);
+}
+
+/* Data is read and thrown away rather than seeked over, since gzseek()
+   doesn't notice the end of the file and a truncated archive would look
+   like one which just ended early */
+static int skip_data(struct tar_reader *tar, long long amount)
+{
+    char buf[16*TAR_BLOCK];
+    int len;
+
+    while ( amount > 0 ) {
+        len = (amount < (long long)sizeof(buf)) ? (int)amount : sizeof(buf);
+        if ( gzread(tar->zfp, buf, len) != len ) {
+            logme(LOG_ERROR, "Unexpected end of %s\n", tar->path);
+            return(-1);
+        }
+        amount -= len;
+    }
+    return(0);
+}
+
+static int read_data(struct tar_reader *tar, char *data, long long size)
+{
+    if ( gzread(tar->zfp, data, size) != size ) {
+        logme(LOG_ERROR, "Unexpected end of %s\n", tar->path);
+        return(-1);
+    }
+    return skip_data(tar, padding(size));
+}
+
+/* GNU tar puts a long name or link in an entry of its own */
+static int read_long_name(struct tar_reader *tar, char *name, long long size)
+{
+    if ( size >= PATH_MAX ) {
+        logme(LOG_ERROR, "Name too long in %s\n", tar->path);
+        return(-1);
+    }
+    if ( read_data(tar, name, size) < 0 ) {
+        return(-1);
+    }
+    name[size] = '\0';
+    return(0);
+}
+
+/* A pax header is a list of "length key=value\n" records */
+static int read_pax(struct tar_reader *tar, long long size,
+                    char *name, char *link, long long *data_size)
+{
+    char *data, *record, *key, *value, *end;
+    long len;
+
+    if ( size > TAR_MAX_PAX ) {
+        return skip_data(tar, size + padding(size));
+    }
+    data = (char *)malloc(size + 1);
+    if ( ! data ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    if ( read_data(tar, data, size) < 0 ) {
+        free(data);
+        return(-1);
+    }
+    data[size] = '\0';
+    for ( record=data; record < (data+size); record += len ) {
+        len = strtol(record, &key, 10);
+        if ( (len <= 0) || ((record+len) > (data+size)) || (*key != ' ') ) {
+            break;
+        }
+        ++key;
+        end = record + len - 1;
+        value = memchr(key, '=', end - key);
+        if ( !value || (*end != '\n') ) {
+            break;
+        }
+        *value++ = '\0';
+        *end = '\0';
+        if ( (strcmp(key, "path") == 0) && ((end - value) < PATH_MAX) ) {
+            strcpy(name, value);
+        } else
+        if ( (strcmp(key, "linkpath") == 0) && ((end - value) < PATH_MAX) ) {
+            strcpy(link, value);
+        } else
+        if ( strcmp(key, "size") == 0 ) {
+            *data_size = strtoll(value, NULL, 10);
+        }
+    }
+    free(data);
+    return(0);
+}
+
+/* Copy a name out of a header field, which needn't be nul terminated */
+static void copy_field(char *dst, const char *field, int len)
+{
+    memcpy(dst, field, len);
+    dst[len] = '\0';
+}
+
+int tar_next(struct tar_reader *tar, struct tar_entry *entry)
+{
+    union {
+        struct tar_header header;
+        char block[TAR_BLOCK];
+    } u;
+    struct tar_header *header = &u.header;
+    char long_name[PATH_MAX];
+    char long_link[PATH_MAX];
+    long long size, pax_size;
+    char prefix[sizeof(header->prefix)+1];
+    int len;
+
+    /* Skip whatever's left of the last entry */
+    if ( skip_data(tar, tar->left + tar->pad) < 0 ) {
+        return(-1);
+    }
+    tar->left = 0;
+    tar->pad = 0;
+
+    *long_name = '\0';
+    *long_link = '\0';
+    pax_size = -1;
+    for ( ; ; ) {
+        /* The archive ends with blocks of zeroes, or just ends */
+        len = gzread(tar->zfp, u.block, TAR_BLOCK);
+        if ( (len == 0) || ((len == TAR_BLOCK) && is_zero_block(u.block)) ) {
+            return(0);
+        }
+        if ( (len != TAR_BLOCK) || !valid_header(header) ) {
+            logme(LOG_ERROR, "%s is not a tar archive, or is corrupt\n",
+                                                                tar->path);
+            return(-1);
+        }
+        size = tar_number(header->size, sizeof(header->size));
+
+        /* Headers which hold the details of the entry after them */
+        if ( header->typeflag == 'L' ) {
+            if ( read_long_name(tar, long_name, size) < 0 ) {
+                return(-1);
+            }
+            continue;
+        }
+        if ( header->typeflag == 'K' ) {
+            if ( read_long_name(tar, long_link, size) < 0 ) {
+                return(-1);
+            }
+            continue;
+        }
+        if ( header->typeflag == 'x' ) {
+            if ( read_pax(tar, size, long_name, long_link, &pax_size) < 0 ) {
+                return(-1);
+            }
+            continue;
+        }
+        if ( header->typeflag == 'g' ) {
+            if ( skip_data(tar, size + padding(size)) < 0 ) {
+                return(-1);
+            }
+            continue;
+        }
+        break;
+    }
+
+    /* Fill in the entry */
+    if ( *long_name ) {
+        strcpy(entry->name, long_name);
+    } else {
+        copy_field(entry->name, header->name, sizeof(header->name));
+        if ( (memcmp(header->magic, "ustar", 6) == 0) && *header->prefix ) {
+            copy_field(prefix, header->prefix, sizeof(header->prefix));
+            sprintf(entry->name, "%s/%.*s", prefix,
+                    (int)sizeof(header->name), header->name);
+        }
+    }
+    if ( *long_link ) {
+        strcpy(entry->link, long_link);
+    } else {
+        copy_field(entry->link, header->linkname, sizeof(header->linkname));
+    }
+    entry->mode = tar_number(header->mode, sizeof(header->mode)) & 07777;
+    if ( pax_size >= 0 ) {
+        size = pax_size;
+    }
+    entry->size = 0;
+    switch (header->typeflag) {
+        case '\0':
+        case '0':
+        case '7':
+            /* Very old archives mark directories with a trailing slash */
+            len = strlen(entry->name);
+            if ( len && (entry->name[len-1] == '/') ) {
+                entry->type = TAR_DIRECTORY;
+            } else {
+                entry->type = TAR_FILE;
+                entry->size = size;
+            }
+            break;
+        case '1':
+            entry->type = TAR_HARDLINK;
+            break;
+        case '2':
+            entry->type = TAR_SYMLINK;
+            break;
+        case '5':
+            entry->type = TAR_DIRECTORY;
+            break;
+        case '3':
+        case '4':
+        case '6':
+            entry->type = TAR_OTHER;
+            break;
+        default:
+            /* Anything else may have data, which is skipped */
+            entry->type = TAR_OTHER;
+            tar->left = size;
+            tar->pad = padding(size);
+            break;
+    }
+    if ( entry->type == TAR_FILE ) {
+        tar->left = entry->size;
+        tar->pad = padding(entry->size);
+    }
+    return(1);
+}
+
+int tar_read(struct tar_reader *tar, void *data, int len)
+{
+    if ( len > tar->left ) {
+        len = tar->left;
+    }
+    if ( len == 0 ) {
+        return(0);
+    }
+    len = gzread(tar->zfp, data, len);
+    if ( len <= 0 ) {
+        logme(LOG_ERROR, "Unexpected end of %s\n", tar->path);
+        return(-1);
+    }
+    tar->left -= len;
+    return(len);
+}
+
+void tar_close(struct tar_reader *tar)
+{
+    if ( tar ) {
+        gzclose(tar->zfp);
+        free(tar);
+    }
+}
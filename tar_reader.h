@@ -0,0 +1,37 @@
+
+/* Reads the entries of a tar archive one at a time, straight out of the
+   archive, which may be gzipped.  POSIX ustar archives are understood,
+   along with the GNU and pax headers used for long names and large files.
+ */
+
+typedef enum {
+    TAR_FILE,
+    TAR_HARDLINK,
+    TAR_SYMLINK,
+    TAR_DIRECTORY,
+    TAR_OTHER               /* Devices, fifos and so on */
+} tar_type;
+
+struct tar_entry {
+    tar_type type;
+    char name[PATH_MAX];
+    char link[PATH_MAX];    /* The target of a link */
+    long mode;              /* The permissions only */
+    long long size;         /* The data that follows a file entry */
+};
+
+/* Open an archive, or return NULL if it can't be read */
+extern struct tar_reader *tar_open(const char *path);
+
+/* Move on to the next entry, skipping whatever's left of the last one.
+   This returns 1 if there is an entry, 0 at the end of the archive, and
+   -1 if the archive is corrupt or can't be read.
+ */
+extern int tar_next(struct tar_reader *tar, struct tar_entry *entry);
+
+/* Read the data of the current entry, returning the number of bytes
+   read, 0 at the end of the data, or -1 on error */
+extern int tar_read(struct tar_reader *tar, void *data, int len);
+
+/* Close the archive */
+extern void tar_close(struct tar_reader *tar);
@@ -8,6 +8,9 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <sys/time.h>
 
 #include <zlib.h>
 
@@ -17,15 +20,39 @@
 #include "loki_xdelta.h"
 #include "mkdirhier.h"
 #include "md5.h"
+#include "md5_cache.h"
+#include "job_pool.h"
+#include "arena.h"
+#include "path_index.h"
+#include "payload_index.h"
+#include "similar_index.h"
+#include "tar_reader.h"
 #include "log_output.h"
 
 
+/* Forward declaration for compilation */
+static void cancel_pending(struct op_add_file *add);
+static void cancel_delta(struct delta_option *option);
+static int unpack_file_data(const char *pat_path, const char *path);
+
+/* See if a path is already in the patch list for the specified operation
+ */
+static int is_in_patch(patch_op op, const char *dst, loki_patch *patch)
+{
+    return(index_count(patch, op, dst) > 0);
+}
+
 /* Remove a path from the specified portion of the patch
  */
 static void remove_path(patch_op op, const char *dst, loki_patch *patch)
 {
     char path[PATH_MAX];
+    int refs;
 
+    /* Don't bother walking the list if the path isn't in it */
+    if ( (op != OP_NONE) && !is_in_patch(op, dst, patch) ) {
+        return;
+    }
     switch (op) {
         case OP_NONE: {
             remove_path(OP_ADD_PATH, dst, patch);
@@ -38,21 +65,22 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         break;
 
         case OP_ADD_PATH: {
-            struct op_add_path *elem, *prev, *freeable;
+            struct op_add_path *elem, *prev, *removed;
 
             prev = NULL;
             elem = patch->add_path_list;
             while ( elem ) {
                 if ( strcmp(elem->dst, dst) == 0 ) {
-                    freeable = elem;
+                    removed = elem;
                     elem = elem->next;
                     if ( prev ) {
                         prev->next = elem;
                     } else {
                         patch->add_path_list = elem;
                     }
-                    freeable->next = NULL;
-                    free_add_path(freeable);
+                    if ( patch->add_path_tail == removed ) {
+                        patch->add_path_tail = prev;
+                    }
                 } else {
                     prev = elem;
                     elem = elem->next;
@@ -62,23 +90,34 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         break;
         
         case OP_ADD_FILE: {
-            struct op_add_file *elem, *prev, *freeable;
+            struct op_add_file *elem, *prev, *removed;
 
             prev = NULL;
             elem = patch->add_file_list;
             while ( elem ) {
                 if ( strcmp(elem->dst, dst) == 0 ) {
-                    freeable = elem;
+                    /* Files that haven't been checksummed yet don't hold
+                       a reference to their data, it hasn't been copied */
+                    removed = elem;
+                    if ( *removed->sum ) {
+                        refs = payload_release(patch, removed->src);
+                    } else {
+                        refs = payload_refs(patch, removed->src);
+                    }
+                    if ( ! refs ) {
+                        sprintf(path, "%s/%s", patch->base, removed->src);
+                        unlink(path);
+                    }
                     elem = elem->next;
                     if ( prev ) {
                         prev->next = elem;
                     } else {
                         patch->add_file_list = elem;
                     }
-                    freeable->next = NULL;
-                    sprintf(path, "%s/%s", patch->base, freeable->src);
-                    unlink(path);
-                    free_add_file(freeable);
+                    if ( patch->add_file_tail == removed ) {
+                        patch->add_file_tail = prev;
+                    }
+                    cancel_pending(removed);
                 } else {
                     prev = elem;
                     elem = elem->next;
@@ -88,21 +127,22 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         break;
 
         case OP_DEL_PATH: {
-            struct op_del_path *elem, *prev, *freeable;
+            struct op_del_path *elem, *prev, *removed;
 
             prev = NULL;
             elem = patch->del_path_list;
             while ( elem ) {
                 if ( strcmp(elem->dst, dst) == 0 ) {
-                    freeable = elem;
+                    removed = elem;
                     elem = elem->next;
                     if ( prev ) {
                         prev->next = elem;
                     } else {
                         patch->del_path_list = elem;
                     }
-                    freeable->next = NULL;
-                    free_del_path(freeable);
+                    if ( patch->del_path_tail == removed ) {
+                        patch->del_path_tail = prev;
+                    }
                 } else {
                     prev = elem;
                     elem = elem->next;
@@ -112,21 +152,22 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         break;
         
         case OP_DEL_FILE: {
-            struct op_del_file *elem, *prev, *freeable;
+            struct op_del_file *elem, *prev, *removed;
 
             prev = NULL;
             elem = patch->del_file_list;
             while ( elem ) {
                 if ( strcmp(elem->dst, dst) == 0 ) {
-                    freeable = elem;
+                    removed = elem;
                     elem = elem->next;
                     if ( prev ) {
                         prev->next = elem;
                     } else {
                         patch->del_file_list = elem;
                     }
-                    freeable->next = NULL;
-                    free_del_file(freeable);
+                    if ( patch->del_file_tail == removed ) {
+                        patch->del_file_tail = prev;
+                    }
                 } else {
                     prev = elem;
                     elem = elem->next;
@@ -136,7 +177,7 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         break;
         
         case OP_PATCH_FILE: {
-            struct op_patch_file *elem, *prev, *freeable;
+            struct op_patch_file *elem, *prev, *removed;
 
             prev = NULL;
             elem = patch->patch_file_list;
@@ -144,19 +185,23 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
                 if ( strcmp(elem->dst, dst) == 0 ) {
                     struct delta_option *here;
 
-                    freeable = elem;
+                    removed = elem;
+                    for ( here=removed->options; here; here=here->next ) {
+                        if ( ! payload_release(patch, here->src) ) {
+                            sprintf(path, "%s/%s", patch->base, here->src);
+                            unlink(path);
+                            cancel_delta(here);
+                        }
+                    }
                     elem = elem->next;
                     if ( prev ) {
                         prev->next = elem;
                     } else {
                         patch->patch_file_list = elem;
                     }
-                    freeable->next = NULL;
-                    for ( here=elem->options; here; here=here->next ) {
-                        sprintf(path, "%s/%s", patch->base, here->src);
-                        unlink(path);
+                    if ( patch->patch_file_tail == removed ) {
+                        patch->patch_file_tail = prev;
                     }
-                    free_patch_file(freeable);
                 } else {
                     prev = elem;
                     elem = elem->next;
@@ -166,21 +211,22 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         break;
         
         case OP_SYMLINK_FILE: {
-            struct op_symlink_file *elem, *prev, *freeable;
+            struct op_symlink_file *elem, *prev, *removed;
 
             prev = NULL;
             elem = patch->symlink_file_list;
             while ( elem ) {
                 if ( strcmp(elem->dst, dst) == 0 ) {
-                    freeable = elem;
+                    removed = elem;
                     elem = elem->next;
                     if ( prev ) {
                         prev->next = elem;
                     } else {
                         patch->symlink_file_list = elem;
                     }
-                    freeable->next = NULL;
-                    free_symlink_file(freeable);
+                    if ( patch->symlink_file_tail == removed ) {
+                        patch->symlink_file_tail = prev;
+                    }
                 } else {
                     prev = elem;
                     elem = elem->next;
@@ -189,158 +235,430 @@ static void remove_path(patch_op op, const char *dst, loki_patch *patch)
         }
         break;
     }
+    if ( op != OP_NONE ) {
+        index_remove_path(patch, op, dst);
+    }
 }
 
-/* See if a path is already in the patch list for the specified operation
+/* The contents of new and changed files are collected as the trees are
+   walked, then checksummed, compressed and diffed all at once - on a pool
+   of worker processes if more than one job is allowed.  The results are
+   merged into the patch in the order the files were found, so the patch
+   is the same no matter how many jobs are used.  Data or deltas with the
+   same checksums as something already in the patch aren't stored again.
+
+   When patching one tree to another, a file which is new to the old tree
+   is looked for in the rest of the old tree at the same time, and if an
+   old file is much like it, the patch holds a delta from that instead.
+
+   When several old trees are patched to the same new tree, the entries
+   for a new file follow one another, one for each old tree, and the new
+   file is only checksummed for the first of them.
  */
-static int is_in_patch(patch_op op, const char *dst, loki_patch *patch)
+struct pending_file {
+    char *o_path;               /* The old file, or NULL for an added file */
+    char *n_path;               /* The new file */
+    char *dst;
+    int find_base;              /* Look for an old file to delta against */
+    int tree;                   /* The old tree to look in */
+    char *from;                 /* The old file found, relative to the tree */
+    struct op_add_file *add;    /* The operation for an added file */
+    struct delta_option *option;/* The delta for a patched file, if any */
+    char *pat_path;             /* Where the file data or delta goes, if
+                                   it isn't already in the patch */
+    char oldsum[CHECKSUM_SIZE+1];
+    char newsum[CHECKSUM_SIZE+1];
+    int same_new;               /* The new file is the one before this */
+    int cancelled;
+    int failed;
+};
+
+struct pending_sums {
+    char oldsum[CHECKSUM_SIZE+1];
+    char newsum[CHECKSUM_SIZE+1];
+    int base;                   /* The similar old file, or -1 */
+};
+
+struct pending_data {
+    long delta;                 /* The size of the delta */
+    long whole;                 /* The size of the whole file compressed,
+                                   or as far as it got */
+    int use_whole;              /* The whole file is stored instead */
+};
+
+struct pending_work {
+    loki_patch *patch;
+    struct pending_file **files;
+};
+
+static int tree_jobs = 1;
+static long tree_segment = DEFAULT_SEGMENT_SIZE;
+
+/* Files made along the way go in a directory of their own in the patch
+   directory, with names nothing else can have, so they can't clobber
+   data for a file in the tree, or another make_patch's on this patch.
+   The directory is made before any jobs are started, so the workers
+   share it, and removed by whatever made it.
+ */
+static char temp_dir[PATH_MAX];
+
+/* Make the directory, returning 1 if it was made here, 0 if it was
+   already there, or -1 if it couldn't be made */
+static int open_temp_dir(loki_patch *patch)
 {
-    int in_patch;
+    if ( *temp_dir ) {
+        return(0);
+    }
+    sprintf(temp_dir, "%s/.tmp.XXXXXX", patch->base);
+    if ( (mkdirhier(temp_dir) < 0) || !mkdtemp(temp_dir) ) {
+        logme(LOG_ERROR, "Unable to create %s: %s\n", temp_dir,
+                                                    strerror(errno));
+        *temp_dir = '\0';
+        return(-1);
+    }
+    return(1);
+}
 
-    in_patch = 0;
-    switch (op) {
-        case OP_NONE: {
-            in_patch += is_in_patch(OP_ADD_PATH, dst, patch);
-            in_patch += is_in_patch(OP_ADD_FILE, dst, patch);
-            in_patch += is_in_patch(OP_DEL_PATH, dst, patch);
-            in_patch += is_in_patch(OP_DEL_FILE, dst, patch);
-            in_patch += is_in_patch(OP_PATCH_FILE, dst, patch);
-            in_patch += is_in_patch(OP_SYMLINK_FILE, dst, patch);
-        }
-        break;
+static void close_temp_dir(int opened)
+{
+    if ( opened > 0 ) {
+        rmdir(temp_dir);
+        *temp_dir = '\0';
+    }
+}
 
-        case OP_ADD_PATH: {
-            struct op_add_path *elem;
+/* Pick a name for a temporary file, creating it empty */
+static int temp_file(char *path)
+{
+    int fd;
 
-            for (elem=patch->add_path_list; elem && !in_patch; elem=elem->next){
-                if ( strcmp(elem->dst, dst) == 0 ) {
-                    ++in_patch;
-                }
-            }
-        }
-        break;
-        
-        case OP_ADD_FILE: {
-            struct op_add_file *elem;
+    sprintf(path, "%s/XXXXXX", temp_dir);
+    fd = mkstemp(path);
+    if ( fd < 0 ) {
+        logme(LOG_ERROR, "Unable to create %s: %s\n", path, strerror(errno));
+        return(-1);
+    }
+    close(fd);
+    return(0);
+}
 
-            for (elem=patch->add_file_list; elem && !in_patch; elem=elem->next){
-                if ( strcmp(elem->dst, dst) == 0 ) {
-                    ++in_patch;
-                }
-            }
-        }
-        break;
+/* The xdelta query size for each class of file, by size.  A file is in
+   the last class it's at least the size of, and files smaller than the
+   first class use xdelta's own query size.
+ */
+#define MAX_QUERY_CLASSES   8
+
+struct query_class {
+    long min_size;
+    int size;
+};
+static struct query_class query_classes[MAX_QUERY_CLASSES];
+static int num_query_classes = 0;
+static int query_auto = 0;
+
+/* When tuning, these query sizes are tried on a few of the files in
+   each of these classes, and the fastest one is picked that makes
+   deltas within 1/TUNE_SLACK of the smallest.
+ */
+static const int tune_sizes[] = { 8, 16, 32, 64 };
+static const long tune_classes[] = { 0, 1024*1024, 64*1024*1024 };
+#define NUM_TUNE_SIZES      ((sizeof tune_sizes)/(sizeof tune_sizes[0]))
+#define NUM_TUNE_CLASSES    ((sizeof tune_classes)/(sizeof tune_classes[0]))
+#define TUNE_SAMPLES        4
+#define TUNE_SLACK          20
+
+/* A delta is only kept if it's smaller than the whole new file after
+   compression, counting the old file it's applied to as one byte for
+   every DELTA_READ_COST bytes of it that have to be read */
+#define DELTA_READ_COST     256
+static struct pending_file *pending = NULL;
+static int num_pending = 0;
+static int max_pending = 0;
+
+/* The old trees being patched from, and their files by contents */
+struct old_tree {
+    const char *top;
+    const char *sub;
+    int sampled;
+    struct similar_index *similar;
+};
+static struct old_tree *old_trees = NULL;
+static int num_old_trees = 0;
+
+/* When chaining deltas, an old version of a file is patched to another
+   old version already in the patch, instead of to the new version, so
+   the files seen with each checksum are remembered.
+ */
+#define NUM_VERSION_BUCKETS 4096
 
-        case OP_DEL_PATH: {
-            struct op_del_path *elem;
+static int tree_chain = 0;
+static struct known_version {
+    char sum[CHECKSUM_SIZE+1];
+    char *path;
+    struct known_version *next;
+} *known_versions[NUM_VERSION_BUCKETS];
 
-            for (elem=patch->del_path_list; elem && !in_patch; elem=elem->next){
-                if ( strcmp(elem->dst, dst) == 0 ) {
-                    ++in_patch;
-                }
-            }
+void set_tree_jobs(int jobs)
+{
+    if ( jobs < 1 ) {
+        jobs = 1;
+    }
+    tree_jobs = jobs;
+}
+
+void set_tree_chain(int chain)
+{
+    tree_chain = chain;
+}
+
+void set_tree_segment_size(long size)
+{
+    tree_segment = size;
+}
+
+/* Read a size, which may be in K, M or G */
+static long parse_size(const char *str, char **end)
+{
+    long size;
+
+    size = strtol(str, end, 10);
+    switch (**end) {
+        case 'k':
+        case 'K':
+            size *= 1024;
+            ++*end;
+            break;
+        case 'm':
+        case 'M':
+            size *= 1024*1024;
+            ++*end;
+            break;
+        case 'g':
+        case 'G':
+            size *= 1024*1024*1024;
+            ++*end;
+            break;
+    }
+    return(size);
+}
+
+int set_tree_query_size(const char *spec)
+{
+    struct query_class classes[MAX_QUERY_CLASSES];
+    const char *str;
+    char *end;
+    int count, valid;
+
+    count = 0;
+    valid = 1;
+    for ( str=spec; valid && *str; str=end ) {
+        if ( isspace(*str) || (*str == ',') ) {
+            end = (char *)str+1;
+            continue;
         }
-        break;
-        
-        case OP_DEL_FILE: {
-            struct op_del_file *elem;
+        if ( count == MAX_QUERY_CLASSES ) {
+            valid = 0;
+            break;
+        }
+        classes[count].size = strtol(str, &end, 10);
+        classes[count].min_size = 0;
+        if ( (end != str) && (*end == '@') ) {
+            str = end+1;
+            classes[count].min_size = parse_size(str, &end);
+        }
+        if ( (end == str) ||
+             (*end && !isspace(*end) && (*end != ',')) ||
+             (loki_xdelta_query_size(classes[count].size) < 0) ||
+             (count &&
+              (classes[count].min_size <= classes[count-1].min_size)) ) {
+            valid = 0;
+        }
+        ++count;
+    }
+    if ( ! valid ) {
+        logme(LOG_ERROR, "Invalid query size: %s\n", spec);
+        logme(LOG_ERROR, "Query sizes are powers of two from 2 to 64, e.g. \"16 32@1M 64@64M\"\n");
+        return(-1);
+    }
+    memcpy(query_classes, classes, count * (sizeof *classes));
+    num_query_classes = count;
+    return(0);
+}
 
-            for (elem=patch->del_file_list; elem && !in_patch; elem=elem->next){
-                if ( strcmp(elem->dst, dst) == 0 ) {
-                    ++in_patch;
-                }
-            }
+void set_tree_query_auto(int tune)
+{
+    query_auto = tune;
+}
+
+/* Write the query sizes out the way set_tree_query_size() reads them */
+static void format_query_size(char *spec)
+{
+    long size;
+    int i;
+
+    *spec = '\0';
+    for ( i=0; i<num_query_classes; ++i ) {
+        spec += sprintf(spec, "%s%d", i ? " " : "", query_classes[i].size);
+        size = query_classes[i].min_size;
+        if ( ! size ) {
+            continue;
         }
-        break;
-        
-        case OP_PATCH_FILE: {
-            struct op_patch_file *elem;
+        if ( (size % (1024*1024*1024)) == 0 ) {
+            spec += sprintf(spec, "@%ldG", size / (1024*1024*1024));
+        } else
+        if ( (size % (1024*1024)) == 0 ) {
+            spec += sprintf(spec, "@%ldM", size / (1024*1024));
+        } else
+        if ( (size % 1024) == 0 ) {
+            spec += sprintf(spec, "@%ldK", size / 1024);
+        } else {
+            spec += sprintf(spec, "@%ld", size);
+        }
+    }
+}
 
-            for (elem=patch->patch_file_list; elem&&!in_patch; elem=elem->next){
-                if ( strcmp(elem->dst, dst) == 0 ) {
-                    ++in_patch;
-                }
-            }
+static int query_size_for(long size)
+{
+    int i, query;
+
+    query = 0;
+    for ( i=0; i<num_query_classes; ++i ) {
+        if ( size >= query_classes[i].min_size ) {
+            query = query_classes[i].size;
         }
-        break;
-        
-        case OP_SYMLINK_FILE: {
-            struct op_symlink_file *elem;
+    }
+    return(query);
+}
 
-            for (elem=patch->symlink_file_list;elem&&!in_patch;elem=elem->next){
-                if ( strcmp(elem->dst, dst) == 0 ) {
-                    ++in_patch;
-                }
-            }
+static unsigned int hash_sum(const char *sum)
+{
+    unsigned int hash;
+
+    hash = 5381;
+    while ( *sum ) {
+        hash = ((hash << 5) + hash) + (unsigned char)*sum++;
+    }
+    return(hash % NUM_VERSION_BUCKETS);
+}
+
+static const char *find_version(const char *sum)
+{
+    struct known_version *version;
+
+    for ( version=known_versions[hash_sum(sum)]; version;
+          version=version->next ) {
+        if ( strcmp(version->sum, sum) == 0 ) {
+            return(version->path);
         }
-        break;
     }
-    return in_patch;
+    return(NULL);
 }
 
-int tree_add_file(const char *path, const char *dst, loki_patch *patch)
+static int remember_version(const char *sum, const char *path)
 {
-    struct op_add_file *op;
-    char pat_path[PATH_MAX];
-    struct stat sb;
-    FILE *src_fp;
-    gzFile pat_zfp;
-    int len;
-    char data[4096];
+    struct known_version *version;
+    unsigned int hash;
 
-    /* See if the file is a symbolic link, and add it, if so */
-    if ( lstat(path, &sb) < 0 ) {
-        logme(LOG_ERROR, "Unable to stat %s\n", path);
+    if ( find_version(sum) ) {
+        return(0);
+    }
+    version = (struct known_version *)malloc(sizeof *version);
+    if ( version ) {
+        version->path = strdup(path);
+    }
+    if ( !version || !version->path ) {
+        if ( version ) {
+            free(version);
+        }
+        logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    if ( S_ISLNK(sb.st_mode) ) {
-        int i;
-        char link[PATH_MAX];
-        
-        i = readlink(path, link, sizeof(link)-1);
-        if ( i < 0 ) {
-            logme(LOG_ERROR, "Unable to read symlink %s\n", path);
+    strcpy(version->sum, sum);
+    hash = hash_sum(sum);
+    version->next = known_versions[hash];
+    known_versions[hash] = version;
+    return(0);
+}
+
+static int add_pending(const char *o_path, const char *n_path,
+                       const char *dst, struct op_add_file *add)
+{
+    struct pending_file *file;
+
+    if ( num_pending == max_pending ) {
+        max_pending = max_pending ? max_pending*2 : 256;
+        file = (struct pending_file *)realloc(pending,
+                                              max_pending * (sizeof *file));
+        if ( ! file ) {
+            logme(LOG_ERROR, "Out of memory\n");
             return(-1);
         }
-        link[i] = '\0';
-        return tree_symlink_file(link, dst, patch);
+        pending = file;
     }
+    file = &pending[num_pending++];
+    memset(file, 0, (sizeof *file));
+    if ( o_path ) {
+        file->o_path = strdup(o_path);
+    }
+    file->n_path = strdup(n_path);
+    file->dst = strdup(dst);
+    file->add = add;
+    if ( (num_pending > 1) &&
+         (strcmp(pending[num_pending-2].n_path, n_path) == 0) ) {
+        file->same_new = 1;
+    }
+    return(0);
+}
 
-    logme(LOG_VERBOSE, "-> ADD FILE %s\n", dst);
+/* An added file was removed from the patch before its data was copied */
+static void cancel_pending(struct op_add_file *add)
+{
+    int i;
 
-    /* See if the path is used by any other portion of the patch */
-    remove_path(OP_ADD_FILE, dst, patch);
-    remove_path(OP_SYMLINK_FILE, dst, patch);
-    remove_path(OP_PATCH_FILE, dst, patch);     /* add supercedes patch */
-    if ( is_in_patch(OP_NONE, dst, patch) ) {
-        logme(LOG_ERROR, "Path %s is already in patch\n", dst);
-        return(-1);
+    for ( i=0; i<num_pending; ++i ) {
+        if ( pending[i].add == add ) {
+            pending[i].add = NULL;
+            pending[i].cancelled = 1;
+        }
     }
+}
 
-    /* Allocate memory for the operation */
-    op = (struct op_add_file *)malloc(sizeof *op);
-    if ( ! op ) {
-        logme(LOG_ERROR, "Out of memory\n");
-        return(-1);
-    }
+/* A delta was removed from the patch before it was generated, and no
+   other file shares it */
+static void cancel_delta(struct delta_option *option)
+{
+    int i;
 
-    /* Copy the file to the patch directory */
-    sprintf(pat_path, "%s/%s", patch->base, dst);
-    if ( mkdirhier(pat_path) < 0 ) {
-        free(op);
-        return(-1);
+    for ( i=0; i<num_pending; ++i ) {
+        if ( pending[i].option == option ) {
+            pending[i].option = NULL;
+            pending[i].cancelled = 1;
+        }
     }
+}
+
+/* Copy a new file, compressed, into the patch directory, returning the
+   size of the compressed data.  If a limit is given, this gives up and
+   removes the data as soon as it's larger than that.
+ */
+static long pack_file_data(const char *path, const char *pat_path, long limit)
+{
+    FILE *src_fp;
+    gzFile pat_zfp;
+    struct stat sb;
+    long packed;
+    int len;
+    char data[4096];
+
     src_fp = fopen(path, "rb");
     if ( src_fp == NULL ) {
         logme(LOG_ERROR, "Unable to open %s\n", path);
-        free(op);
         return(-1);
     }
     pat_zfp = gzopen(pat_path, "wb9");
     if ( pat_zfp == NULL ) {
         logme(LOG_ERROR, "Unable to open %s\n", path);
         fclose(src_fp);
-        free(op);
         return(-1);
     }
     while ( (len=fread(data, 1, sizeof(data), src_fp)) > 0 ) {
@@ -348,239 +666,446 @@ int tree_add_file(const char *path, const char *dst, loki_patch *patch)
             logme(LOG_ERROR, "Error writing patch data: %s\n", strerror(errno));
             fclose(src_fp);
             gzclose(pat_zfp);
-            free(op);
             return(-1);
         }
+        if ( limit && ((packed=gzoffset(pat_zfp)) > limit) ) {
+            fclose(src_fp);
+            gzclose(pat_zfp);
+            unlink(pat_path);
+            return(packed);
+        }
     }
     fclose(src_fp);
     if ( gzclose(pat_zfp) != Z_OK ) {
         logme(LOG_ERROR, "Error writing patch data: %s\n", strerror(errno));
     }
+    if ( stat(pat_path, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", pat_path);
+        return(-1);
+    }
+    return(sb.st_size);
+}
 
-    /* Put it all together now */
-    op->dst = strdup(dst);
-    op->src = strdup(dst);
-    op->mode = sb.st_mode;
-    op->size = sb.st_size;
-    md5_compute(path, op->sum, 1);
-    op->next = patch->add_file_list;
-    patch->add_file_list = op;
+static int copy_file_data(const char *path, const char *pat_path)
+{
+    return (pack_file_data(path, pat_path, 0) < 0) ? -1 : 0;
+}
+
+static int checksum_job(int job, void *data, void *result)
+{
+    struct pending_work *work = (struct pending_work *)data;
+    struct pending_file *file = work->files[job];
+    struct pending_sums *sums = (struct pending_sums *)result;
+    struct similar_sketch sketch;
+    struct similar_index *similar;
+    char o_path[PATH_MAX];
+
+    sums->base = -1;
+    *sums->newsum = '\0';
+    if ( file->cancelled ) {
+        return(0);
+    }
+    similar = file->find_base ? old_trees[file->tree].similar : NULL;
+    if ( similar ) {
+        if ( similar_sketch_file(file->n_path, &sketch) == 0 ) {
+            sums->base = similar_find(similar, &sketch);
+        }
+        if ( sums->base >= 0 ) {
+            sprintf(o_path, "%s/%s", old_trees[file->tree].top,
+                                     similar_path(similar, sums->base));
+            md5_cache_compute(o_path, sums->oldsum);
+        }
+    }
+    if ( file->o_path ) {
+        md5_cache_compute(file->o_path, sums->oldsum);
+    }
+    if ( ! file->same_new ) {
+        md5_cache_compute(file->n_path, sums->newsum);
+    }
+    return(0);
+}
 
+static int checksum_done(int job, int status, void *data, void *result)
+{
+    struct pending_work *work = (struct pending_work *)data;
+    struct pending_file *file = work->files[job];
+    struct pending_sums *sums = (struct pending_sums *)result;
+    struct old_tree *tree;
+    char o_path[PATH_MAX];
+
+    if ( status < 0 ) {
+        file->failed = 1;
+    }
+    strcpy(file->oldsum, sums->oldsum);
+    strcpy(file->newsum, sums->newsum);
+
+    /* The delta for a new file is made from the old file most like it */
+    if ( !file->failed && (sums->base >= 0) ) {
+        tree = &old_trees[file->tree];
+        sprintf(o_path, "%s/%s", tree->top,
+                                 similar_path(tree->similar, sums->base));
+        file->from = strdup(similar_path(tree->similar, sums->base));
+        file->o_path = strdup(o_path);
+        if ( !file->from || !file->o_path ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            file->failed = 1;
+        }
+    }
     return(0);
 }
 
-int tree_add_path(const char *path, const char *dst, loki_patch *patch)
+/* The size a delta is classed by, the larger of the two files, or the
+   segment size if they're diffed a segment at a time */
+static long delta_size(struct pending_file *file)
 {
-    int is_toplevel;
-    struct op_add_path *op;
-    char child_path[PATH_MAX];
-    char child_dst[PATH_MAX];
     struct stat sb;
-    DIR *dir;
-    struct dirent *entry;
-
-    /* See if we're adding to the toplevel directory */
-    is_toplevel = (!dst || !*dst || (strcmp(dst, ".") == 0));
+    long size;
 
-    if ( ! is_toplevel ) {
-        logme(LOG_VERBOSE, "-> ADD PATH %s\n", dst);
+    size = 0;
+    if ( (stat(file->o_path, &sb) == 0) && (size < sb.st_size) ) {
+        size = sb.st_size;
+    }
+    if ( (stat(file->n_path, &sb) == 0) && (size < sb.st_size) ) {
+        size = sb.st_size;
+    }
+    if ( file->option && file->option->segment &&
+         (size > file->option->segment) ) {
+        size = file->option->segment;
     }
+    return(size);
+}
 
-    /* See if the path is used by any other portion of the patch */
-    if ( ! is_toplevel ) {
-        remove_path(OP_ADD_PATH, dst, patch);
-        if ( is_in_patch(OP_NONE, dst, patch) ) {
-            logme(LOG_ERROR, "Path %s is already in patch\n", dst);
+static int data_job(int job, void *data, void *result)
+{
+    struct pending_work *work = (struct pending_work *)data;
+    struct pending_file *file = work->files[job];
+    struct pending_data *sizes = (struct pending_data *)result;
+    unsigned int hits, misses, evictions;
+    char whole_path[PATH_MAX];
+    struct stat sb;
+    long limit;
+
+    if ( ! file->o_path ) {
+        return copy_file_data(file->n_path, file->pat_path);
+    }
+    loki_xdelta_query_size(query_size_for(delta_size(file)));
+    if ( file->option && file->option->segment ) {
+        if ( loki_xdelta_segments(file->o_path, file->n_path, file->pat_path,
+                                  file->option->segment) < 0 ) {
+            logme(LOG_ERROR, "Failed delta between %s and %s\n",
+                                                file->o_path, file->n_path);
             return(-1);
         }
+    } else
+    if ( loki_xdelta(file->o_path, file->n_path, file->pat_path) < 0 ) {
+        logme(LOG_ERROR, "Failed delta between %s and %s\n",
+                                            file->o_path, file->n_path);
+        return(-1);
     }
-
-    /* Get the mode information for the path */
-    if ( stat(path, &sb) < 0 ) {
-        logme(LOG_ERROR, "Unable to stat %s\n", path);
-        free(op);
+    loki_xdelta_stats(&hits, &misses, &evictions);
+    logme(LOG_DEBUG, "Delta of %s: %u page hits, %u misses, %u evictions\n",
+                                    file->dst, hits, misses, evictions);
+
+    /* See if the delta pays for itself, compressing the whole file only
+       as far as it takes to find out */
+    if ( stat(file->pat_path, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", file->pat_path);
         return(-1);
     }
-
-    if ( ! is_toplevel ) {
-        /* Allocate memory for the operation */
-        op = (struct op_add_path *)malloc(sizeof *op);
-        if ( ! op ) {
-            logme(LOG_ERROR, "Out of memory\n");
+    sizes->delta = sb.st_size;
+    limit = sizes->delta;
+    if ( stat(file->o_path, &sb) == 0 ) {
+        limit += sb.st_size / DELTA_READ_COST;
+    }
+    if ( temp_file(whole_path) < 0 ) {
+        return(-1);
+    }
+    sizes->whole = pack_file_data(file->n_path, whole_path, limit);
+    if ( sizes->whole < 0 ) {
+        unlink(whole_path);
+        return(-1);
+    }
+    if ( sizes->whole > limit ) {
+        unlink(whole_path);
+    } else {
+        if ( rename(whole_path, file->pat_path) < 0 ) {
+            logme(LOG_ERROR, "Unable to rename %s: %s\n", whole_path,
+                                                        strerror(errno));
+            unlink(whole_path);
             return(-1);
         }
+        sizes->use_whole = 1;
+    }
+    return(0);
+}
 
-        /* Put it all together now */
-        op->dst = strdup(dst);
-        op->mode = sb.st_mode;
-        if ( patch->add_path_list ) {
-            struct op_add_path *here;
-            /* Insert the directory at the end of the list, so that
-               directories are created in the correct order.
-             */
-            for ( here=patch->add_path_list; here->next; here=here->next )
-                ;
-            op->next = here->next;
-            here->next = op;
-        } else {
-            patch->add_path_list = op;
-        }
-        op->next = (struct op_add_path *)0;
+static int data_done(int job, int status, void *data, void *result)
+{
+    struct pending_work *work = (struct pending_work *)data;
+    struct pending_file *file = work->files[job];
+    struct pending_data *sizes = (struct pending_data *)result;
+
+    if ( status < 0 ) {
+        file->failed = 1;
+        return(0);
     }
+    if ( ! file->option ) {
+        return(0);
+    }
+    if ( sizes->use_whole ) {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s stored whole, %ld bytes instead of a %ld byte delta\n",
+                                    file->dst, sizes->whole, sizes->delta);
+        file->option->whole = 1;
+        file->option->segment = 0;
+        payload_set_whole(work->patch, file->option->src);
+    } else {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s delta is %ld bytes, saving at least %ld\n",
+                        file->dst, sizes->delta, sizes->whole - sizes->delta);
+    }
+    return(0);
+}
 
-    /* Now add everything in the path */
-    dir = opendir(path);
-    if ( ! dir ) {
-        logme(LOG_ERROR, "Unable to list %s\n", path);
+static long elapsed_ms(struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return((now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_usec - start->tv_usec) / 1000);
+}
+
+/* Try each query size on a few of the deltas in each class of file, and
+   keep the best in the patch header, for the rest of the deltas and for
+   the next time the patch is added to.  Files diffed a segment at a
+   time are left out, they take too long to diff more than once.
+ */
+static int tune_query_size(struct pending_file **files, int count,
+                           loki_patch *patch)
+{
+    struct query_class classes[NUM_TUNE_CLASSES];
+    char tmp_path[PATH_MAX];
+    char spec[MAX_QUERY_CLASSES*16];
+    long sizes[NUM_TUNE_SIZES];
+    long times[NUM_TUNE_SIZES];
+    struct timeval start;
+    struct stat sb;
+    long size, least;
+    int i, j, c, n, num, best;
+
+    if ( temp_file(tmp_path) < 0 ) {
         return(-1);
     }
-    while ( (entry=readdir(dir)) != NULL ) {
-        /* Skip "." and ".." entries */
-        if ( (strcmp(entry->d_name, ".") == 0) ||
-             (strcmp(entry->d_name, "..") == 0) ) {
+    num = 0;
+    for ( c=0; c<NUM_TUNE_CLASSES; ++c ) {
+        memset(sizes, 0, sizeof(sizes));
+        memset(times, 0, sizeof(times));
+        n = 0;
+        for ( i=0; (i < count) && (n < TUNE_SAMPLES); ++i ) {
+            if ( !files[i]->o_path ||
+                 (files[i]->option && files[i]->option->segment) ) {
+                continue;
+            }
+            size = delta_size(files[i]);
+            if ( (size < tune_classes[c]) ||
+                 ((c+1 < NUM_TUNE_CLASSES) && (size >= tune_classes[c+1])) ) {
+                continue;
+            }
+            for ( j=0; j<NUM_TUNE_SIZES; ++j ) {
+                loki_xdelta_query_size(tune_sizes[j]);
+                gettimeofday(&start, NULL);
+                if ( (loki_xdelta(files[i]->o_path, files[i]->n_path,
+                                  tmp_path) < 0) ||
+                     (stat(tmp_path, &sb) < 0) ) {
+                    logme(LOG_ERROR, "Failed delta between %s and %s\n",
+                                        files[i]->o_path, files[i]->n_path);
+                    unlink(tmp_path);
+                    return(-1);
+                }
+                times[j] += elapsed_ms(&start);
+                sizes[j] += sb.st_size;
+            }
+            ++n;
+        }
+        unlink(tmp_path);
+        if ( ! n ) {
             continue;
         }
 
-        /* Add the child path */
-        sprintf(child_path, "%s/%s", path, entry->d_name);
-        if ( is_toplevel ) {
-            strcpy(child_dst, entry->d_name);
-        } else {
-            sprintf(child_dst, "%s/%s", dst, entry->d_name);
-        }
-        if ( stat(child_path, &sb) < 0 ) {
-            logme(LOG_ERROR, "Unable to stat %s\n", child_path);
-            return(-1);
-        }
-        if ( S_ISDIR(sb.st_mode) ) {
-            if ( tree_add_path(child_path, child_dst, patch) < 0 ) {
-                return(-1);
+        /* Ties go to the larger query size, it uses less memory */
+        least = sizes[0];
+        for ( j=1; j<NUM_TUNE_SIZES; ++j ) {
+            if ( least > sizes[j] ) {
+                least = sizes[j];
             }
-        } else {
-            if ( tree_add_file(child_path, child_dst, patch) < 0 ) {
-                return(-1);
+        }
+        best = -1;
+        for ( j=0; j<NUM_TUNE_SIZES; ++j ) {
+            logme(LOG_VERBOSE,
+                  "Query size %d on %d files from %ld bytes: %ld bytes in %ld ms\n",
+                  tune_sizes[j], n, tune_classes[c], sizes[j], times[j]);
+            if ( (sizes[j] <= (least + least/TUNE_SLACK)) &&
+                 ((best < 0) || (times[j] <= times[best])) ) {
+                best = j;
             }
         }
+        classes[num].min_size = tune_classes[c];
+        classes[num].size = tune_sizes[best];
+        ++num;
+    }
+    query_auto = 0;
+    if ( ! num ) {
+        return(0);
+    }
+    memcpy(query_classes, classes, num * (sizeof *classes));
+    num_query_classes = num;
+    format_query_size(spec);
+    logme(LOG_NORMAL, "Picked query sizes: %s\n", spec);
+    if ( set_optional_field(patch, QUERY_SIZE_FIELD, spec) < 0 ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
     }
-    closedir(dir);
-
-    /* We're finally done */
     return(0);
 }
 
-int tree_patch_file(const char *o_path,
-                    const char *n_path, const char *dst, loki_patch *patch)
+/* Fill in the checksum for an added file, and decide where its data goes */
+static int merge_add_file(struct pending_file *file, loki_patch *patch)
 {
-    struct op_patch_file *op;
-    struct delta_option *option;
-    char oldsum[CHECKSUM_SIZE+1];
-    char newsum[CHECKSUM_SIZE+1];
-    struct stat old_sb, new_sb;
-    struct stat sb;
-    int i;
+    struct op_add_file *op = file->add;
+    const char *src;
+    char name[PATH_MAX];
     char pat_path[PATH_MAX];
+    int i;
 
-    /* See if either of the files are symbolic links */
-    if ( lstat(o_path, &old_sb) < 0 ) {
-        logme(LOG_ERROR, "Unable to stat %s\n", o_path);
-        return(-1);
+    /* See if the same data is already in the patch */
+    src = payload_find(patch, NULL, file->newsum);
+    strcpy(op->sum, file->newsum);
+    if ( src ) {
+        logme(LOG_VERBOSE, "-> ADD FILE %s shares data with %s\n",
+                                                        op->dst, src);
+        op->src = (char *)src;
+        return payload_add(patch, NULL, op->sum, op->src);
     }
-    if ( lstat(n_path, &new_sb) < 0 ) {
-        logme(LOG_ERROR, "Unable to stat %s\n", n_path);
+
+    /* The data goes under the name of the file, unless something else
+       in the patch is still using that */
+    src = op->dst;
+    for ( i=0; payload_refs(patch, src) > 0; ++i ) {
+        sprintf(name, "%s.%d", op->dst, i);
+        src = name;
+    }
+    op->src = patch_strdup(patch, src);
+    if ( ! op->src ) {
+        logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
-    /* New file is symlink, old file is not, then add symlink */
-    if ( S_ISLNK(new_sb.st_mode) && !S_ISLNK(old_sb.st_mode) ) {
-        char link[PATH_MAX];
-        
-        i = readlink(n_path, link, sizeof(link)-1);
-        if ( i < 0 ) {
-            logme(LOG_ERROR, "Unable to read symlink %s\n", n_path);
-            return(-1);
-        }
-        link[i] = '\0';
-        return tree_symlink_file(link, dst, patch);
+    sprintf(pat_path, "%s/%s", patch->base, op->src);
+    if ( mkdirhier(pat_path) < 0 ) {
+        return(-1);
     }
-    /* Old file is symlink, new file is not, then add file */
-    if ( S_ISLNK(old_sb.st_mode) && !S_ISLNK(new_sb.st_mode) ) {
-        return tree_add_file(n_path, dst, patch);
+    file->pat_path = strdup(pat_path);
+    if ( ! file->pat_path ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
     }
-    /* Both files are links, see if they are the same links */
-    if ( S_ISLNK(new_sb.st_mode) && S_ISLNK(old_sb.st_mode) ) {
-        char old_link[PATH_MAX];
-        char new_link[PATH_MAX];
-        
-        i = readlink(o_path, old_link, sizeof(old_link)-1);
-        if ( i < 0 ) {
-            logme(LOG_ERROR, "Unable to read symlink %s\n", o_path);
-            return(-1);
-        }
-        old_link[i] = '\0';
-
-        i = readlink(n_path, new_link, sizeof(new_link)-1);
-        if ( i < 0 ) {
-            logme(LOG_ERROR, "Unable to read symlink %s\n", n_path);
-            return(-1);
-        }
-        new_link[i] = '\0';
+    return payload_add(patch, NULL, op->sum, op->src);
+}
 
-        /* If they are the same, nothing to do, otherwise create new link */
-        if ( strcmp(old_link, new_link) == 0 ) {
-            return(0);
-        }
-        return tree_symlink_file(new_link, dst, patch);
-    }
-    /* Okay, neither file is a symbolic link, continue.. */
+/* Pick a name for a delta for the file, and hold on to it so another
+   delta for this file doesn't pick the same one.  Added files' data
+   isn't copied until later, so a name may be taken without being on
+   disk yet.
+ */
+static int reserve_delta(const char *dst, char *pat_path, loki_patch *patch)
+{
+    struct stat sb;
+    const char *src;
+    int i, fd;
 
-    /* Make sure the files to compare are readable */
-    if ( access(o_path, R_OK) < 0 ) {
-        logme(LOG_ERROR, "Unable to read %s\n", o_path);
+    i = 0;
+    sprintf(pat_path, "%s/%s.%d", patch->base, dst, i);
+    if ( mkdirhier(pat_path) < 0 ) {
         return(-1);
     }
-    if ( access(n_path, R_OK) < 0 ) {
-        logme(LOG_ERROR, "Unable to read %s\n", n_path);
+    src = pat_path + strlen(patch->base) + 1;
+    while ( (stat(pat_path, &sb) == 0) || (payload_refs(patch, src) > 0) ) {
+        sprintf(pat_path, "%s/%s.%d", patch->base, dst, ++i);
+    }
+    fd = open(pat_path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if ( fd < 0 ) {
+        logme(LOG_ERROR, "Unable to create %s\n", pat_path);
         return(-1);
     }
+    close(fd);
+    return(0);
+}
 
-    /* A previous add supercedes a new patch */
-    if ( is_in_patch(OP_ADD_FILE, dst, patch) ) {
-        return(0);
-    }
+/* Add a delta option to the patch for a pair of checksummed files */
+static int merge_patch_file(struct pending_file *file, loki_patch *patch)
+{
+    const char *n_path = file->n_path;
+    const char *dst = file->dst;
+    const char *from = file->from;
+    const char *oldsum = file->oldsum;
+    const char *newsum = file->newsum;
+    struct op_patch_file *op;
+    struct delta_option *option, *chain;
+    struct stat sb;
+    char pat_path[PATH_MAX];
 
-    /* See if we need to generate a delta */
-    md5_compute(o_path, oldsum, 1);
-    md5_compute(n_path, newsum, 1);
-    if ( strcmp(oldsum, newsum) == 0 ) {
-        struct op_patch_file *elem;
+    /* See if we need to generate a delta, a file copied from another
+       one always needs one */
+    if ( !from && (strcmp(oldsum, newsum) == 0) ) {
         /* They are the same file - if there is already a delta for this,
            then it becomes an optional delta, since we may be applying a
            patch to both this file and the other, different, file.
          */
-        for ( elem = patch->patch_file_list; elem; elem = elem->next ) {
-            if ( strcmp(elem->dst, dst) == 0 ) {
-                elem->optional = 1;
-                break;
-            }
+        op = (struct op_patch_file *)index_find(patch, OP_PATCH_FILE, dst);
+        if ( op ) {
+            op->optional = 1;
         }
         return(0);
     }
 
     /* See if we already have this delta in our patch */
-    for ( op = patch->patch_file_list; op; op=op->next ) {
-        if ( strcmp(op->dst, dst) == 0 ) {
-            struct delta_option *here;
-
-            for ( here=op->options; here; here=here->next ) {
-                if ( (strcmp(here->oldsum, oldsum) == 0) &&
-                     (strcmp(here->newsum, newsum) == 0) ) {
-                    /* This delta is already in the patch, oh well.. */
-                    return(0);
-                }
+    op = (struct op_patch_file *)index_find(patch, OP_PATCH_FILE, dst);
+    if ( op ) {
+        struct delta_option *here;
+
+        for ( here=op->options; here; here=here->next ) {
+            if ( (strcmp(here->oldsum, oldsum) == 0) &&
+                 (tree_chain || (strcmp(here->newsum, newsum) == 0)) &&
+                 (here->from ? (from && strcmp(here->from, from) == 0)
+                             : !from) ) {
+                /* This delta is already in the patch, oh well.. */
+                return(0);
+            }
+        }
+    }
+
+    /* Chain this version on to the last one patched in place, if we
+       still have a copy of it */
+    chain = NULL;
+    if ( op && tree_chain && !from ) {
+        struct delta_option *here;
+
+        for ( here=op->options; here; here=here->next ) {
+            if ( !here->from && find_version(here->oldsum) ) {
+                chain = here;
             }
         }
     }
+    if ( !from && (remember_version(oldsum, file->o_path) < 0) ) {
+        return(-1);
+    }
 
-    logme(LOG_VERBOSE, "-> PATCH FILE %s\n", dst);
+    if ( from ) {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s from %s\n", dst, from);
+    } else if ( chain ) {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s via %s\n", dst,
+                                            find_version(chain->oldsum));
+    } else {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s\n", dst);
+    }
 
     /* We can have multiple "PATCH FILE" entries, but no other kind */
     if ( is_in_patch(OP_ADD_PATH, dst, patch) ||
@@ -592,24 +1117,24 @@ int tree_patch_file(const char *o_path,
     }
 
     /* Allocate memory for the operation, if needed */
-    for ( op = patch->patch_file_list; op; op=op->next ) {
-        if ( strcmp(op->dst, dst) == 0 ) {
-            break;
-        }
-    }
+    op = (struct op_patch_file *)index_find(patch, OP_PATCH_FILE, dst);
     if ( ! op ) {
-        op = (struct op_patch_file *)malloc(sizeof *op);
-        if ( ! op ) {
+        op = (struct op_patch_file *)patch_alloc(patch, sizeof *op);
+        if ( op ) {
+            op->dst = patch_strdup(patch, dst);
+        }
+        if ( !op || !op->dst ) {
             logme(LOG_ERROR, "Out of memory\n");
             return(-1);
         }
-        op->dst = strdup(dst);
-        op->options = (struct delta_option *)0;
-        op->mode = 0;
-        op->size = 0;
-        op->optional = 0;
         op->next = patch->patch_file_list;
         patch->patch_file_list = op;
+        if ( ! patch->patch_file_tail ) {
+            patch->patch_file_tail = op;
+        }
+        if ( index_add_path(patch, OP_PATCH_FILE, dst, op) < 0 ) {
+            return(-1);
+        }
     }
 
     /* The patch size is the size of the largest output file */
@@ -622,8 +1147,23 @@ int tree_patch_file(const char *o_path,
     }
     op->mode = sb.st_mode;
 
+    /* A chained delta makes the version it's chained to, and the delta
+       is made against a copy of that instead of the new file */
+    if ( chain ) {
+        newsum = chain->oldsum;
+        free(file->n_path);
+        file->n_path = strdup(find_version(newsum));
+        if ( ! file->n_path ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+        if ( (stat(file->n_path, &sb) == 0) && (op->size < sb.st_size) ) {
+            op->size = sb.st_size;
+        }
+    }
+
     /* Allocate memory for the option */
-    option = (struct delta_option *)malloc(sizeof *option);
+    option = (struct delta_option *)patch_alloc(patch, sizeof *option);
     if ( ! option ) {
         logme(LOG_ERROR, "Out of memory\n");
         return(-1);
@@ -637,335 +1177,1967 @@ int tree_patch_file(const char *o_path,
     } else {
         op->options = option;
     }
-    option->src = (char *)0;
     strcpy(option->oldsum, oldsum);
     strcpy(option->newsum, newsum);
-    option->next = (struct delta_option *)0;
+    if ( from ) {
+        option->from = patch_strdup(patch, from);
+        if ( ! option->from ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+    }
 
-    /* Generate a delta between the two versions */
-    i = 0;
-    sprintf(pat_path, "%s/%s.%d", patch->base, dst, i);
-    if ( mkdirhier(pat_path) < 0 ) {
+    /* The same change may have been made to another file already */
+    option->src = (char *)payload_find(patch, oldsum, newsum);
+    if ( option->src ) {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s shares delta with %s\n",
+                                                        dst, option->src);
+        option->whole = payload_whole(patch, option->src);
+        option->segment = payload_segment(patch, option->src);
+        return payload_add(patch, oldsum, newsum, option->src);
+    }
+
+    /* Files too large to diff at once are diffed a segment at a time */
+    if ( ((stat(file->o_path, &sb) == 0) && (sb.st_size > tree_segment)) ||
+         ((stat(file->n_path, &sb) == 0) && (sb.st_size > tree_segment)) ) {
+        option->segment = tree_segment;
+    }
+
+    /* The delta itself is generated later */
+    if ( reserve_delta(dst, pat_path, patch) < 0 ) {
         return(-1);
     }
-    while ( stat(pat_path, &sb) == 0 ) {
-        sprintf(pat_path, "%s/%s.%d", patch->base, dst, ++i);
+    option->src = patch_strdup(patch, pat_path+strlen(patch->base)+1);
+    file->option = option;
+    file->pat_path = strdup(pat_path);
+    if ( !option->src || !file->pat_path ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
     }
-    if ( loki_xdelta(o_path, n_path, pat_path) < 0 ) {
-        logme(LOG_ERROR, "Failed delta between %s and %s\n", o_path, n_path);
+    if ( payload_add(patch, oldsum, newsum, option->src) < 0 ) {
         return(-1);
     }
-    option->src = strdup(pat_path+strlen(patch->base)+1);
-
-    /* We're done, successful delta */
+    payload_set_segment(patch, option->src, option->segment);
     return(0);
 }
 
-int tree_symlink_file(const char *link, const char *dst, loki_patch *patch)
+/* Put a new ADD FILE operation in the patch, replacing anything else
+   which would create the same file */
+static struct op_add_file *new_add_file(const char *dst, struct stat *sb,
+                                        loki_patch *patch)
 {
-    struct op_symlink_file *op;
+    struct op_add_file *op;
 
-    logme(LOG_VERBOSE, "-> SYMLINK FILE %s -> %s\n", dst, link);
+    logme(LOG_VERBOSE, "-> ADD FILE %s\n", dst);
 
     /* See if the path is used by any other portion of the patch */
     remove_path(OP_ADD_FILE, dst, patch);
     remove_path(OP_SYMLINK_FILE, dst, patch);
+    remove_path(OP_PATCH_FILE, dst, patch);     /* add supercedes patch */
     if ( is_in_patch(OP_NONE, dst, patch) ) {
         logme(LOG_ERROR, "Path %s is already in patch\n", dst);
-        return(-1);
+        return((struct op_add_file *)0);
     }
 
     /* Allocate memory for the operation */
-    op = (struct op_symlink_file *)malloc(sizeof *op);
-    if ( ! op ) {
+    op = (struct op_add_file *)patch_alloc(patch, sizeof *op);
+    if ( op ) {
+        op->dst = patch_strdup(patch, dst);
+        op->src = op->dst;
+    }
+    if ( !op || !op->dst ) {
         logme(LOG_ERROR, "Out of memory\n");
-        return(-1);
+        return((struct op_add_file *)0);
     }
 
-    /* Put it all together now */
-    op->dst = strdup(dst);
-    op->link = strdup(link);
-    op->next = patch->symlink_file_list;
-    patch->symlink_file_list = op;
-
-    return(0);
+    /* Put it all together now, the data and checksum are filled in later */
+    op->mode = sb->st_mode;
+    op->size = sb->st_size;
+    op->next = patch->add_file_list;
+    patch->add_file_list = op;
+    if ( ! patch->add_file_tail ) {
+        patch->add_file_tail = op;
+    }
+    if ( index_add_path(patch, OP_ADD_FILE, dst, op) < 0 ) {
+        return((struct op_add_file *)0);
+    }
+    return(op);
 }
 
-int tree_del_path(const char *dst, loki_patch *patch)
+/* Add a file which is new to the old tree, as a delta from the old file
+   it's most like, or whole if there isn't one */
+static int merge_new_file(struct pending_file *file, loki_patch *patch)
 {
-    struct op_del_path *op;
-    char path[PATH_MAX];
-    int pathlen;
+    struct stat sb;
 
-    logme(LOG_VERBOSE, "-> DEL PATH %s\n", dst);
+    if ( file->from && !is_in_patch(OP_ADD_FILE, file->dst, patch) ) {
+        remove_path(OP_SYMLINK_FILE, file->dst, patch);
+        return merge_patch_file(file, patch);
+    }
+    if ( file->o_path ) {
+        free(file->o_path);
+        file->o_path = NULL;
+    }
+    if ( stat(file->n_path, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", file->n_path);
+        return(-1);
+    }
+    file->add = new_add_file(file->dst, &sb, patch);
+    if ( ! file->add ) {
+        return(-1);
+    }
+    return merge_add_file(file, patch);
+}
 
-    /* Need to make sure that this path isn't part of any of the path */
-    remove_path(OP_DEL_PATH, dst, patch);
-    sprintf(path, "%s/", dst);
-    pathlen = strlen(path);
-    {
-        struct op_add_path *elem;
 
-        for (elem=patch->add_path_list; elem; elem=elem->next){
-            if ( (strcmp(elem->dst, dst) == 0) ||
-                 (strncmp(elem->dst, path, pathlen) == 0) ) {
-                logme(LOG_ERROR,
-"Can't delete path %s, used by ADD PATH %s\n", dst, elem->dst);
-                return(-1);
+/* Do the work on all the files collected so far */
+static int finish_pending(loki_patch *patch)
+{
+    struct pending_work work;
+    struct pending_file *file;
+    struct old_tree *tree;
+    int i, count, temp, retval;
+
+    if ( num_pending == 0 ) {
+        return(0);
+    }
+    work.patch = patch;
+    work.files = (struct pending_file **)malloc(num_pending *
+                                                (sizeof *work.files));
+    if ( ! work.files ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    retval = 0;
+
+    /* Sample the old trees which there are new files to look for in */
+    for ( i=0; i<num_pending; ++i ) {
+        if ( pending[i].find_base ) {
+            tree = &old_trees[pending[i].tree];
+            if ( ! tree->sampled ) {
+                tree->similar = similar_build(tree->top, tree->sub, tree_jobs);
+                tree->sampled = 1;
             }
         }
     }
-    {
-        struct op_add_file *elem;
 
-        for (elem=patch->add_file_list; elem; elem=elem->next){
-            if ( (strcmp(elem->dst, dst) == 0) ||
-                 (strncmp(elem->dst, path, pathlen) == 0) ) {
-                logme(LOG_ERROR,
-"Can't delete path %s, used by ADD FILE %s\n", dst, elem->dst);
-                return(-1);
+    /* First checksum everything */
+    for ( i=0; i<num_pending; ++i ) {
+        work.files[i] = &pending[i];
+    }
+    if ( run_jobs(tree_jobs, num_pending, sizeof(struct pending_sums),
+                  checksum_job, checksum_done, &work) < 0 ) {
+        retval = -1;
+    }
+    for ( i=1; i<num_pending; ++i ) {
+        file = &pending[i];
+        if ( file->same_new && !file->cancelled ) {
+            if ( *pending[i-1].newsum ) {
+                strcpy(file->newsum, pending[i-1].newsum);
+            } else {
+                md5_cache_compute(file->n_path, file->newsum);
             }
         }
     }
-    {
-        struct op_del_file *elem;
 
-        for (elem=patch->del_file_list; elem; elem=elem->next){
-            if ( (strcmp(elem->dst, dst) == 0) ||
-                 (strncmp(elem->dst, path, pathlen) == 0) ) {
-                logme(LOG_ERROR,
-"Can't delete path %s, used by DEL FILE %s\n", dst, elem->dst);
-                return(-1);
+    /* Merge the results into the patch in the order they were found */
+    for ( i=0; i<num_pending; ++i ) {
+        file = &pending[i];
+        if ( file->cancelled || file->failed ) {
+            continue;
+        }
+        if ( file->find_base ) {
+            if ( merge_new_file(file, patch) < 0 ) {
+                file->failed = 1;
+            }
+        } else
+        if ( file->o_path ) {
+            /* The file may have been added whole for another old tree */
+            if ( is_in_patch(OP_ADD_FILE, file->dst, patch) ) {
+                continue;
+            }
+            if ( merge_patch_file(file, patch) < 0 ) {
+                file->failed = 1;
+            }
+        } else {
+            if ( merge_add_file(file, patch) < 0 ) {
+                file->failed = 1;
             }
         }
     }
-    {
-        struct op_patch_file *elem;
 
-        for (elem=patch->patch_file_list; elem; elem=elem->next){
-            if ( (strcmp(elem->dst, dst) == 0) ||
-                 (strncmp(elem->dst, path, pathlen) == 0) ) {
-                logme(LOG_ERROR,
-"Can't delete path %s, used by PATCH FILE %s\n", dst, elem->dst);
-                return(-1);
+    /* Now copy in the new data and generate the deltas that are needed,
+       files that share data with another file have no pat_path */
+    count = 0;
+    for ( i=0; i<num_pending; ++i ) {
+        file = &pending[i];
+        if ( !file->cancelled && !file->failed && file->pat_path ) {
+            work.files[count++] = file;
+        }
+    }
+    temp = open_temp_dir(patch);
+    if ( temp < 0 ) {
+        retval = -1;
+    } else {
+        if ( query_auto && (tune_query_size(work.files, count, patch) < 0) ) {
+            retval = -1;
+        }
+        if ( run_jobs(tree_jobs, count, sizeof(struct pending_data),
+                      data_job, data_done, &work) < 0 ) {
+            retval = -1;
+        }
+        close_temp_dir(temp);
+    }
+
+    /* Deltas stored whole may be shared by other files patched here */
+    for ( i=0; i<count; ++i ) {
+        if ( work.files[i]->option && work.files[i]->option->whole ) {
+            break;
+        }
+    }
+    if ( i < count ) {
+        struct op_patch_file *op;
+        struct delta_option *option;
+
+        for ( op=patch->patch_file_list; op; op=op->next ) {
+            for ( option=op->options; option; option=option->next ) {
+                if ( !option->whole && payload_whole(patch, option->src) ) {
+                    option->whole = 1;
+                    option->segment = 0;
+                }
             }
         }
     }
 
-    /* Allocate memory for the operation */
-    op = (struct op_del_path *)malloc(sizeof *op);
+    /* Clean up, and see if anything went wrong */
+    for ( i=0; i<num_pending; ++i ) {
+        file = &pending[i];
+        if ( file->failed ) {
+            retval = -1;
+        }
+        if ( file->o_path ) {
+            free(file->o_path);
+        }
+        free(file->n_path);
+        free(file->dst);
+        if ( file->from ) {
+            free(file->from);
+        }
+        if ( file->pat_path ) {
+            free(file->pat_path);
+        }
+    }
+    free(work.files);
+    num_pending = 0;
+
+    return(retval);
+}
+
+/* Add a new file, looking for it in the given old tree if there is one */
+static int add_file(const char *path, const char *dst, int tree,
+                    loki_patch *patch)
+{
+    struct op_add_file *op;
+    struct stat sb;
+
+    /* See if the file is a symbolic link, and add it, if so */
+    if ( lstat(path, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", path);
+        return(-1);
+    }
+    if ( S_ISLNK(sb.st_mode) ) {
+        int i;
+        char link[PATH_MAX];
+        
+        i = readlink(path, link, sizeof(link)-1);
+        if ( i < 0 ) {
+            logme(LOG_ERROR, "Unable to read symlink %s\n", path);
+            return(-1);
+        }
+        link[i] = '\0';
+        return tree_symlink_file(link, dst, patch);
+    }
+
+    /* When patching from an old tree, see if the file was there under
+       another name before deciding how to add it */
+    if ( tree >= 0 ) {
+        if ( add_pending(NULL, path, dst, NULL) < 0 ) {
+            return(-1);
+        }
+        pending[num_pending-1].find_base = 1;
+        pending[num_pending-1].tree = tree;
+        return(0);
+    }
+
+    op = new_add_file(dst, &sb, patch);
     if ( ! op ) {
-        logme(LOG_ERROR, "Out of memory\n");
         return(-1);
     }
+    return add_pending(NULL, path, dst, op);
+}
 
-    /* Put it all together now */
-    op->dst = strdup(dst);
-    op->next = patch->del_path_list;
-    patch->del_path_list = op;
+int tree_add_file(const char *path, const char *dst, loki_patch *patch)
+{
+    int retval;
 
-    return(0);
+    retval = add_file(path, dst, -1, patch);
+    if ( finish_pending(patch) < 0 ) {
+        retval = -1;
+    }
+    return(retval);
 }
 
-int tree_del_file(const char *dst, loki_patch *patch)
+/* Put a new ADD PATH operation at the end of the patch */
+static struct op_add_path *new_add_path(const char *dst, long mode,
+                                        loki_patch *patch)
 {
-    struct op_del_file *op;
+    struct op_add_path *op;
 
-    logme(LOG_VERBOSE, "-> DEL FILE %s\n", dst);
+    logme(LOG_VERBOSE, "-> ADD PATH %s\n", dst);
 
     /* See if the path is used by any other portion of the patch */
-    remove_path(OP_DEL_FILE, dst, patch);
+    remove_path(OP_ADD_PATH, dst, patch);
     if ( is_in_patch(OP_NONE, dst, patch) ) {
         logme(LOG_ERROR, "Path %s is already in patch\n", dst);
-        return(-1);
+        return((struct op_add_path *)0);
     }
 
     /* Allocate memory for the operation */
-    op = (struct op_del_file *)malloc(sizeof *op);
-    if ( ! op ) {
+    op = (struct op_add_path *)patch_alloc(patch, sizeof *op);
+    if ( op ) {
+        op->dst = patch_strdup(patch, dst);
+    }
+    if ( !op || !op->dst ) {
         logme(LOG_ERROR, "Out of memory\n");
-        return(-1);
+        return((struct op_add_path *)0);
     }
 
     /* Put it all together now */
-    op->dst = strdup(dst);
-    op->next = patch->del_file_list;
-    patch->del_file_list = op;
-
-    return(0);
+    op->mode = mode;
+    /* Insert the directory at the end of the list, so that
+       directories are created in the correct order.
+     */
+    if ( patch->add_path_tail ) {
+        patch->add_path_tail->next = op;
+    } else {
+        patch->add_path_list = op;
+    }
+    patch->add_path_tail = op;
+    if ( index_add_path(patch, OP_ADD_PATH, dst, op) < 0 ) {
+        return((struct op_add_path *)0);
+    }
+    return(op);
 }
 
-/* Create a recursive patch between the two trees of files */
-int tree_patch(const char *o_top, const char *o_path,
-               const char *n_top, const char *n_path, loki_patch *patch)
+static int add_path(const char *path, const char *dst, loki_patch *patch)
 {
-    DIR *old, *new;
+    int is_toplevel;
+    char child_path[PATH_MAX];
+    char child_dst[PATH_MAX];
+    struct stat sb;
+    DIR *dir;
     struct dirent *entry;
-    char path[PATH_MAX];
-    char old_path[PATH_MAX];
-    char new_path[PATH_MAX];
-    struct stat old_sb, new_sb;
-    int status;
 
-    /* No errors yet */
-    status = 0;
+    /* See if we're adding to the toplevel directory */
+    is_toplevel = (!dst || !*dst || (strcmp(dst, ".") == 0));
 
-    /* If both paths are the same, then there's nothing to do */
-    sprintf(old_path, "%s/%s", o_top, o_path);
-    sprintf(new_path, "%s/%s", n_top, n_path);
-    if ( strcmp(old_path, new_path) == 0 ) {
-        return(0);
+    /* Get the mode information for the path */
+    if ( stat(path, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", path);
+        return(-1);
     }
-    
-    /* First get all the files that are in the old path */
-    sprintf(path, "%s/%s", o_top, o_path);
-    old = opendir(path);
-    if ( ! old ) {
-        logme(LOG_ERROR, "Unable to open directory: %s\n", path);
+    if ( !is_toplevel && !new_add_path(dst, sb.st_mode, patch) ) {
+        return(-1);
+    }
+
+    /* Now add everything in the path */
+    dir = opendir(path);
+    if ( ! dir ) {
+        logme(LOG_ERROR, "Unable to list %s\n", path);
         return(-1);
     }
-    while ( (entry=readdir(old)) != NULL ) {
+    while ( (entry=readdir(dir)) != NULL ) {
         /* Skip "." and ".." entries */
         if ( (strcmp(entry->d_name, ".") == 0) ||
              (strcmp(entry->d_name, "..") == 0) ) {
             continue;
         }
 
-        /* Make sure we can see the old path */
-        sprintf(old_path, "%s/%s/%s", o_top, o_path, entry->d_name);
-        if ( lstat(old_path, &old_sb) < 0 ) {
-            logme(LOG_ERROR, "Unable to stat path: %s\n", old_path);
-            --status;
-            continue;
-        }
-
-        /* See if the new entry doesn't exist, and we have to remove it */
-        sprintf(new_path, "%s/%s/%s", n_top, n_path, entry->d_name);
-        if ( lstat(new_path, &new_sb) < 0 ) {
-            /* This is an obsolete entry */
-            if ( S_ISDIR(old_sb.st_mode) ) {
-                if ( tree_del_path(old_path+strlen(o_top)+2, patch) < 0 ) {
-                    --status;
-                }
-            } else {
-                if ( tree_del_file(old_path+strlen(o_top)+2, patch) < 0 ) {
-                    --status;
-                }
-            }
-            continue;
+        /* Add the child path */
+        sprintf(child_path, "%s/%s", path, entry->d_name);
+        if ( is_toplevel ) {
+            strcpy(child_dst, entry->d_name);
+        } else {
+            sprintf(child_dst, "%s/%s", dst, entry->d_name);
         }
-
-        /* If they both exist, but are not the same type of file.. */
-        if ( S_ISDIR(old_sb.st_mode) != S_ISDIR(new_sb.st_mode) ) {
-            logme(LOG_ERROR, "%s is a %s and %s is a %s\n",
-                    old_path, S_ISDIR(old_sb.st_mode) ? "directory" : "file",
-                    new_path, S_ISDIR(new_sb.st_mode) ? "directory" : "file");
-            --status;
-            continue;
+        if ( stat(child_path, &sb) < 0 ) {
+            logme(LOG_ERROR, "Unable to stat %s\n", child_path);
+            return(-1);
         }
-
-        if ( S_ISDIR(old_sb.st_mode) ) {
-            /* They're both directories, recurse */
-            if ( tree_patch(o_top, old_path+strlen(o_top)+1,
-                            n_top, new_path+strlen(n_top)+1, patch) < 0 ) {
-                --status;
+        if ( S_ISDIR(sb.st_mode) ) {
+            if ( add_path(child_path, child_dst, patch) < 0 ) {
+                return(-1);
             }
         } else {
-            /* They're both files, patch old to new */
-            if ( tree_patch_file(old_path, new_path,
-                                new_path+strlen(n_top)+2, patch) < 0 ) {
-                --status;
+            if ( add_file(child_path, child_dst, -1, patch) < 0 ) {
+                return(-1);
             }
         }
     }
-    closedir(old);
+    closedir(dir);
 
-    /* Now go through and add new files and directories */
-    sprintf(path, "%s/%s", n_top, n_path);
-    new = opendir(path);
-    if ( ! new ) {
-        logme(LOG_ERROR, "Unable to open directory: %s\n", path);
-        return(-1);
-    }
-    while ( (entry=readdir(new)) != NULL ) {
-        /* Skip "." and ".." entries */
-        if ( (strcmp(entry->d_name, ".") == 0) ||
-             (strcmp(entry->d_name, "..") == 0) ) {
-            continue;
-        }
+    /* We're finally done */
+    return(0);
+}
 
-        /* Make sure we can see the new path */
-        sprintf(new_path, "%s/%s/%s", n_top, n_path, entry->d_name);
-        if ( lstat(new_path, &new_sb) < 0 ) {
-            logme(LOG_ERROR, "Unable to stat path: %s\n", new_path);
-            --status;
-            continue;
-        }
+int tree_add_path(const char *path, const char *dst, loki_patch *patch)
+{
+    int retval;
 
-        /* See if we can see the old path.  If so, handled above. */
-        sprintf(old_path, "%s/%s/%s", o_top, o_path, entry->d_name);
-        if ( lstat(old_path, &old_sb) < 0 ) {
-            /* This is a new entry of some kind */
-            if ( S_ISDIR(new_sb.st_mode) ) {
-                if (tree_add_path(new_path,new_path+strlen(n_top)+2,patch) < 0){
-                    --status;
-                }
-            } else {
-                if (tree_add_file(new_path,new_path+strlen(n_top)+2,patch) < 0){
-                    --status;
-                }
-            }
-        }
+    retval = add_path(path, dst, patch);
+    if ( finish_pending(patch) < 0 ) {
+        retval = -1;
     }
-    closedir(new);
-
-    /* We're done! */
-    return(status);
+    return(retval);
 }
 
-/* Add a set of files and directories from a UNIX tar file
-   This is an easy hack - just extract the directory and add it
- */
-int tree_tarfile(const char *tarfile, loki_patch *patch)
+/* The types of the files are the S_IFMT bits of their modes, if they're
+   already known from a directory listing, or 0 to look them up */
+static int patch_file(const char *o_path, const char *n_path,
+                      mode_t o_type, mode_t n_type, const char *dst, int tree,
+                      loki_patch *patch)
 {
-    static const char gzip_magic[2] = { 0037, 0213 };
-    FILE *fp;
-    char magic[2];
-    int is_compressed;
-    char tmppath[PATH_MAX];
-    char command[4*PATH_MAX];
-    int retval;
+    struct stat old_sb, new_sb;
+    int i;
 
-    /* Make sure we can read the tarfile */
-    fp = fopen(tarfile, "rb");
-    if ( ! fp ) {
-        logme(LOG_ERROR, "Unable to read %s\n", tarfile);
+    /* See if either of the files are symbolic links */
+    if ( o_type ) {
+        old_sb.st_mode = o_type;
+    } else
+    if ( lstat(o_path, &old_sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", o_path);
         return(-1);
     }
-    if ( fread(magic, sizeof(magic), 1, fp) &&
-         (memcmp(magic, gzip_magic, sizeof(magic)) == 0) ) {
-        is_compressed = 1;
-    } else {
-        is_compressed = 0;
+    if ( n_type ) {
+        new_sb.st_mode = n_type;
+    } else
+    if ( lstat(n_path, &new_sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", n_path);
+        return(-1);
+    }
+    /* New file is symlink, old file is not, then add symlink */
+    if ( S_ISLNK(new_sb.st_mode) && !S_ISLNK(old_sb.st_mode) ) {
+        char link[PATH_MAX];
+        
+        i = readlink(n_path, link, sizeof(link)-1);
+        if ( i < 0 ) {
+            logme(LOG_ERROR, "Unable to read symlink %s\n", n_path);
+            return(-1);
+        }
+        link[i] = '\0';
+        return tree_symlink_file(link, dst, patch);
+    }
+    /* Old file is symlink, new file is not, then add file */
+    if ( S_ISLNK(old_sb.st_mode) && !S_ISLNK(new_sb.st_mode) ) {
+        return add_file(n_path, dst, tree, patch);
+    }
+    /* Both files are links, see if they are the same links */
+    if ( S_ISLNK(new_sb.st_mode) && S_ISLNK(old_sb.st_mode) ) {
+        char old_link[PATH_MAX];
+        char new_link[PATH_MAX];
+        
+        i = readlink(o_path, old_link, sizeof(old_link)-1);
+        if ( i < 0 ) {
+            logme(LOG_ERROR, "Unable to read symlink %s\n", o_path);
+            return(-1);
+        }
+        old_link[i] = '\0';
+
+        i = readlink(n_path, new_link, sizeof(new_link)-1);
+        if ( i < 0 ) {
+            logme(LOG_ERROR, "Unable to read symlink %s\n", n_path);
+            return(-1);
+        }
+        new_link[i] = '\0';
+
+        /* If they are the same, nothing to do, otherwise create new link */
+        if ( strcmp(old_link, new_link) == 0 ) {
+            return(0);
+        }
+        return tree_symlink_file(new_link, dst, patch);
     }
-    fclose(fp);
+    /* Okay, neither file is a symbolic link, continue.. */
 
-    /* Extract the tarfile to the temporary directory */
-    sprintf(tmppath, "%s/../tmp", patch->base);
-    sprintf(command, "rm -rf %s", tmppath);
-    system(command);
-    sprintf(command, "mkdir %s", tmppath);
-    if ( system(command) != 0 ) {
+    /* Make sure the files to compare are readable */
+    if ( access(o_path, R_OK) < 0 ) {
+        logme(LOG_ERROR, "Unable to read %s\n", o_path);
+        return(-1);
+    }
+    if ( access(n_path, R_OK) < 0 ) {
+        logme(LOG_ERROR, "Unable to read %s\n", n_path);
         return(-1);
     }
-    sprintf(command, "tar %sxpf %s -C %s", is_compressed ? "z" : "",
-                                           tarfile, tmppath);
-    if ( system(command) == 0 ) {
-        /* Add the contents of the temporary directory */
-        retval = tree_add_path(tmppath, NULL, patch);
+
+    /* A previous add supercedes a new patch */
+    if ( is_in_patch(OP_ADD_FILE, dst, patch) ) {
+        return(0);
     }
-    sprintf(command, "rm -rf %s", tmppath);
-    system(command);
 
+    /* The checksums and delta are worked out later */
+    return add_pending(o_path, n_path, dst, NULL);
+}
+
+int tree_patch_file(const char *o_path,
+                    const char *n_path, const char *dst, loki_patch *patch)
+{
+    int retval;
+
+    retval = patch_file(o_path, n_path, 0, 0, dst, -1, patch);
+    if ( finish_pending(patch) < 0 ) {
+        retval = -1;
+    }
     return(retval);
 }
+
+int tree_symlink_file(const char *link, const char *dst, loki_patch *patch)
+{
+    struct op_symlink_file *op;
+
+    logme(LOG_VERBOSE, "-> SYMLINK FILE %s -> %s\n", dst, link);
+
+    /* See if the path is used by any other portion of the patch */
+    remove_path(OP_ADD_FILE, dst, patch);
+    remove_path(OP_SYMLINK_FILE, dst, patch);
+    if ( is_in_patch(OP_NONE, dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is already in patch\n", dst);
+        return(-1);
+    }
+
+    /* Allocate memory for the operation */
+    op = (struct op_symlink_file *)patch_alloc(patch, sizeof *op);
+    if ( op ) {
+        op->dst = patch_strdup(patch, dst);
+        op->link = patch_strdup(patch, link);
+    }
+    if ( !op || !op->dst || !op->link ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+
+    /* Put it all together now */
+    op->next = patch->symlink_file_list;
+    patch->symlink_file_list = op;
+    if ( ! patch->symlink_file_tail ) {
+        patch->symlink_file_tail = op;
+    }
+
+    return index_add_path(patch, OP_SYMLINK_FILE, dst, op);
+}
+
+int tree_del_path(const char *dst, loki_patch *patch)
+{
+    struct op_del_path *op;
+    char path[PATH_MAX];
+    int pathlen;
+
+    logme(LOG_VERBOSE, "-> DEL PATH %s\n", dst);
+
+    /* Need to make sure that this path isn't part of any of the path,
+       the lists are only searched to name the operation that uses it.
+     */
+    remove_path(OP_DEL_PATH, dst, patch);
+    sprintf(path, "%s/", dst);
+    pathlen = strlen(path);
+    if ( index_count_tree(patch, OP_ADD_PATH, dst) ) {
+        struct op_add_path *elem;
+
+        for (elem=patch->add_path_list; elem; elem=elem->next){
+            if ( (strcmp(elem->dst, dst) == 0) ||
+                 (strncmp(elem->dst, path, pathlen) == 0) ) {
+                logme(LOG_ERROR,
+"Can't delete path %s, used by ADD PATH %s\n", dst, elem->dst);
+                return(-1);
+            }
+        }
+    }
+    if ( index_count_tree(patch, OP_ADD_FILE, dst) ) {
+        struct op_add_file *elem;
+
+        for (elem=patch->add_file_list; elem; elem=elem->next){
+            if ( (strcmp(elem->dst, dst) == 0) ||
+                 (strncmp(elem->dst, path, pathlen) == 0) ) {
+                logme(LOG_ERROR,
+"Can't delete path %s, used by ADD FILE %s\n", dst, elem->dst);
+                return(-1);
+            }
+        }
+    }
+    if ( index_count_tree(patch, OP_DEL_FILE, dst) ) {
+        struct op_del_file *elem;
+
+        for (elem=patch->del_file_list; elem; elem=elem->next){
+            if ( (strcmp(elem->dst, dst) == 0) ||
+                 (strncmp(elem->dst, path, pathlen) == 0) ) {
+                logme(LOG_ERROR,
+"Can't delete path %s, used by DEL FILE %s\n", dst, elem->dst);
+                return(-1);
+            }
+        }
+    }
+    if ( index_count_tree(patch, OP_PATCH_FILE, dst) ) {
+        struct op_patch_file *elem;
+
+        for (elem=patch->patch_file_list; elem; elem=elem->next){
+            if ( (strcmp(elem->dst, dst) == 0) ||
+                 (strncmp(elem->dst, path, pathlen) == 0) ) {
+                logme(LOG_ERROR,
+"Can't delete path %s, used by PATCH FILE %s\n", dst, elem->dst);
+                return(-1);
+            }
+        }
+    }
+
+    /* Allocate memory for the operation */
+    op = (struct op_del_path *)patch_alloc(patch, sizeof *op);
+    if ( op ) {
+        op->dst = patch_strdup(patch, dst);
+    }
+    if ( !op || !op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+
+    /* Put it all together now */
+    op->next = patch->del_path_list;
+    patch->del_path_list = op;
+    if ( ! patch->del_path_tail ) {
+        patch->del_path_tail = op;
+    }
+
+    return index_add_path(patch, OP_DEL_PATH, dst, op);
+}
+
+int tree_del_file(const char *dst, loki_patch *patch)
+{
+    struct op_del_file *op;
+
+    logme(LOG_VERBOSE, "-> DEL FILE %s\n", dst);
+
+    /* See if the path is used by any other portion of the patch */
+    remove_path(OP_DEL_FILE, dst, patch);
+    if ( is_in_patch(OP_NONE, dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is already in patch\n", dst);
+        return(-1);
+    }
+
+    /* Allocate memory for the operation */
+    op = (struct op_del_file *)patch_alloc(patch, sizeof *op);
+    if ( op ) {
+        op->dst = patch_strdup(patch, dst);
+    }
+    if ( !op || !op->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+
+    /* Put it all together now */
+    op->next = patch->del_file_list;
+    patch->del_file_list = op;
+    if ( ! patch->del_file_tail ) {
+        patch->del_file_tail = op;
+    }
+
+    return index_add_path(patch, OP_DEL_FILE, dst, op);
+}
+
+/* How a directory being walked stands in each old tree */
+#define TREE_SKIP   0           /* The old tree isn't being looked at */
+#define TREE_HAS    1           /* The old tree has the directory */
+#define TREE_NEW    2           /* The directory is new to the old tree */
+
+/* What each old tree has under the name of an entry in the new tree */
+#define OLD_NONE    0
+#define OLD_FILE    1
+#define OLD_LINK    2
+#define OLD_DIR     3
+#define OLD_OTHER   4           /* A file in one and a directory in the other */
+
+/* The entries of a directory, sorted by name.  The type of each entry is
+   taken from the directory listing where the filesystem gives it, so that
+   listing a directory doesn't take a stat() of every entry in it.
+ */
+struct dir_item {
+    const char *name;
+    mode_t type;                /* The S_IFMT bits of the mode */
+};
+
+struct dir_list {
+    char *names;                /* All the names, one after another */
+    struct dir_item *items;
+    int count;
+};
+
+static int compare_items(const void *a, const void *b)
+{
+    return strcmp(((const struct dir_item *)a)->name,
+                  ((const struct dir_item *)b)->name);
+}
+
+static void free_dir_list(struct dir_list *list)
+{
+    free(list->names);
+    free(list->items);
+    memset(list, 0, (sizeof *list));
+}
+
+/* Put a name under a directory, either of which may be empty */
+static void join_path(char *path, const char *dir, const char *name)
+{
+    if ( ! *name ) {
+        strcpy(path, dir);
+    } else
+    if ( ! *dir ) {
+        strcpy(path, name);
+    } else {
+        sprintf(path, "%s/%s", dir, name);
+    }
+}
+
+/* List a directory, sorted by name */
+static int read_dir(const char *dir, struct dir_list *list, int *status)
+{
+    DIR *dp;
+    struct dirent *entry;
+    struct stat sb;
+    struct dir_item *items;
+    char *names, *name;
+    size_t len, used, size;
+    mode_t type;
+    int i, max;
+
+    memset(list, 0, (sizeof *list));
+    dp = opendir(dir);
+    if ( ! dp ) {
+        logme(LOG_ERROR, "Unable to open directory: %s\n", dir);
+        return(-1);
+    }
+    used = 0;
+    size = 0;
+    max = 0;
+    while ( (entry=readdir(dp)) != NULL ) {
+        /* Skip "." and ".." entries */
+        if ( (strcmp(entry->d_name, ".") == 0) ||
+             (strcmp(entry->d_name, "..") == 0) ) {
+            continue;
+        }
+
+        /* Not every filesystem fills in the type of the entry */
+        if ( entry->d_type != DT_UNKNOWN ) {
+            type = DTTOIF(entry->d_type);
+        } else
+        if ( fstatat(dirfd(dp), entry->d_name, &sb,
+                     AT_SYMLINK_NOFOLLOW) == 0 ) {
+            type = (sb.st_mode & S_IFMT);
+        } else {
+            logme(LOG_ERROR, "Unable to stat path: %s/%s\n",
+                                                    dir, entry->d_name);
+            --*status;
+            continue;
+        }
+
+        len = strlen(entry->d_name)+1;
+        if ( (used + len) > size ) {
+            size = size ? size*2 : 4096;
+            if ( size < (used + len) ) {
+                size = used + len;
+            }
+            names = (char *)realloc(list->names, size);
+            if ( ! names ) {
+                break;
+            }
+            list->names = names;
+        }
+        if ( list->count == max ) {
+            max = max ? max*2 : 64;
+            items = (struct dir_item *)realloc(list->items,
+                                               max * (sizeof *items));
+            if ( ! items ) {
+                break;
+            }
+            list->items = items;
+        }
+        memcpy(list->names + used, entry->d_name, len);
+        list->items[list->count].type = type;
+        used += len;
+        ++list->count;
+    }
+    closedir(dp);
+    if ( entry ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_dir_list(list);
+        return(-1);
+    }
+
+    /* The names are in the order they were read, now that they've
+       stopped moving, point at them and sort them */
+    name = list->names;
+    for ( i=0; i<list->count; ++i ) {
+        list->items[i].name = name;
+        name += strlen(name)+1;
+    }
+    qsort(list->items, list->count, sizeof *list->items, compare_items);
+    return(list->count);
+}
+
+static const char *type_name(mode_t type)
+{
+    return(S_ISDIR(type) ? "directory" : "file");
+}
+
+/* Walk a directory of the new tree and the same directory of each of
+   the old trees together, collecting the differences.  The new tree is
+   only listed once, however many old trees there are, and each sorted
+   old listing is merged against it in a single pass, so that each new
+   file is visited once with what each old tree has in its place.
+ */
+static int patch_trees(const char *n_top, const char *rel,
+                       const char *in_tree, loki_patch *patch)
+{
+    char new_dir[PATH_MAX];
+    char old_dir[PATH_MAX];
+    struct dir_list new_list, old_list;
+    struct dir_item *n_item, *o_item;
+    char path[PATH_MAX];
+    char old_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    char dst[PATH_MAX];
+    char *old, *child_in;
+    struct stat sb;
+    int i, j, k, cmp, is_new, status;
+
+    /* No errors yet */
+    status = 0;
+
+    /* First get all the files that are in the new path */
+    join_path(new_dir, n_top, rel);
+    if ( read_dir(new_dir, &new_list, &status) < 0 ) {
+        return(-1);
+    }
+
+    /* What each old tree has for each new entry, then room to note how
+       each old tree stands in a subdirectory */
+    old = (char *)calloc(new_list.count+1, num_old_trees);
+    if ( ! old ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        free_dir_list(&new_list);
+        return(-1);
+    }
+    child_in = old + (new_list.count * num_old_trees);
+
+    /* See what's in each of the old trees, removing what's not in the
+       new one */
+    for ( k=0; k<num_old_trees; ++k ) {
+        if ( in_tree[k] != TREE_HAS ) {
+            continue;
+        }
+        join_path(path, old_trees[k].top, old_trees[k].sub);
+        join_path(old_dir, path, rel);
+        if ( read_dir(old_dir, &old_list, &status) < 0 ) {
+            --status;
+            continue;
+        }
+        i = 0;
+        j = 0;
+        while ( j < old_list.count ) {
+            o_item = &old_list.items[j];
+            if ( i < new_list.count ) {
+                n_item = &new_list.items[i];
+                cmp = strcmp(n_item->name, o_item->name);
+            } else {
+                n_item = NULL;
+                cmp = 1;
+            }
+
+            /* Only in the new tree, nothing to compare it with */
+            if ( cmp < 0 ) {
+                ++i;
+                continue;
+            }
+
+            /* Only in the old tree, an obsolete entry to remove */
+            if ( cmp > 0 ) {
+                join_path(dst, rel, o_item->name);
+                if ( S_ISDIR(o_item->type) ) {
+                    if ( tree_del_path(dst, patch) < 0 ) {
+                        --status;
+                    }
+                } else {
+                    if ( tree_del_file(dst, patch) < 0 ) {
+                        --status;
+                    }
+                }
+                ++j;
+                continue;
+            }
+
+            /* If they both exist, but are not the same type of file.. */
+            if ( S_ISDIR(o_item->type) != S_ISDIR(n_item->type) ) {
+                sprintf(old_path, "%s/%s", old_dir, o_item->name);
+                sprintf(new_path, "%s/%s", new_dir, n_item->name);
+                logme(LOG_ERROR, "%s is a %s and %s is a %s\n",
+                      old_path, type_name(o_item->type),
+                      new_path, type_name(n_item->type));
+                old[i*num_old_trees + k] = OLD_OTHER;
+                --status;
+            } else
+            if ( S_ISDIR(o_item->type) ) {
+                old[i*num_old_trees + k] = OLD_DIR;
+            } else
+            if ( S_ISLNK(o_item->type) ) {
+                old[i*num_old_trees + k] = OLD_LINK;
+            } else {
+                old[i*num_old_trees + k] = OLD_FILE;
+            }
+            ++i;
+            ++j;
+        }
+        free_dir_list(&old_list);
+    }
+
+    /* Now go through the new files and directories */
+    for ( i=0; i<new_list.count; ++i ) {
+        n_item = &new_list.items[i];
+        sprintf(new_path, "%s/%s", new_dir, n_item->name);
+        join_path(dst, rel, n_item->name);
+
+        if ( S_ISDIR(n_item->type) ) {
+            /* Recurse, noting the old trees the directory is new to */
+            is_new = 0;
+            for ( k=0; k<num_old_trees; ++k ) {
+                child_in[k] = TREE_SKIP;
+                if ( in_tree[k] == TREE_NEW ) {
+                    child_in[k] = TREE_NEW;
+                    is_new = 1;
+                } else
+                if ( in_tree[k] == TREE_HAS ) {
+                    if ( old[i*num_old_trees + k] == OLD_DIR ) {
+                        child_in[k] = TREE_HAS;
+                    } else
+                    if ( old[i*num_old_trees + k] == OLD_NONE ) {
+                        child_in[k] = TREE_NEW;
+                        is_new = 1;
+                    }
+                }
+            }
+            if ( is_new ) {
+                if ( stat(new_path, &sb) < 0 ) {
+                    logme(LOG_ERROR, "Unable to stat %s\n", new_path);
+                    --status;
+                    continue;
+                }
+                if ( ! new_add_path(dst, sb.st_mode, patch) ) {
+                    --status;
+                    continue;
+                }
+            }
+            if ( patch_trees(n_top, dst, child_in, patch) < 0 ) {
+                --status;
+            }
+            continue;
+        }
+
+        /* A file, patched from each old tree that has it, and added for
+           each that doesn't */
+        for ( k=0; k<num_old_trees; ++k ) {
+            if ( in_tree[k] == TREE_SKIP ) {
+                continue;
+            }
+            switch (old[i*num_old_trees + k]) {
+                case OLD_NONE:
+                    if ( add_file(new_path, dst, k, patch) < 0 ) {
+                        --status;
+                    }
+                    break;
+                case OLD_FILE:
+                case OLD_LINK:
+                    join_path(path, old_trees[k].top, old_trees[k].sub);
+                    join_path(old_dir, path, rel);
+                    sprintf(old_path, "%s/%s", old_dir, n_item->name);
+                    if ( patch_file(old_path, new_path,
+                            (old[i*num_old_trees + k] == OLD_LINK) ?
+                                                        S_IFLNK : S_IFREG,
+                            n_item->type, dst, k, patch) < 0 ) {
+                        --status;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    free(old);
+    free_dir_list(&new_list);
+
+    /* We're done! */
+    return(status);
+}
+
+/* Create a recursive patch from each of the old trees to the new one */
+static int patch_versions(struct old_tree *trees, int count,
+                          const char *n_top, const char *n_path,
+                          loki_patch *patch)
+{
+    char old_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    char *in_tree;
+    int i, status;
+
+    in_tree = (char *)malloc(count);
+    if ( ! in_tree ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+
+    /* If an old path is the same as the new one, there's nothing to do */
+    join_path(new_path, n_top, n_path);
+    for ( i=0; i<count; ++i ) {
+        join_path(old_path, trees[i].top, trees[i].sub);
+        in_tree[i] = (strcmp(old_path, new_path) == 0) ? TREE_SKIP : TREE_HAS;
+    }
+    old_trees = trees;
+    num_old_trees = count;
+    status = patch_trees(new_path, "", in_tree, patch);
+    if ( finish_pending(patch) < 0 ) {
+        --status;
+    }
+    for ( i=0; i<count; ++i ) {
+        free_similar_index(trees[i].similar);
+        trees[i].similar = NULL;
+        trees[i].sampled = 0;
+    }
+    old_trees = NULL;
+    num_old_trees = 0;
+    free(in_tree);
+    return(status);
+}
+
+int tree_patch(const char *o_top, const char *o_path,
+               const char *n_top, const char *n_path, loki_patch *patch)
+{
+    struct old_tree tree;
+
+    memset(&tree, 0, (sizeof tree));
+    tree.top = o_top;
+    tree.sub = o_path;
+    return patch_versions(&tree, 1, n_top, n_path, patch);
+}
+
+int tree_patch_versions(const char *o_tops[], int count,
+                        const char *n_top, loki_patch *patch)
+{
+    struct old_tree *trees;
+    int i, status;
+
+    trees = (struct old_tree *)calloc(count, sizeof *trees);
+    if ( ! trees ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    for ( i=0; i<count; ++i ) {
+        trees[i].top = o_tops[i];
+        trees[i].sub = "";
+    }
+    status = patch_versions(trees, count, n_top, "", patch);
+    free(trees);
+    return(status);
+}
+
+/* Make the name of a tar entry relative to the top of the tree, returning
+   0 if there's nothing left of it, or -1 if it would leave the tree */
+static int tar_entry_path(const char *name, char *dst)
+{
+    const char *part;
+    int len;
+
+    *dst = '\0';
+    while ( *name ) {
+        /* Pick out the next component of the name */
+        while ( *name == '/' ) {
+            ++name;
+        }
+        part = name;
+        while ( *name && (*name != '/') ) {
+            ++name;
+        }
+        len = name - part;
+        if ( (len == 0) || ((len == 1) && (*part == '.')) ) {
+            continue;
+        }
+        if ( (len == 2) && (strncmp(part, "..", 2) == 0) ) {
+            return(-1);
+        }
+        if ( *dst ) {
+            strcat(dst, "/");
+        }
+        strncat(dst, part, len);
+    }
+    return(*dst ? 1 : 0);
+}
+
+/* Add the directories above a path which the archive doesn't list */
+static int tar_parent_paths(const char *dst, loki_patch *patch)
+{
+    char path[PATH_MAX];
+    char *slash;
+
+    strcpy(path, dst);
+    for ( slash=strchr(path, '/'); slash; slash=strchr(slash+1, '/') ) {
+        *slash = '\0';
+        if ( !index_find(patch, OP_ADD_PATH, path) &&
+             !new_add_path(path, S_IFDIR|0755, patch) ) {
+            return(-1);
+        }
+        *slash = '/';
+    }
+    return(0);
+}
+
+/* Compress the data of a tar entry into the patch, checksumming it on
+   the way through */
+static int pack_tar_data(struct tar_reader *tar, const char *pat_path,
+                         char *sum)
+{
+    gzFile pat_zfp;
+    struct loki_md5 *md5;
+    int len;
+    char data[4096];
+
+    md5 = loki_md5_begin();
+    if ( ! md5 ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    pat_zfp = gzopen(pat_path, "wb9");
+    if ( pat_zfp == NULL ) {
+        logme(LOG_ERROR, "Unable to open %s\n", pat_path);
+        loki_md5_end(md5, sum);
+        return(-1);
+    }
+    while ( (len=tar_read(tar, data, sizeof(data))) > 0 ) {
+        loki_md5_update(md5, data, len);
+        if ( gzwrite(pat_zfp, data, len) != len ) {
+            logme(LOG_ERROR, "Error writing patch data: %s\n", strerror(errno));
+            len = -1;
+            break;
+        }
+    }
+    loki_md5_end(md5, sum);
+    if ( gzclose(pat_zfp) != Z_OK ) {
+        logme(LOG_ERROR, "Error writing patch data: %s\n", strerror(errno));
+        len = -1;
+    }
+    return(len);
+}
+
+/* Add a file from a tar archive, sharing data already in the patch */
+static int tar_add_file(struct tar_reader *tar, struct tar_entry *entry,
+                        const char *dst, const char *tmp_path,
+                        loki_patch *patch)
+{
+    struct pending_file file;
+    struct op_add_file *op;
+    struct stat sb;
+    char link[PATH_MAX];
+    int retval;
+
+    memset(&file, 0, (sizeof file));
+    memset(&sb, 0, (sizeof sb));
+    sb.st_mode = S_IFREG|entry->mode;
+    sb.st_size = entry->size;
+
+    /* A hard link is another copy of a file earlier in the archive */
+    if ( entry->type == TAR_HARDLINK ) {
+        if ( tar_entry_path(entry->link, link) <= 0 ) {
+            op = NULL;
+        } else {
+            op = (struct op_add_file *)index_find(patch, OP_ADD_FILE, link);
+        }
+        if ( ! op ) {
+            logme(LOG_ERROR, "Hard link %s to %s, which isn't in the archive\n",
+                                                        dst, entry->link);
+            return(-1);
+        }
+        sb.st_size = op->size;
+        strcpy(file.newsum, op->sum);
+    } else {
+        if ( pack_tar_data(tar, tmp_path, file.newsum) < 0 ) {
+            unlink(tmp_path);
+            return(-1);
+        }
+
+        /* Gzipped data is checksummed uncompressed, from a copy of it */
+        if ( ! *file.newsum ) {
+            char raw_path[PATH_MAX];
+
+            if ( temp_file(raw_path) < 0 ) {
+                unlink(tmp_path);
+                return(-1);
+            }
+            if ( unpack_file_data(tmp_path, raw_path) < 0 ) {
+                unlink(raw_path);
+                unlink(tmp_path);
+                return(-1);
+            }
+            md5_compute(raw_path, file.newsum, 1);
+            unlink(raw_path);
+        }
+    }
+
+    file.add = new_add_file(dst, &sb, patch);
+    if ( ! file.add ) {
+        return(-1);
+    }
+    retval = merge_add_file(&file, patch);
+    if ( file.pat_path ) {
+        if ( (retval == 0) && (rename(tmp_path, file.pat_path) < 0) ) {
+            logme(LOG_ERROR, "Unable to rename %s to %s: %s\n",
+                                tmp_path, file.pat_path, strerror(errno));
+            retval = -1;
+        }
+        free(file.pat_path);
+    }
+    return(retval);
+}
+
+/* Add a set of files and directories from a UNIX tar file, which may
+   be gzipped.  The data goes straight from the archive into the patch.
+ */
+int tree_tarfile(const char *tarfile, loki_patch *patch)
+{
+    struct tar_reader *tar;
+    struct tar_entry entry;
+    struct op_add_path *op;
+    char dst[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    int temp, status, retval;
+
+    tar = tar_open(tarfile);
+    if ( ! tar ) {
+        return(-1);
+    }
+    temp = open_temp_dir(patch);
+    if ( (temp < 0) || (temp_file(tmp_path) < 0) ) {
+        close_temp_dir(temp);
+        tar_close(tar);
+        return(-1);
+    }
+
+    retval = 0;
+    while ( (status=tar_next(tar, &entry)) > 0 ) {
+        status = tar_entry_path(entry.name, dst);
+        if ( status == 0 ) {
+            continue;
+        }
+        if ( status < 0 ) {
+            logme(LOG_ERROR, "%s in %s is outside the tree\n",
+                                                    entry.name, tarfile);
+            retval = -1;
+            break;
+        }
+        if ( tar_parent_paths(dst, patch) < 0 ) {
+            retval = -1;
+            break;
+        }
+        switch (entry.type) {
+            case TAR_DIRECTORY:
+                /* It may already be there as the parent of a file */
+                op = (struct op_add_path *)index_find(patch, OP_ADD_PATH, dst);
+                if ( op ) {
+                    op->mode = S_IFDIR|entry.mode;
+                } else
+                if ( ! new_add_path(dst, S_IFDIR|entry.mode, patch) ) {
+                    retval = -1;
+                }
+                break;
+            case TAR_SYMLINK:
+                retval = tree_symlink_file(entry.link, dst, patch);
+                break;
+            case TAR_FILE:
+            case TAR_HARDLINK:
+                retval = tar_add_file(tar, &entry, dst, tmp_path, patch);
+                break;
+            default:
+                logme(LOG_WARNING, "Skipping %s, it isn't a file\n", dst);
+                break;
+        }
+        if ( retval < 0 ) {
+            break;
+        }
+    }
+    if ( status < 0 ) {
+        retval = -1;
+    }
+    unlink(tmp_path);
+    close_temp_dir(temp);
+    tar_close(tar);
+
+    return(retval);
+}
+
+/* Merging a later patch into this one, so that the result does the work
+   of both in a single pass over the install.  The operations of the
+   later patch are combined with whatever this patch already does to the
+   same paths, and deltas of successive versions of a file are chained
+   together.  A delta for a file which this patch adds whole is applied
+   to its data here instead, since there's no old version to chain from.
+ */
+
+/* See if a path or a directory above it is removed by the patch */
+static int is_deleted(const char *dst, loki_patch *patch)
+{
+    char path[PATH_MAX];
+    char *slash;
+
+    strcpy(path, dst);
+    do {
+        if ( is_in_patch(OP_DEL_PATH, path, patch) ) {
+            return(1);
+        }
+        slash = strrchr(path, '/');
+        if ( slash ) {
+            *slash = '\0';
+        }
+    } while ( slash );
+    return(0);
+}
+
+static int in_tree(const char *path, const char *dst)
+{
+    int len = strlen(dst);
+
+    return((strncmp(path, dst, len) == 0) &&
+           ((path[len] == '\0') || (path[len] == '/')));
+}
+
+/* Remove everything the patch does at or below a path */
+static void remove_tree(const char *dst, loki_patch *patch)
+{
+    { struct op_add_path *elem;
+        while ( index_count_tree(patch, OP_ADD_PATH, dst) ) {
+            for ( elem=patch->add_path_list; elem; elem=elem->next ) {
+                if ( in_tree(elem->dst, dst) ) {
+                    break;
+                }
+            }
+            if ( ! elem ) {
+                break;
+            }
+            remove_path(OP_ADD_PATH, elem->dst, patch);
+        }
+    }
+    { struct op_add_file *elem;
+        while ( index_count_tree(patch, OP_ADD_FILE, dst) ) {
+            for ( elem=patch->add_file_list; elem; elem=elem->next ) {
+                if ( in_tree(elem->dst, dst) ) {
+                    break;
+                }
+            }
+            if ( ! elem ) {
+                break;
+            }
+            remove_path(OP_ADD_FILE, elem->dst, patch);
+        }
+    }
+    { struct op_patch_file *elem;
+        while ( index_count_tree(patch, OP_PATCH_FILE, dst) ) {
+            for ( elem=patch->patch_file_list; elem; elem=elem->next ) {
+                if ( in_tree(elem->dst, dst) ) {
+                    break;
+                }
+            }
+            if ( ! elem ) {
+                break;
+            }
+            remove_path(OP_PATCH_FILE, elem->dst, patch);
+        }
+    }
+    { struct op_symlink_file *elem;
+        while ( index_count_tree(patch, OP_SYMLINK_FILE, dst) ) {
+            for ( elem=patch->symlink_file_list; elem; elem=elem->next ) {
+                if ( in_tree(elem->dst, dst) ) {
+                    break;
+                }
+            }
+            if ( ! elem ) {
+                break;
+            }
+            remove_path(OP_SYMLINK_FILE, elem->dst, patch);
+        }
+    }
+    { struct op_del_file *elem;
+        while ( index_count_tree(patch, OP_DEL_FILE, dst) ) {
+            for ( elem=patch->del_file_list; elem; elem=elem->next ) {
+                if ( in_tree(elem->dst, dst) ) {
+                    break;
+                }
+            }
+            if ( ! elem ) {
+                break;
+            }
+            remove_path(OP_DEL_FILE, elem->dst, patch);
+        }
+    }
+    { struct op_del_path *elem;
+        while ( index_count_tree(patch, OP_DEL_PATH, dst) ) {
+            for ( elem=patch->del_path_list; elem; elem=elem->next ) {
+                if ( in_tree(elem->dst, dst) ) {
+                    break;
+                }
+            }
+            if ( ! elem ) {
+                break;
+            }
+            remove_path(OP_DEL_PATH, elem->dst, patch);
+        }
+    }
+}
+
+/* Copy a data file from one patch directory to another, as it is */
+static int copy_patch_data(const char *path, const char *pat_path)
+{
+    FILE *src_fp, *dst_fp;
+    int len;
+    char data[4096];
+
+    src_fp = fopen(path, "rb");
+    if ( src_fp == NULL ) {
+        logme(LOG_ERROR, "Unable to open %s\n", path);
+        return(-1);
+    }
+    dst_fp = fopen(pat_path, "wb");
+    if ( dst_fp == NULL ) {
+        logme(LOG_ERROR, "Unable to open %s\n", pat_path);
+        fclose(src_fp);
+        return(-1);
+    }
+    while ( (len=fread(data, 1, sizeof(data), src_fp)) > 0 ) {
+        if ( fwrite(data, 1, len, dst_fp) != len ) {
+            logme(LOG_ERROR, "Error writing patch data: %s\n", strerror(errno));
+            fclose(src_fp);
+            fclose(dst_fp);
+            return(-1);
+        }
+    }
+    fclose(src_fp);
+    if ( fclose(dst_fp) != 0 ) {
+        logme(LOG_ERROR, "Error writing patch data: %s\n", strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+/* Uncompress the data of an added file */
+static int unpack_file_data(const char *pat_path, const char *path)
+{
+    gzFile pat_zfp;
+    FILE *dst_fp;
+    int len;
+    char data[4096];
+
+    pat_zfp = gzopen(pat_path, "rb");
+    if ( pat_zfp == NULL ) {
+        logme(LOG_ERROR, "Unable to open %s\n", pat_path);
+        return(-1);
+    }
+    dst_fp = fopen(path, "wb");
+    if ( dst_fp == NULL ) {
+        logme(LOG_ERROR, "Unable to open %s\n", path);
+        gzclose(pat_zfp);
+        return(-1);
+    }
+    while ( (len=gzread(pat_zfp, data, sizeof(data))) > 0 ) {
+        if ( fwrite(data, 1, len, dst_fp) != len ) {
+            logme(LOG_ERROR, "Error writing %s: %s\n", path, strerror(errno));
+            gzclose(pat_zfp);
+            fclose(dst_fp);
+            return(-1);
+        }
+    }
+    gzclose(pat_zfp);
+    if ( (fclose(dst_fp) != 0) || (len < 0) ) {
+        logme(LOG_ERROR, "Unable to uncompress %s\n", pat_path);
+        return(-1);
+    }
+    return(0);
+}
+
+/* Add a file with the given data and checksum, copied from a later patch
+   or made here, unless the patch already holds the same data */
+static int merge_file_data(const char *dst, const char *path, int packed,
+                           const char *sum, long mode, loki_patch *patch)
+{
+    struct pending_file file;
+    struct stat sb;
+    int retval;
+
+    if ( stat(path, &sb) < 0 ) {
+        logme(LOG_ERROR, "Unable to stat %s\n", path);
+        return(-1);
+    }
+    sb.st_mode = mode;
+    memset(&file, 0, (sizeof file));
+    strcpy(file.newsum, sum);
+    file.add = new_add_file(dst, &sb, patch);
+    if ( ! file.add ) {
+        return(-1);
+    }
+    retval = merge_add_file(&file, patch);
+    if ( file.pat_path ) {
+        if ( retval == 0 ) {
+            if ( packed ) {
+                retval = copy_patch_data(path, file.pat_path);
+            } else {
+                retval = copy_file_data(path, file.pat_path);
+            }
+        }
+        free(file.pat_path);
+    }
+    return(retval);
+}
+
+static struct delta_option *find_option(struct op_patch_file *op,
+                                        const char *oldsum, const char *from)
+{
+    struct delta_option *option;
+
+    for ( option=op->options; option; option=option->next ) {
+        if ( (strcmp(option->oldsum, oldsum) == 0) &&
+             (from ? (option->from && strcmp(option->from, from) == 0)
+                   : !option->from) ) {
+            break;
+        }
+    }
+    return(option);
+}
+
+/* Take an option out of a patched file, along with its delta if nothing
+   else uses it */
+static void remove_option(struct op_patch_file *op,
+                          struct delta_option *option, loki_patch *patch)
+{
+    struct delta_option **link;
+    char path[PATH_MAX];
+
+    for ( link=&op->options; *link; link=&(*link)->next ) {
+        if ( *link == option ) {
+            *link = option->next;
+            break;
+        }
+    }
+    if ( ! payload_release(patch, option->src) ) {
+        sprintf(path, "%s/%s", patch->base, option->src);
+        unlink(path);
+    }
+}
+
+/* Copy a delta option from a later patch */
+static int merge_option(struct op_patch_file *op, struct delta_option *delta,
+                        loki_patch *later, loki_patch *patch)
+{
+    struct delta_option *option, *here;
+    char path[PATH_MAX];
+    char pat_path[PATH_MAX];
+
+    option = (struct delta_option *)patch_alloc(patch, sizeof *option);
+    if ( ! option ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    if ( op->options ) {
+        for ( here=op->options; here->next; here=here->next )
+            ;
+        here->next = option;
+    } else {
+        op->options = option;
+    }
+    strcpy(option->oldsum, delta->oldsum);
+    strcpy(option->newsum, delta->newsum);
+    option->segment = delta->segment;
+    option->whole = delta->whole;
+    if ( delta->from ) {
+        option->from = patch_strdup(patch, delta->from);
+        if ( ! option->from ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+    }
+
+    /* The same change may have been made to another file already */
+    option->src = (char *)payload_find(patch, option->oldsum, option->newsum);
+    if ( option->src ) {
+        logme(LOG_VERBOSE, "-> PATCH FILE %s shares delta with %s\n",
+                                                    op->dst, option->src);
+        option->whole = payload_whole(patch, option->src);
+        option->segment = payload_segment(patch, option->src);
+        return payload_add(patch, option->oldsum, option->newsum, option->src);
+    }
+    if ( reserve_delta(op->dst, pat_path, patch) < 0 ) {
+        return(-1);
+    }
+    option->src = patch_strdup(patch, pat_path+strlen(patch->base)+1);
+    if ( ! option->src ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    sprintf(path, "%s/%s", later->base, delta->src);
+    if ( copy_patch_data(path, pat_path) < 0 ) {
+        return(-1);
+    }
+    if ( payload_add(patch, option->oldsum, option->newsum, option->src) < 0 ) {
+        return(-1);
+    }
+    if ( option->whole ) {
+        payload_set_whole(patch, option->src);
+    } else {
+        payload_set_segment(patch, option->src, option->segment);
+    }
+    return(0);
+}
+
+/* Apply a delta from a later patch, and any chained on to it, to the
+   data of a file added by this patch, and add the result instead */
+static int rebuild_file(struct op_patch_file *op, struct delta_option *delta,
+                        struct op_add_file *add, loki_patch *later,
+                        loki_patch *patch)
+{
+    char src_path[PATH_MAX];
+    char old_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    char csum[CHECKSUM_SIZE+1];
+    struct delta_option *next;
+    int steps, temp, retval;
+
+    logme(LOG_VERBOSE, "-> PATCH FILE %s applied to ADD FILE %s\n",
+                                                    op->dst, add->dst);
+
+    /* The versions along the way are temporary files */
+    temp = open_temp_dir(patch);
+    if ( (temp < 0) || (temp_file(old_path) < 0) ) {
+        close_temp_dir(temp);
+        return(-1);
+    }
+    sprintf(src_path, "%s/%s", patch->base, add->src);
+    if ( unpack_file_data(src_path, old_path) < 0 ) {
+        unlink(old_path);
+        close_temp_dir(temp);
+        return(-1);
+    }
+    retval = 0;
+    for ( steps=0; delta; ++steps ) {
+        if ( steps == MAX_DELTA_CHAIN ) {
+            logme(LOG_ERROR, "Delta chain too long for %s\n", op->dst);
+            retval = -1;
+            break;
+        }
+        sprintf(src_path, "%s/%s", later->base, delta->src);
+        if ( temp_file(new_path) < 0 ) {
+            retval = -1;
+            break;
+        }
+        if ( delta->whole ) {
+            retval = unpack_file_data(src_path, new_path);
+        } else
+        if ( delta->segment ) {
+            retval = loki_xpatch_segments(src_path, old_path, new_path, csum);
+        } else {
+            retval = loki_xpatch(src_path, old_path, new_path);
+        }
+        unlink(old_path);
+        strcpy(old_path, new_path);
+        if ( retval < 0 ) {
+            logme(LOG_ERROR, "Failed patch delta on %s\n", op->dst);
+            break;
+        }
+        if ( ! delta->segment || ! *csum ) {
+            md5_compute(new_path, csum, 1);
+        }
+        if ( strcmp(delta->newsum, csum) != 0 ) {
+            logme(LOG_ERROR, "Failed checksum: %s\n", op->dst);
+            retval = -1;
+            break;
+        }
+        for ( next=op->options; next; next=next->next ) {
+            if ( !next->from && (strcmp(next->oldsum, delta->newsum) == 0) ) {
+                break;
+            }
+        }
+        delta = next;
+    }
+    if ( retval == 0 ) {
+        retval = merge_file_data(op->dst, old_path, 0, csum, op->mode, patch);
+    }
+    unlink(old_path);
+    close_temp_dir(temp);
+    return(retval);
+}
+
+static int merge_add_path(struct op_add_path *op, loki_patch *patch)
+{
+    struct op_add_path *add;
+
+    logme(LOG_VERBOSE, "-> ADD PATH %s\n", op->dst);
+
+    /* The directory may have been made by this patch already */
+    add = (struct op_add_path *)index_find(patch, OP_ADD_PATH, op->dst);
+    if ( add ) {
+        add->mode = op->mode;
+        return(0);
+    }
+    if ( is_deleted(op->dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is removed and made again\n", op->dst);
+        return(-1);
+    }
+    if ( is_in_patch(OP_NONE, op->dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is already in patch\n", op->dst);
+        return(-1);
+    }
+
+    /* Allocate memory for the operation */
+    add = (struct op_add_path *)patch_alloc(patch, sizeof *add);
+    if ( add ) {
+        add->dst = patch_strdup(patch, op->dst);
+    }
+    if ( !add || !add->dst ) {
+        logme(LOG_ERROR, "Out of memory\n");
+        return(-1);
+    }
+    add->mode = op->mode;
+
+    /* Directories are made in the order they were listed */
+    if ( patch->add_path_tail ) {
+        patch->add_path_tail->next = add;
+    } else {
+        patch->add_path_list = add;
+    }
+    patch->add_path_tail = add;
+    return index_add_path(patch, OP_ADD_PATH, op->dst, add);
+}
+
+static int merge_later_add(struct op_add_file *op, loki_patch *later,
+                           loki_patch *patch)
+{
+    char path[PATH_MAX];
+
+    if ( is_deleted(op->dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is removed and made again\n", op->dst);
+        return(-1);
+    }
+    remove_path(OP_DEL_FILE, op->dst, patch);
+    sprintf(path, "%s/%s", later->base, op->src);
+    return merge_file_data(op->dst, path, 1, op->sum, op->mode, patch);
+}
+
+static int merge_later_patch(struct op_patch_file *op, loki_patch *later,
+                             loki_patch *patch)
+{
+    struct op_patch_file *mine;
+    struct op_add_file *add;
+    struct delta_option *delta, *option, *next;
+    int is_last;
+
+    /* The file has to be there for the later patch to change it */
+    if ( is_deleted(op->dst, patch) ||
+         is_in_patch(OP_ADD_PATH, op->dst, patch) ||
+         is_in_patch(OP_DEL_FILE, op->dst, patch) ||
+         is_in_patch(OP_SYMLINK_FILE, op->dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is already in patch\n", op->dst);
+        return(-1);
+    }
+
+    /* A file added whole by this patch is added at its new version */
+    add = (struct op_add_file *)index_find(patch, OP_ADD_FILE, op->dst);
+    if ( add ) {
+        delta = find_option(op, add->sum, NULL);
+        if ( delta ) {
+            return rebuild_file(op, delta, add, later, patch);
+        }
+        for ( delta=op->options; delta; delta=delta->next ) {
+            if ( strcmp(delta->newsum, add->sum) == 0 ) {
+                return(0);
+            }
+        }
+        if ( op->optional ) {
+            return(0);
+        }
+        logme(LOG_ERROR, "No delta for %s as added by the earlier patch\n",
+                                                                op->dst);
+        return(-1);
+    }
+
+    /* A file copied from one this patch changes can't be patched from
+       the installed copy of that, unless the change adds it whole */
+    for ( delta=op->options; delta; delta=delta->next ) {
+        if ( !delta->from ||
+             !is_in_patch(OP_NONE, delta->from, patch) ) {
+            continue;
+        }
+        add = (struct op_add_file *)index_find(patch, OP_ADD_FILE,
+                                               delta->from);
+        if ( add && (strcmp(add->sum, delta->oldsum) == 0) ) {
+            return rebuild_file(op, delta, add, later, patch);
+        }
+        logme(LOG_ERROR, "PATCH FILE %s from %s, which is already in patch\n",
+                                                    op->dst, delta->from);
+        return(-1);
+    }
+
+    logme(LOG_VERBOSE, "-> PATCH FILE %s\n", op->dst);
+
+    mine = (struct op_patch_file *)index_find(patch, OP_PATCH_FILE, op->dst);
+    if ( mine ) {
+        /* Versions the later patch starts from go straight to its new
+           version, and ones it makes aren't patched any further */
+        for ( delta=op->options; delta; delta=delta->next ) {
+            option = find_option(mine, delta->oldsum, delta->from);
+            if ( option ) {
+                remove_option(mine, option, patch);
+            }
+            is_last = 1;
+            for ( next=op->options; next; next=next->next ) {
+                if ( !next->from &&
+                     (strcmp(next->oldsum, delta->newsum) == 0) ) {
+                    is_last = 0;
+                }
+            }
+            option = find_option(mine, delta->newsum, NULL);
+            if ( is_last && option ) {
+                remove_option(mine, option, patch);
+            }
+        }
+        if ( mine->size < op->size ) {
+            mine->size = op->size;
+        }
+        mine->optional = (mine->optional && op->optional);
+    } else {
+        mine = (struct op_patch_file *)patch_alloc(patch, sizeof *mine);
+        if ( mine ) {
+            mine->dst = patch_strdup(patch, op->dst);
+        }
+        if ( !mine || !mine->dst ) {
+            logme(LOG_ERROR, "Out of memory\n");
+            return(-1);
+        }
+        mine->size = op->size;
+        mine->optional = op->optional;
+        if ( patch->patch_file_tail ) {
+            patch->patch_file_tail->next = mine;
+        } else {
+            patch->patch_file_list = mine;
+        }
+        patch->patch_file_tail = mine;
+        if ( index_add_path(patch, OP_PATCH_FILE, op->dst, mine) < 0 ) {
+            return(-1);
+        }
+    }
+    mine->mode = op->mode;
+
+    /* Deltas from the versions this patch makes chain on to its own */
+    for ( delta=op->options; delta; delta=delta->next ) {
+        if ( merge_option(mine, delta, later, patch) < 0 ) {
+            return(-1);
+        }
+    }
+    return(0);
+}
+
+static int merge_symlink_file(struct op_symlink_file *op, loki_patch *patch)
+{
+    if ( is_deleted(op->dst, patch) ) {
+        logme(LOG_ERROR, "Path %s is removed and made again\n", op->dst);
+        return(-1);
+    }
+    remove_path(OP_DEL_FILE, op->dst, patch);
+    remove_path(OP_PATCH_FILE, op->dst, patch);
+    return tree_symlink_file(op->link, op->dst, patch);
+}
+
+static int merge_del_file(struct op_del_file *op, loki_patch *patch)
+{
+    remove_path(OP_ADD_FILE, op->dst, patch);
+    remove_path(OP_PATCH_FILE, op->dst, patch);
+    remove_path(OP_SYMLINK_FILE, op->dst, patch);
+    return tree_del_file(op->dst, patch);
+}
+
+static int merge_del_path(struct op_del_path *op, loki_patch *patch)
+{
+    remove_tree(op->dst, patch);
+    return tree_del_path(op->dst, patch);
+}
+
+/* Merge a later patch into this one */
+int tree_merge_patch(const char *patchfile, loki_patch *patch)
+{
+    loki_patch *later;
+    char path[PATH_MAX];
+    struct stat sb;
+    int status;
+
+    /* The patch can be given by its directory */
+    if ( (stat(patchfile, &sb) == 0) && S_ISDIR(sb.st_mode) ) {
+        sprintf(path, "%s/patch.dat", patchfile);
+    } else {
+        strcpy(path, patchfile);
+    }
+    later = load_patch(path);
+    if ( ! later ) {
+        return(-1);
+    }
+
+    /* Go through the operations in the order they are applied */
+    status = 0;
+    { struct op_add_path *op;
+        for ( op=later->add_path_list; op; op=op->next ) {
+            if ( merge_add_path(op, patch) < 0 ) {
+                --status;
+            }
+        }
+    }
+    { struct op_add_file *op;
+        for ( op=later->add_file_list; op; op=op->next ) {
+            if ( merge_later_add(op, later, patch) < 0 ) {
+                --status;
+            }
+        }
+    }
+    { struct op_patch_file *op;
+        for ( op=later->patch_file_list; op; op=op->next ) {
+            if ( merge_later_patch(op, later, patch) < 0 ) {
+                --status;
+            }
+        }
+    }
+    { struct op_symlink_file *op;
+        for ( op=later->symlink_file_list; op; op=op->next ) {
+            if ( merge_symlink_file(op, patch) < 0 ) {
+                --status;
+            }
+        }
+    }
+    { struct op_del_file *op;
+        for ( op=later->del_file_list; op; op=op->next ) {
+            if ( merge_del_file(op, patch) < 0 ) {
+                --status;
+            }
+        }
+    }
+    { struct op_del_path *op;
+        for ( op=later->del_path_list; op; op=op->next ) {
+            if ( merge_del_path(op, patch) < 0 ) {
+                --status;
+            }
+        }
+    }
+    free_patch(later);
+    return(status);
+}
@@ -1,7 +1,33 @@
 
+/* Set the number of files which may be compressed or diffed at once */
+extern void set_tree_jobs(int jobs);
+
+/* Files larger than this are diffed a segment of this size at a time */
+#define DEFAULT_SEGMENT_SIZE    (1024*1024*1024)
+extern void set_tree_segment_size(long size);
+
+/* The xdelta query size for each class of file by size, given as a list
+   of query sizes, each but the first with the size of the smallest file
+   it's for, e.g. "16 32@1M 64@64M".  These are kept in the patch header,
+   and can be picked by trying them on some of the files first.
+ */
+#define QUERY_SIZE_FIELD        "Querysize"
+extern int set_tree_query_size(const char *spec);
+extern void set_tree_query_auto(int tune);
+
+/* Patch each old version of a file to the version patched before it,
+   rather than straight to the new version */
+extern void set_tree_chain(int chain);
+
 /* Create a recursive patch between the two trees of files */
 extern int tree_patch(const char *o_top, const char *o_path,
                       const char *n_top, const char *n_path, loki_patch *patch);
+
+/* Create a patch from each of the old trees to the new one, walking them
+   all at once so the new tree is only read once.  When chaining, list
+   the old trees newest first. */
+extern int tree_patch_versions(const char *o_tops[], int count,
+                               const char *n_top, loki_patch *patch);
 extern int tree_add_file(const char *path, const char *dst, loki_patch *patch);
 extern int tree_add_path(const char *path, const char *dst, loki_patch *patch);
 extern int tree_patch_file(const char *o_path, const char *n_path,
@@ -10,3 +36,7 @@ extern int tree_symlink_file(const char *link, const char *dst, loki_patch *patc
 extern int tree_del_path(const char *dst, loki_patch *patch);
 extern int tree_del_file(const char *dst, loki_patch *patch);
 extern int tree_tarfile(const char *tarfile, loki_patch *patch);
+
+/* Merge a later patch into this one, which then updates installs from
+   before either of them in one pass */
+extern int tree_merge_patch(const char *patchfile, loki_patch *patch);
@@ -82,7 +82,8 @@ extern const guint xdelta_micro_version;
  * large files, try undefining this (and using the -s argument to
  * Xdelta).
  */
-#define XDELTA_HARDCODE_SIZE
+/* loki_patch picks the query size for each file, so it's left unset */
+/* #define XDELTA_HARDCODE_SIZE */
 
 #ifdef XDELTA_HARDCODE_SIZE
 #define QUERY_SIZE          QUERY_SIZE_DEFAULT